@@ -1,11 +1,26 @@
 #include "bamliquidator.h"
 
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <samtools/sam.h>
+#include <zlib.h>
 
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
 #include <deque>
+#include <limits>
+#include <mutex>
 #include <stdexcept>
 #include <sstream>
+#include <thread>
+#include <unordered_map>
 
 /* The MIT License (MIT) 
 
@@ -30,200 +45,2089 @@
    THE SOFTWARE. 
  */
 
-struct ReadItem
+int intMax(int a, int b)
+{
+  if(a > b) return a;
+  return b;
+}
+
+// The parts of a read that liquidating uses, decoded once per read.  Reads are fetched as
+// ReadRecords instead of bam1_ts, so that the name, sequence, qualities and tags of a read
+// are skipped without being copied or decoded, and its cigar is walked only once.
+struct ReadRecord
 {
-  unsigned int start;
-  /* read stop is start + strlen(seq)
-  this *stop* will only be used for computing density
-  will not be reported to js for bed plotting
-  the actual stop need to be determined by cigar
-  */
-  unsigned int stop;
-  uint32_t flag; // flag from bam
-  char strand;
-  std::vector<uint32_t> cigar;
+  int32_t tid;
+  int32_t pos;
+  uint16_t flag;
+  uint16_t n_cigar;
+  // the number of reference positions the read covers: the length of its cigar's match,
+  // deletion and skip operations
+  unsigned int length;
+  // the end of the read as bam_fetch sees it: bam_calend, or pos + 1 without a cigar
+  unsigned int fetch_end;
 };
 
+// called by fetch on every read overlapping the fetched region
+typedef void (*fetch_f)(const ReadRecord& read, void* data);
 
-int intMin(int a, int b)
+// sets the read's length and fetch_end from its n_cigar operations, which may be unaligned
+static inline void decode_cigar(ReadRecord& read, const uint8_t* cigar)
 {
-  if(a < b) return a;
-  return b;
+  unsigned int length = 0;
+  // bam_calend adds the same operations as length, except that some samtools versions also
+  // add = and X, or go back for B, so it is only called for reads with those operations
+  bool same_end = true;
+  for (uint16_t i = 0; i < read.n_cigar; ++i)
+  {
+    uint32_t operation;
+    memcpy(&operation, cigar + i*sizeof(operation), sizeof(operation));
+    const uint32_t op = operation & 0xf;
+    if (op == BAM_CMATCH || op == BAM_CDEL || op == BAM_CREF_SKIP)
+    {
+      length += operation >> 4;
+    }
+    else if (op > 6)
+    {
+      same_end = false;
+    }
+  }
+
+  read.length = length;
+  if (read.n_cigar == 0)
+  {
+    read.fetch_end = read.pos + 1;
+  }
+  else if (same_end)
+  {
+    read.fetch_end = read.pos + length;
+  }
+  else
+  {
+    bam1_core_t core;
+    memset(&core, 0, sizeof(core));
+    core.pos = read.pos;
+    core.n_cigar = read.n_cigar;
+    std::vector<uint32_t> operations(read.n_cigar);
+    memcpy(operations.data(), cigar, operations.size()*sizeof(uint32_t));
+    read.fetch_end = bam_calend(&core, operations.data());
+  }
 }
 
-int intMax(int a, int b)
+static inline ReadRecord read_record(const bam1_t* b)
 {
-  if(a > b) return a;
-  return b;
+  ReadRecord read;
+  read.tid = b->core.tid;
+  read.pos = b->core.pos;
+  read.flag = b->core.flag;
+  read.n_cigar = b->core.n_cigar;
+  decode_cigar(read, (const uint8_t*) bam1_cigar(b));
+  return read;
+}
+
+/* Sets [start, stop) to the reference positions a read at pos covering readlen positions
+   is counted on: the read is extended by extendlen in the direction of its strand.
+   Returns false if the read is excluded because it isn't on the requested strand ('+' or
+   '-').
+*/
+static inline bool read_span(char read_strand, unsigned int pos, unsigned int readlen,
+                             char strand, unsigned int extendlen,
+                             unsigned int& start, unsigned int& stop)
+{
+  if((strand=='+' || strand=='-') && strand!=read_strand) return false;
+
+  start=pos;
+  stop=pos+readlen;
+
+  // extend
+  if(extendlen>0)
+  {
+    if(read_strand=='+')
+    {
+      stop+=extendlen;
+    }
+    else
+    {
+      start=intMax(0,start-extendlen);
+    }
+  }
+
+  return true;
+}
+
+static inline char read_strand(const ReadRecord& read)
+{
+  return (read.flag&BAM_FREVERSE)?'-':'+';
+}
+
+static inline bool read_span(const ReadRecord& read, char strand, unsigned int extendlen,
+                             unsigned int& start, unsigned int& stop)
+{
+  return read_span(read_strand(read), read.pos, read.length, strand, extendlen, start, stop);
 }
 
+// The same as above, except that the requested strand ('+', '-', or '.' for both) and
+// whether reads are extended are template parameters, so the counting kernels below that
+// call this don't branch on them for every read.
+template <char Strand, bool Extended>
+static inline bool read_span(const ReadRecord& read, unsigned int extendlen,
+                             unsigned int& start, unsigned int& stop)
+{
+  const bool reverse = (read.flag&BAM_FREVERSE) != 0;
+  if ((Strand == '+' && reverse) || (Strand == '-' && !reverse)) return false;
+
+  start=read.pos;
+  stop=read.pos+read.length;
+
+  if(Extended)
+  {
+    if(Strand == '+' || (Strand == '.' && !reverse))
+    {
+      stop+=extendlen;
+    }
+    else
+    {
+      start=intMax(0,start-extendlen);
+    }
+  }
+
+  return true;
+}
 
+// Returns Kernel<Strand, Extended>::count for the strand and extension length of a fetch, so
+// that they are dispatched on once per fetch instead of once per read.  Like read_span, any
+// strand besides '+' and '-' counts both strands.
+template <template <char, bool> class Kernel>
+static fetch_f choose_kernel(char strand, unsigned int extendlen)
+{
+  switch (strand)
+  {
+    case '+':
+      return extendlen > 0 ? Kernel<'+', true>::count : Kernel<'+', false>::count;
+    case '-':
+      return extendlen > 0 ? Kernel<'-', true>::count : Kernel<'-', false>::count;
+    default:
+      return extendlen > 0 ? Kernel<'.', true>::count : Kernel<'.', false>::count;
+  }
+}
 
 struct UserData
 {
-  std::deque<ReadItem> readItems;
-  char strand;
+  // summary point i covers [start + i*pieceLength, start + (i+1)*pieceLength)
+  int64_t start;
+  int64_t pieceLength;
+  unsigned int spnum;
+  // partial[i] accumulates the bases of reads that only partially overlap summary
+  // point i, and coverage is a difference array of the number of reads that fully
+  // overlap each summary point, so each read is added in constant time regardless
+  // of how many summary points it spans
+  int64_t* partial;
+  int64_t* coverage;
   unsigned int extendlen;
 };
 
+// Adds the read straight into the summary point counts, so nothing is allocated or kept
+// per read.
+template <char Strand, bool Extended>
+struct SummaryPointsKernel
+{
+  static void count(const ReadRecord& read, void* data)
+  {
+    if (read.tid < 0) return;
+
+    UserData *udata=(UserData *)data;
+
+    unsigned int read_start, read_stop;
+    if (!read_span<Strand, Extended>(read, udata->extendlen, read_start, read_stop)) return;
+
+    const int64_t lo = std::max<int64_t>(read_start, udata->start);
+    const int64_t hi = std::min<int64_t>(read_stop, udata->start + udata->pieceLength*udata->spnum);
+    if (lo >= hi) return;
+
+    // as Charles suggested, add the fraction of the read (overlapping with the bin)
+    // instead of just counting the read
+    const int64_t first = (lo - udata->start) / udata->pieceLength;
+    const int64_t last = (hi - 1 - udata->start) / udata->pieceLength;
+    if (first == last)
+    {
+      udata->partial[first] += hi - lo;
+    }
+    else
+    {
+      udata->partial[first] += udata->start + udata->pieceLength*(first+1) - lo;
+      udata->partial[last] += hi - (udata->start + udata->pieceLength*last);
+      udata->coverage[first+1] += 1;
+      udata->coverage[last] -= 1;
+    }
+  }
+};
+
+// The same as SummaryPointsKernel for a single summary point (e.g. every bin or region
+// liquidated one at a time), where an overlapping read is only ever added to the one count.
+template <char Strand, bool Extended>
+struct SinglePointKernel
+{
+  static void count(const ReadRecord& read, void* data)
+  {
+    if (read.tid < 0) return;
+
+    UserData *udata=(UserData *)data;
 
+    unsigned int read_start, read_stop;
+    if (!read_span<Strand, Extended>(read, udata->extendlen, read_start, read_stop)) return;
 
+    const int64_t lo = std::max<int64_t>(read_start, udata->start);
+    const int64_t hi = std::min<int64_t>(read_stop, udata->start + udata->pieceLength);
+    if (lo < hi)
+    {
+      udata->partial[0] += hi - lo;
+    }
+  }
+};
 
-static int bam_fetch_func(const bam1_t* b,void* data)
+// returns the value of the environment variable, or default_value if it isn't a number
+uint64_t environment_number(const char* name, uint64_t default_value)
 {
-  if (b->core.tid < 0) return 0;
+  const char* value = getenv(name);
+  if (value == NULL || *value < '0' || *value > '9') return default_value;
+  char* end = NULL;
+  const unsigned long long number = strtoull(value, &end, 10);
+  return *end == '\0' ? number : default_value;
+}
 
-  UserData *udata=(UserData *)data;
+namespace
+{
+// the pseudo bin of each reference in a .bai index whose second chunk holds the numbers of
+// mapped and unmapped reads instead of file offsets
+const uint32_t index_metadata_bin = 37450;
 
-  const bam1_core_t* c = &b->core;
+// reads the whole .bai index that bam_index_load would load for the bam file, i.e.
+// mm1s.bam.bai, or else mm1s.bai
+std::vector<char> read_bam_index(const std::string& bam_file_path, std::string& index_path)
+{
+  index_path = bam_file_path + ".bai";
+  FILE* file = fopen(index_path.c_str(), "rb");
+  if (file == NULL && bam_file_path.size() > 4
+      && bam_file_path.compare(bam_file_path.size() - 4, 4, ".bam") == 0)
+  {
+    index_path = bam_file_path.substr(0, bam_file_path.size() - 4) + ".bai";
+    file = fopen(index_path.c_str(), "rb");
+  }
+  if (file == NULL)
+  {
+    throw std::runtime_error("failed to open the index of " + bam_file_path);
+  }
 
-  char strand= (c->flag&BAM_FREVERSE)?'-':'+';
-  if(udata->strand=='+')
+  std::vector<char> data;
+  char block[1 << 16];
+  for (size_t n; (n = fread(block, 1, sizeof(block), file)) > 0; )
   {
-    if(strand!='+') return 0;
+    data.insert(data.end(), block, block + n);
   }
-  else if(udata->strand=='-')
+  const bool failed = ferror(file) != 0;
+  fclose(file);
+  if (failed)
   {
-    if(strand!='-') return 0;
+    throw std::runtime_error("failed to read " + index_path);
   }
+  return data;
+}
+
+// A BGZF block is an 18 byte gzip header whose extra field holds the size of the block, raw
+// deflate data of at most 64 KiB, and an 8 byte footer -- see the SAM/BAM specification.
+const size_t bgzf_header_size = 18;
+const size_t bgzf_footer_size = 8;
+const size_t bgzf_max_block_size = 1 << 16;
+
+// The i/o tunables of the fetches read by a BlockReader, which may be set in the environment
+// (e.g. by bamliquidator_batch.py) for the storage the bam files are on.
+struct ReadAhead
+{
+  // BAMLIQUIDATOR_PARALLEL_FETCH (KiB): fetches that span fewer compressed bytes than this are
+  // left to bam_fetch, since a few blocks are inflated faster than they could be handed to
+  // helper threads (e.g. 0 reads every fetch with a BlockReader, as the tests do)
+  uint64_t parallel_fetch_bytes;
+
+  // BAMLIQUIDATOR_READ_AHEAD_BLOCKS: the most blocks a fetch reads and inflates ahead of the
+  // record it is decoding, i.e. the queue depth of the InflatePool
+  size_t blocks;
+
+  // BAMLIQUIDATOR_READ_SIZE (KiB): the size of each read of compressed blocks
+  size_t read_bytes;
+
+  // BAMLIQUIDATOR_READ_AHEAD (MiB): how far past the blocks read so far a fetch asks the
+  // kernel to read its chunks in the background, or 0 to leave read ahead to the kernel
+  uint64_t hint_bytes;
+};
 
-  ReadItem r;
-  r.strand=strand;
+const ReadAhead& read_ahead()
+{
+  static const ReadAhead settings = {
+    environment_number("BAMLIQUIDATOR_PARALLEL_FETCH", 1024) << 10,
+    environment_number("BAMLIQUIDATOR_READ_AHEAD_BLOCKS", 64),
+    environment_number("BAMLIQUIDATOR_READ_SIZE", 1024) << 10,
+    environment_number("BAMLIQUIDATOR_READ_AHEAD", 32) << 20
+  };
+  return settings;
+}
 
-  uint32_t* cigar = bam1_cigar(b);
+// BAMLIQUIDATOR_MMAP: if not 0, each bam file is mapped into memory once and shared by every
+// Liquidator (see BlockIndex)
+bool map_bam_files()
+{
+  static const bool mapped = environment_number("BAMLIQUIDATOR_MMAP", 0) != 0;
+  return mapped;
+}
+}
 
-  // get read length
-  int i, readlen;
-  if (b->core.tid < 0) return 0;
-  for (i = readlen = 0; i < c->n_cigar; ++i)
+// The bins and linear index of every reference in a .bai index (which samtools keeps private
+// to bam_index_t), and a descriptor of the bam file, which any thread may pread from.  With
+// map_bam_files(), the bam file is also mapped, so that every thread reads and inflates its
+// blocks straight from the same pages of the page cache, and every fetch is read from there.
+struct BlockIndex
+{
+  // a range of virtual file offsets, i.e. the offset of a block in the bam file shifted left
+  // 16 bits plus the offset in the inflated block
+  struct Chunk
   {
-    int op = cigar[i]&0xf;
-    if (op == BAM_CMATCH || op == BAM_CDEL || op == BAM_CREF_SKIP)
-      readlen += cigar[i]>>4;
-  }
+    uint64_t begin;
+    uint64_t end;
+  };
 
-  r.cigar = std::vector<uint32_t>(cigar, cigar+c->n_cigar);
+  struct Reference
+  {
+    std::unordered_map<uint32_t, std::vector<Chunk>> bins;
+    std::vector<uint64_t> intervals;
+  };
 
-  r.start=c->pos;
-  r.stop=c->pos+readlen;
+  BlockIndex(): fd(-1), mapped(nullptr), mapped_size(0) {}
+  BlockIndex(const BlockIndex&) = delete;
+  BlockIndex& operator=(const BlockIndex&) = delete;
+  ~BlockIndex()
+  {
+    if (mapped != nullptr) munmap((void*) mapped, mapped_size);
+    if (fd >= 0) close(fd);
+  }
 
-  //printf("%d\t%d\t%c\t", r.start, r.stop, strand);
+  int fd;
+  // null unless the bam file is mapped
+  const uint8_t* mapped;
+  size_t mapped_size;
+  std::vector<Reference> references;
+};
 
-  // extend
-  if(udata->extendlen>0)
+// returns null if the index isn't a .bai index that can be read, in which case every fetch is
+// left to bam_fetch
+static std::shared_ptr<const BlockIndex> load_block_index(const std::string& bam_file_path)
+{
+  std::shared_ptr<BlockIndex> index(new BlockIndex);
+  try
   {
-    if(strand=='+')
+    std::string index_path;
+    const std::vector<char> data = read_bam_index(bam_file_path, index_path);
+    size_t offset = 0;
+    auto read = [&](void* value, size_t count, size_t size)
+    {
+      if ((data.size() - offset) / size < count)
+      {
+        throw std::runtime_error("truncated bam index " + index_path);
+      }
+      memcpy(value, data.data() + offset, count * size);
+      offset += count * size;
+    };
+
+    char magic[4];
+    int32_t references = 0;
+    read(magic, 1, sizeof(magic));
+    read(&references, 1, sizeof(references));
+    if (memcmp(magic, "BAI\1", sizeof(magic)) != 0 || references < 0)
     {
-      r.stop+=udata->extendlen;
+      return nullptr;
     }
-    else
+    index->references.resize(references);
+    for (BlockIndex::Reference& reference : index->references)
     {
-      r.start=intMax(0,r.start-udata->extendlen);
+      int32_t bins = 0;
+      read(&bins, 1, sizeof(bins));
+      for (int32_t b = 0; b < bins; ++b)
+      {
+        uint32_t bin = 0;
+        int32_t chunks = 0;
+        read(&bin, 1, sizeof(bin));
+        read(&chunks, 1, sizeof(chunks));
+        if (chunks < 0 || (data.size() - offset) / sizeof(BlockIndex::Chunk) < (size_t) chunks)
+        {
+          return nullptr;
+        }
+        std::vector<BlockIndex::Chunk> list(chunks);
+        read(list.data(), list.size(), sizeof(BlockIndex::Chunk));
+        // like bam_index_load, a repeated bin replaces the earlier one
+        reference.bins[bin] = std::move(list);
+      }
+      int32_t intervals = 0;
+      read(&intervals, 1, sizeof(intervals));
+      if (intervals < 0 || (data.size() - offset) / sizeof(uint64_t) < (size_t) intervals)
+      {
+        return nullptr;
+      }
+      reference.intervals.resize(intervals);
+      read(reference.intervals.data(), reference.intervals.size(), sizeof(uint64_t));
     }
   }
+  catch (const std::exception&)
+  {
+    return nullptr;
+  }
 
-  //printf("%d\t%d\n", r.start, r.stop);
+  index->fd = open(bam_file_path.c_str(), O_RDONLY);
+  if (index->fd < 0)
+  {
+    return nullptr;
+  }
 
-  r.flag=c->flag;
-  udata->readItems.push_back(r);
-  return 0;
+  // if the file can't be mapped, it is read with pread instead
+  struct stat st;
+  if (map_bam_files() && !bam_is_be && fstat(index->fd, &st) == 0 && st.st_size > 0)
+  {
+    void* data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, index->fd, 0);
+    if (data != MAP_FAILED)
+    {
+      index->mapped = (const uint8_t*) data;
+      index->mapped_size = st.st_size;
+    }
+  }
+  return index;
 }
 
-std::deque<ReadItem> bamQuery_region(const samfile_t* fp, const bam_index_t* idx, const std::string& coord, char strand, unsigned int extendlen)
+// The chunks that bam_fetch reads for [beg, end) on the reference, found, sorted and merged
+// the same way as bam_iter_query in samtools, so the same reads are visited in the same order.
+static std::vector<BlockIndex::Chunk> query_chunks(const BlockIndex::Reference& reference,
+                                                   uint32_t beg, uint32_t end)
 {
-  // will not fill chromidx
-  int ref,beg,end;
-  int rc = bam_parse_region(fp->header,coord.c_str(),&ref,&beg,&end);
-  if (rc != 0)
+  typedef BlockIndex::Chunk Chunk;
+  std::vector<Chunk> chunks;
+  if (beg >= end) return chunks;
+
+  // reg2bins: the bins at each level of the binning scheme that overlap [beg, end)
+  std::vector<uint32_t> bins(1, 0);
   {
-    std::stringstream error_msg;
-    error_msg << "bam_parse_region failed with return code " << rc;
-    throw std::runtime_error(error_msg.str());
+    const uint32_t last = std::min<uint32_t>(end, 1u << 29) - 1;
+    const uint32_t first_bin[] = {1, 9, 73, 585, 4681};
+    const int shift[] = {26, 23, 20, 17, 14};
+    for (int level = 0; level < 5; ++level)
+    {
+      for (uint32_t k = first_bin[level] + (beg >> shift[level]); k <= first_bin[level] + (last >> shift[level]); ++k)
+      {
+        bins.push_back(k);
+      }
+    }
   }
-  if(ref<0)
+
+  // the linear index gives the smallest offset of a read that may overlap beg
+  uint64_t min_offset = 0;
+  const std::vector<uint64_t>& intervals = reference.intervals;
+  if (!intervals.empty())
+  {
+    const size_t interval = beg >> 14;
+    min_offset = interval >= intervals.size() ? intervals.back() : intervals[interval];
+    if (min_offset == 0)
+    {
+      for (size_t i = std::min(interval, intervals.size()); i > 0; --i)
+      {
+        if (intervals[i-1] != 0)
+        {
+          min_offset = intervals[i-1];
+          break;
+        }
+      }
+    }
+  }
+
+  for (uint32_t bin : bins)
   {
-    return std::deque<ReadItem>();
+    auto it = reference.bins.find(bin);
+    if (it == reference.bins.end()) continue;
+    for (const Chunk& chunk : it->second)
+    {
+      if (chunk.end > min_offset) chunks.push_back(chunk);
+    }
   }
-  UserData d;
-  d.strand=strand;
-  d.extendlen=extendlen;
-  bam_fetch(fp->x.bam,idx,ref,beg,end,&d,bam_fetch_func);
-  return d.readItems;
+  if (chunks.empty()) return chunks;
+
+  std::sort(chunks.begin(), chunks.end(), [](const Chunk& a, const Chunk& b)
+  {
+    return a.begin < b.begin || (a.begin == b.begin && a.end < b.end);
+  });
+  // drop chunks contained in an earlier one
+  size_t l = 0;
+  for (size_t i = 1; i < chunks.size(); ++i)
+  {
+    if (chunks[l].end < chunks[i].end) chunks[++l] = chunks[i];
+  }
+  chunks.resize(l + 1);
+  // resolve overlaps between neighbours
+  for (size_t i = 1; i < chunks.size(); ++i)
+  {
+    if (chunks[i-1].end >= chunks[i].begin) chunks[i-1].end = chunks[i].begin;
+  }
+  // merge neighbours that end and begin in the same block
+  l = 0;
+  for (size_t i = 1; i < chunks.size(); ++i)
+  {
+    if (chunks[l].end >> 16 == chunks[i].begin >> 16) chunks[l].end = chunks[i].end;
+    else chunks[++l] = chunks[i];
+  }
+  chunks.resize(l + 1);
+  return chunks;
 }
 
+namespace
+{
+// Asks the kernel to start reading the blocks of chunks[first] onwards that are between file
+// offsets start and stop, without waiting for them, so that on cold network storage the
+// reads of a fetch are in flight together instead of each waiting for a round trip (or for
+// a mapped bam file, so that the pages are read ahead of the faults on them).
+void advise(const BlockIndex& index, const std::vector<BlockIndex::Chunk>& chunks, size_t first,
+            uint64_t start, uint64_t stop)
+{
+  static const uint64_t page_size = sysconf(_SC_PAGESIZE);
+  for (size_t c = first; c < chunks.size(); ++c)
+  {
+    const uint64_t begin = std::max(start, chunks[c].begin >> 16);
+    if (begin >= stop) break;
+    // a chunk's last block starts at the address its end points into
+    const uint64_t end = std::min(stop, (chunks[c].end >> 16) + bgzf_max_block_size);
+    if (begin < end && index.mapped != nullptr)
+    {
+      const uint64_t page = begin / page_size * page_size;
+      if (page < index.mapped_size)
+      {
+        madvise((void*) (index.mapped + page), std::min<uint64_t>(end, index.mapped_size) - page, MADV_WILLNEED);
+      }
+    }
+    else if (begin < end)
+    {
+      posix_fadvise(index.fd, begin, end - begin, POSIX_FADV_WILLNEED);
+    }
+  }
+}
 
-std::vector<double> liquidate(const std::string& bamfile, const std::string& chromosome,
-                              const unsigned int start, const unsigned int stop,
-                              const char strand, const unsigned int spnum,
-                              const unsigned int extendlen)
+// notified whenever one of a fetch's blocks is inflated
+struct BlockSignal
 {
-	samfile_t* fp=NULL;
-	fp=samopen(bamfile.c_str(),"rb",0);
-	if(fp == NULL)
-	{
-		throw std::runtime_error("samopen() error with " + bamfile);
-	}
+  std::mutex mutex;
+  std::condition_variable inflated;
+};
 
-  bam_index_t* bamidx=NULL;
-  bamidx=bam_index_load(bamfile.c_str());
-	if (bamidx == NULL)
-	{
-		throw std::runtime_error("bam_index_load() error with " + bamfile);
-	}
+// A block read ahead of the fetch that decodes it, which is inflated by whichever claims it
+// first: a helper thread, or the fetch once it reaches the block.  The compressed bytes are
+// in copy, or in the mapping of a mapped bam file.
+struct Block
+{
+  enum State { pending, claimed, inflated };
 
-	std::vector<double> counts = liquidate(fp, bamidx, chromosome, start, stop, strand, spnum, extendlen);
+  Block(): address(0), next_address(0), compressed(nullptr), compressed_size(0), failed(false), state(pending) {}
 
-  bam_index_destroy(bamidx);
-  samclose(fp);
+  uint64_t address;
+  uint64_t next_address;
+  const uint8_t* compressed;
+  size_t compressed_size;
+  std::vector<uint8_t> copy;
+  std::vector<uint8_t> data;
+  bool failed;
+  std::atomic<int> state;
+  std::shared_ptr<BlockSignal> signal;
+};
 
-	return counts;
+// returns false if the block was already claimed (or cancelled)
+bool claim(Block& block)
+{
+  int expected = Block::pending;
+  return block.state.compare_exchange_strong(expected, Block::claimed);
 }
 
-std::vector<double> liquidate(const samfile_t* fp, const bam_index_t* bamidx,
-															const std::string& chromosome,
-                              const unsigned int start, const unsigned int stop,
-                              const char strand, const unsigned int spnum,
-                              const unsigned int extendlen)
+// the caller must have claimed the block
+void inflate_block(Block& block)
 {
-  std::vector<double> data(spnum, 0);
-  
-  std::string coord;
+  block.data.resize(bgzf_max_block_size);
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  stream.next_in = (Bytef*) block.compressed + bgzf_header_size;
+  stream.avail_in = block.compressed_size - bgzf_header_size - bgzf_footer_size;
+  stream.next_out = block.data.data();
+  stream.avail_out = block.data.size();
+  block.failed = inflateInit2(&stream, -15) != Z_OK;
+  if (!block.failed)
   {
-    std::stringstream ss;
-    ss << chromosome << ':' << start << '-' << stop;
-    coord = ss.str();
+    block.failed = inflate(&stream, Z_FINISH) != Z_STREAM_END;
+    inflateEnd(&stream);
+  }
+  block.data.resize(block.failed ? 0 : stream.total_out);
+  std::vector<uint8_t>().swap(block.copy);
+  block.compressed = nullptr;
+
+  {
+    std::lock_guard<std::mutex> lock(block.signal->mutex);
+    block.state = Block::inflated;
+  }
+  block.signal->inflated.notify_all();
+}
+
+// The helper threads that inflate the blocks read ahead by every fetch in the process, one per
+// core, started by the first large fetch and never stopped.  Blocks are shared with the fetch,
+// so a fetch that finishes (or throws) early just leaves its unclaimed blocks to be dropped.
+class InflatePool
+{
+public:
+  static InflatePool& instance()
+  {
+    static InflatePool* pool = new InflatePool(std::max(1u, std::thread::hardware_concurrency()));
+    return *pool;
   }
 
-  /* fetch bed items for a region and compute density
-  only deal with coord, so use generic item
-  */
-  int startArr[spnum], stopArr[spnum];
-  int pieceLength = (stop-start) / spnum;
-  for(int i=0; i<spnum; i++)
+  void submit(const std::shared_ptr<Block>& block)
   {
-    startArr[i] = start + pieceLength*i;
-    stopArr[i] = start + pieceLength*(i+1);
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      blocks.push_back(block);
+    }
+    ready.notify_one();
   }
 
-  std::deque<ReadItem> items = bamQuery_region(fp,bamidx,coord,strand,extendlen);
+private:
+  explicit InflatePool(unsigned int threads)
+  {
+    for (unsigned int i = 0; i < threads; ++i)
+    {
+      std::thread(&InflatePool::run, this).detach();
+    }
+  }
 
-  for(const ReadItem& item : items)
+  void run()
   {
-    // collapse this bed item onto the density counter
-    for(int i=0; i<spnum; i++)
+    for (;;)
     {
-      if(item.start > stopArr[i]) continue;
-      if(item.stop < startArr[i]) break;
-      int start=intMax(item.start,startArr[i]);
-      int stop=intMin(item.stop,stopArr[i]);
-      if(start<stop)
+      std::shared_ptr<Block> block;
       {
-        // as Charles suggested, add the fraction of the read (overlapping with the bin)
-        // instead of just counting the read
-        data[i] += stop-start;
+        std::unique_lock<std::mutex> lock(mutex);
+        ready.wait(lock, [this] { return !blocks.empty(); });
+        block = std::move(blocks.front());
+        blocks.pop_front();
       }
+      if (claim(*block)) inflate_block(*block);
     }
   }
 
-  return data;
+  std::mutex mutex;
+  std::condition_variable ready;
+  std::deque<std::shared_ptr<Block>> blocks;
+};
+
+// Reads records from a bam file like bgzf_read and bam_read1 in samtools, except that the
+// blocks of the fetch's chunks are read up to blocks_ahead ahead of the current record and
+// inflated by the InflatePool while the records before them are counted, and the kernel is
+// asked to read ReadAhead::hint_bytes further ahead in the background.  With no blocks_ahead,
+// every block is inflated by the fetch itself.  As with bam_fetch, a read error or a corrupt
+// block ends the records instead of throwing.
+class BlockReader
+{
+public:
+  BlockReader(const BlockIndex& index, const std::vector<BlockIndex::Chunk>& chunks, size_t blocks_ahead):
+    index(index),
+    chunks(chunks),
+    blocks_ahead(blocks_ahead),
+    plan_chunk(0),
+    plan_address(0),
+    hinted_address(0),
+    signal(std::make_shared<BlockSignal>()),
+    address(0),
+    offset(0),
+    buffer_address(0)
+  {
+    plan();
+  }
+
+  ~BlockReader()
+  {
+    for (const std::shared_ptr<Block>& block : ahead)
+    {
+      cancel(*block);
+    }
+  }
+
+  // the virtual file offset of the next byte, as bgzf_tell
+  uint64_t tell() const
+  {
+    return address << 16 | offset;
+  }
+
+  void seek(uint64_t virtual_offset)
+  {
+    current.reset();
+    address = virtual_offset >> 16;
+    offset = virtual_offset & 0xffff;
+  }
+
+  // Sets record to the next record, decoding only its core fields and cigar.  Returns false
+  // at the end of the file or on an error.
+  bool read_record(ReadRecord& record)
+  {
+    const uint8_t* bytes;
+    int32_t block_len;
+    if (!read(sizeof(block_len), bytes)) return false;
+    memcpy(&block_len, bytes, sizeof(block_len));
+
+    // the core fields, as in bam_read1
+    uint32_t x[8];
+    if (block_len < (int32_t) sizeof(x) || !read(sizeof(x), bytes)) return false;
+    memcpy(x, bytes, sizeof(x));
+    record.tid = x[0];
+    record.pos = x[1];
+    record.flag = x[3] >> 16;
+    record.n_cigar = x[3] & 0xffff;
+
+    // the read name is before the cigar, and the sequence, qualities and tags are after it
+    const size_t data_len = block_len - sizeof(x);
+    const size_t name_len = x[2] & 0xff;
+    const size_t cigar_len = record.n_cigar * sizeof(uint32_t);
+    if (name_len + cigar_len > data_len || !skip(name_len) || !read(cigar_len, bytes)) return false;
+    decode_cigar(record, bytes);
+    return skip(data_len - name_len - cigar_len);
+  }
+
+private:
+  // points bytes at the next size bytes, which are copied only if they span blocks
+  bool read(size_t size, const uint8_t*& bytes)
+  {
+    if (current && current->data.size() - offset >= size)
+    {
+      bytes = current->data.data() + offset;
+      offset += size;
+      if (offset == current->data.size()) next_block();
+      return true;
+    }
+
+    scratch.resize(size);
+    for (size_t copied = 0; copied < size; )
+    {
+      if (!current && (!load(address) || offset >= current->data.size())) return false;
+      const size_t n = std::min(size - copied, current->data.size() - offset);
+      memcpy(scratch.data() + copied, current->data.data() + offset, n);
+      copied += n;
+      offset += n;
+      if (offset == current->data.size()) next_block();
+    }
+    bytes = scratch.data();
+    return true;
+  }
+
+  // like read, except that the bytes are only passed over
+  bool skip(size_t size)
+  {
+    while (size > 0)
+    {
+      if (!current && (!load(address) || offset >= current->data.size())) return false;
+      const size_t n = std::min(size, current->data.size() - offset);
+      offset += n;
+      size -= n;
+      if (offset == current->data.size()) next_block();
+    }
+    return true;
+  }
+
+  // called once the current block is used up, keeping it until the next one is loaded, since
+  // the last record read may point into it
+  void next_block()
+  {
+    previous = std::move(current);
+    address = previous->next_address;
+    offset = 0;
+  }
+
+  // Cancels a block read ahead if no helper has started on it, or else waits for the helper,
+  // which may be inflating from a mapping that is unmapped once the fetch's Liquidator is gone.
+  void cancel(Block& block)
+  {
+    if (!claim(block))
+    {
+      wait(block);
+    }
+  }
+
+  void wait(Block& block)
+  {
+    std::unique_lock<std::mutex> lock(signal->mutex);
+    signal->inflated.wait(lock, [&block] { return block.state == Block::inflated; });
+  }
+
+  // makes the block at the address current, returning false at the end of the file or on an
+  // error
+  bool load(uint64_t block_address)
+  {
+    // blocks before the address were planned for chunks that the fetch has skipped or finished
+    while (!ahead.empty() && ahead.front()->address < block_address)
+    {
+      cancel(*ahead.front());
+      ahead.pop_front();
+    }
+
+    std::shared_ptr<Block> block;
+    if (!ahead.empty() && ahead.front()->address == block_address)
+    {
+      block = std::move(ahead.front());
+      ahead.pop_front();
+      plan();
+    }
+    else
+    {
+      // e.g. a record that continues past the last block of its chunk
+      block = read_block(block_address);
+      if (!block) return false;
+      plan();
+    }
+
+    if (claim(*block))
+    {
+      inflate_block(*block);
+    }
+    else
+    {
+      wait(*block);
+    }
+    if (block->failed) return false;
+
+    previous.reset();
+    current = std::move(block);
+    return true;
+  }
+
+  // reads the blocks of the chunks in file order until blocks_ahead are waiting, and hands
+  // them to the InflatePool
+  void plan()
+  {
+    while (ahead.size() < blocks_ahead && plan_chunk < chunks.size())
+    {
+      const BlockIndex::Chunk& chunk = chunks[plan_chunk];
+      // the chunk's last block is the one its end points into, unless its end is the very
+      // beginning of a block
+      const uint64_t limit = (chunk.end >> 16) + ((chunk.end & 0xffff) ? 1 : 0);
+      plan_address = std::max(plan_address, chunk.begin >> 16);
+      if (plan_address >= limit)
+      {
+        ++plan_chunk;
+        continue;
+      }
+
+      std::shared_ptr<Block> block = read_block(plan_address);
+      if (!block)
+      {
+        plan_chunk = chunks.size();
+        break;
+      }
+      plan_address = block->next_address;
+      ahead.push_back(block);
+      InflatePool::instance().submit(block);
+    }
+
+    // the next hint is given once half of the last one has been read
+    const uint64_t hint_bytes = read_ahead().hint_bytes;
+    const uint64_t position = std::max(plan_address, address);
+    if (hint_bytes > 0 && blocks_ahead > 0 && position + hint_bytes / 2 >= hinted_address)
+    {
+      advise(index, chunks, plan_chunk, std::max(position, hinted_address), position + hint_bytes);
+      hinted_address = position + hint_bytes;
+    }
+  }
+
+  // returns null at the end of the file, or if the block can't be read or isn't a BGZF block
+  std::shared_ptr<Block> read_block(uint64_t block_address)
+  {
+    const uint8_t* header = buffered(block_address, bgzf_header_size);
+    if (header == nullptr || header[0] != 31 || header[1] != 139 || header[2] != 8 || (header[3] & 4) == 0
+        || header[10] != 6 || header[11] != 0 || header[12] != 'B' || header[13] != 'C'
+        || header[14] != 2 || header[15] != 0)
+    {
+      return nullptr;
+    }
+    const size_t size = (header[16] | header[17] << 8) + 1;
+    const uint8_t* bytes = size < bgzf_header_size + bgzf_footer_size ? nullptr : buffered(block_address, size);
+    if (bytes == nullptr) return nullptr;
+
+    std::shared_ptr<Block> block = std::make_shared<Block>();
+    block->address = block_address;
+    block->next_address = block_address + size;
+    if (index.mapped == nullptr)
+    {
+      block->copy.assign(bytes, bytes + size);
+      bytes = block->copy.data();
+    }
+    block->compressed = bytes;
+    block->compressed_size = size;
+    block->signal = signal;
+    return block;
+  }
+
+  // returns the size bytes of the bam file at the file offset, or null if they can't be read
+  const uint8_t* buffered(uint64_t file_offset, size_t size)
+  {
+    if (index.mapped != nullptr)
+    {
+      return file_offset <= index.mapped_size && size <= index.mapped_size - file_offset
+             ? index.mapped + file_offset : nullptr;
+    }
+    if (file_offset < buffer_address || file_offset + size > buffer_address + buffer.size())
+    {
+      buffer.resize(std::max(read_ahead().read_bytes, size));
+      size_t filled = 0;
+      while (filled < buffer.size())
+      {
+        const ssize_t n = pread(index.fd, buffer.data() + filled, buffer.size() - filled, file_offset + filled);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        filled += n;
+      }
+      buffer.resize(filled);
+      buffer_address = file_offset;
+      if (filled < size) return nullptr;
+    }
+    return buffer.data() + (file_offset - buffer_address);
+  }
+
+  const BlockIndex& index;
+  const std::vector<BlockIndex::Chunk>& chunks;
+  const size_t blocks_ahead;
+
+  // the blocks read ahead, in file order, where plan continues reading, and the file offset
+  // that the kernel has been asked to read up to
+  std::deque<std::shared_ptr<Block>> ahead;
+  size_t plan_chunk;
+  uint64_t plan_address;
+  uint64_t hinted_address;
+  std::shared_ptr<BlockSignal> signal;
+
+  // the next byte read is at offset in the inflated block at address, which is current unless
+  // it hasn't been loaded yet
+  std::shared_ptr<Block> current;
+  std::shared_ptr<Block> previous;
+  uint64_t address;
+  size_t offset;
+  std::vector<uint8_t> scratch;
+
+  std::vector<uint8_t> buffer;
+  uint64_t buffer_address;
+};
+
+// Where fetches read from: bam_fetch with the samtools file and index, or for large fetches, a
+// BlockReader when blocks isn't null.
+struct BamSource
+{
+  const samfile_t* fp;
+  const bam_index_t* bamidx;
+  const BlockIndex* blocks;
+};
+}
+
+// adapts a fetch_f to bam_fetch, for the fetches that aren't read by a BlockReader
+struct FetchCallback
+{
+  fetch_f func;
+  void* data;
+};
+
+static int bam_fetch_read(const bam1_t* b, void* data)
+{
+  const FetchCallback* callback = (const FetchCallback*) data;
+  callback->func(read_record(b), callback->data);
+  return 0;
+}
+
+// Calls func on every read overlapping [beg, end) on the reference, e.g. like bam_fetch.  A
+// mapped bam file is never read with bam_fetch, since the samtools file is shared by every
+// Liquidator of the bam file, so a reference missing from the index or an inverted region
+// has no reads.
+static void fetch(const BamSource& source, int ref, int beg, int end, void* data, fetch_f func)
+{
+  beg = std::max(beg, 0);
+  if (source.blocks != NULL && !bam_is_be && ref >= 0 && ref < (int) source.blocks->references.size() && beg <= end)
+  {
+    const std::vector<BlockIndex::Chunk> chunks = query_chunks(source.blocks->references[ref], beg, end);
+    uint64_t bytes = 0;
+    for (const BlockIndex::Chunk& chunk : chunks)
+    {
+      bytes += (chunk.end >> 16) - (chunk.begin >> 16);
+    }
+
+    if (bytes >= read_ahead().parallel_fetch_bytes || source.blocks->mapped != nullptr)
+    {
+      if (chunks.empty()) return;
+
+      // the same loop as bam_iter_read: each chunk is read until a record ends at or after the
+      // chunk's end, and the fetch stops at the first record past the region
+      BlockReader reader(*source.blocks, chunks, bytes >= read_ahead().parallel_fetch_bytes ? read_ahead().blocks : 0);
+      ReadRecord read;
+      reader.seek(chunks[0].begin);
+      for (size_t i = 0; reader.read_record(read); )
+      {
+        if (read.tid != ref || read.pos >= end) break;
+
+        if (read.fetch_end > (uint32_t) beg && (uint32_t) read.pos < (uint32_t) end)
+        {
+          func(read, data);
+        }
+
+        if (reader.tell() >= chunks[i].end)
+        {
+          if (i + 1 == chunks.size()) break;
+          if (chunks[i].end != chunks[i+1].begin) reader.seek(chunks[i+1].begin);
+          ++i;
+        }
+      }
+      return;
+    }
+  }
+  else if (source.blocks != NULL && source.blocks->mapped != nullptr)
+  {
+    return;
+  }
+
+  FetchCallback callback = {func, data};
+  bam_fetch(source.fp->x.bam, source.bamidx, ref, beg, end, &callback, bam_fetch_read);
+}
+
+// calls func on every read overlapping coord, e.g. "chr1:100-200"
+static void fetch_region(const BamSource& source, const std::string& coord,
+                         void* data, fetch_f func)
+{
+  // will not fill chromidx
+  int ref,beg,end;
+  int rc = bam_parse_region(source.fp->header,coord.c_str(),&ref,&beg,&end);
+  if (rc != 0)
+  {
+    std::stringstream error_msg;
+    error_msg << "bam_parse_region failed with return code " << rc;
+    throw std::runtime_error(error_msg.str());
+  }
+  if(ref<0)
+  {
+    return;
+  }
+  fetch(source,ref,beg,end,data,func);
+}
+
+
+std::vector<double> liquidate(const std::string& bamfile, const std::string& chromosome,
+                              const unsigned int start, const unsigned int stop,
+                              const char strand, const unsigned int spnum,
+                              const unsigned int extendlen)
+{
+  const std::shared_ptr<const CoverageIndex> coverage = CoverageIndex::open(bamfile);
+  if (coverage)
+  {
+    std::vector<uint64_t> counts(spnum, 0);
+    if (coverage->liquidate(chromosome, start, stop, strand, spnum, extendlen, counts.data()))
+    {
+      return std::vector<double>(counts.begin(), counts.end());
+    }
+  }
+
+	samfile_t* fp=NULL;
+	fp=samopen(bamfile.c_str(),"rb",0);
+	if(fp == NULL)
+	{
+		throw std::runtime_error("samopen() error with " + bamfile);
+	}
+
+  bam_index_t* bamidx=NULL;
+  bamidx=bam_index_load(bamfile.c_str());
+	if (bamidx == NULL)
+	{
+		throw std::runtime_error("bam_index_load() error with " + bamfile);
+	}
+
+	std::vector<double> counts = liquidate(fp, bamidx, chromosome, start, stop, strand, spnum, extendlen);
+
+  bam_index_destroy(bamidx);
+  samclose(fp);
+
+	return counts;
+}
+
+std::vector<double> liquidate(const samfile_t* fp, const bam_index_t* bamidx,
+															const std::string& chromosome,
+                              const unsigned int start, const unsigned int stop,
+                              const char strand, const unsigned int spnum,
+                              const unsigned int extendlen)
+{
+  std::vector<uint64_t> counts(spnum, 0);
+  liquidate(fp, bamidx, chromosome, start, stop, strand, spnum, extendlen, counts.data());
+
+  return std::vector<double>(counts.begin(), counts.end());
+}
+
+static void liquidate(const BamSource& source, const std::string& chromosome,
+                      const unsigned int start, const unsigned int stop,
+                      const char strand, const unsigned int spnum,
+                      const unsigned int extendlen, uint64_t* counts)
+{
+  std::string coord;
+  {
+    std::stringstream ss;
+    ss << chromosome << ':' << start << '-' << stop;
+    coord = ss.str();
+  }
+
+  const int64_t pieceLength = (stop-start) / spnum;
+
+  std::vector<int64_t> partial(spnum, 0);
+  std::vector<int64_t> coverage(spnum + 1, 0);
+
+  UserData d;
+  d.start=start;
+  d.pieceLength=pieceLength;
+  d.spnum=spnum;
+  d.partial=partial.data();
+  d.coverage=coverage.data();
+  d.extendlen=extendlen;
+  fetch_region(source,coord,&d,spnum == 1 ? choose_kernel<SinglePointKernel>(strand, extendlen)
+                                          : choose_kernel<SummaryPointsKernel>(strand, extendlen));
+
+  int64_t full_reads = 0;
+  for(unsigned int i=0; i<spnum; i++)
+  {
+    full_reads += coverage[i];
+    counts[i] = partial[i] + full_reads*pieceLength;
+  }
+}
+
+void liquidate(const samfile_t* fp, const bam_index_t* bamidx,
+               const std::string& chromosome,
+               const unsigned int start, const unsigned int stop,
+               const char strand, const unsigned int spnum,
+               const unsigned int extendlen, uint64_t* counts)
+{
+  liquidate(BamSource{fp, bamidx, NULL}, chromosome, start, stop, strand, spnum, extendlen, counts);
+}
+
+// one of the bin ranges being counted
+struct BinsLevel
+{
+  // counts[m][i] is the count for bin first_bin + i with modes[m]
+  std::vector<std::vector<uint64_t>> counts;
+  size_t first_bin;
+  size_t bins;
+  unsigned int bin_size;
+};
+
+struct BinsData
+{
+  std::vector<BinsLevel> levels;
+  std::vector<CountingMode> modes;
+};
+
+// adds the part of the read in [start, stop) to the counts of mode m at every level
+static inline void add_to_bins(BinsData& bdata, size_t m, const ReadRecord& read,
+                               unsigned int start, unsigned int stop)
+{
+  // A per bin bam_fetch only returns the reads that overlap the bin before they are
+  // extended, so only those bins are credited to keep the counts identical: bin n is
+  // fetched with the region "chr:n*bin_size-(n+1)*bin_size", which bam_parse_region turns
+  // into the zero based [n*bin_size - 1, (n+1)*bin_size), or [0, bin_size) for bin 0.
+  const size_t read_end = read.fetch_end;
+
+  for (BinsLevel& level : bdata.levels)
+  {
+    if (level.bins == 0) continue;
+
+    const size_t bin_size = level.bin_size;
+    size_t first_bin = std::max<size_t>(read.pos / bin_size, start / bin_size);
+    size_t last_bin = std::min<size_t>(read_end / bin_size, stop == 0 ? 0 : (stop - 1) / bin_size);
+    first_bin = std::max(first_bin, level.first_bin);
+    last_bin = std::min(last_bin, level.first_bin + level.bins - 1);
+
+    std::vector<uint64_t>& counts = level.counts[m];
+    for (size_t bin = first_bin; bin <= last_bin && start < stop; ++bin)
+    {
+      const size_t bin_start = bin * bin_size;
+      counts[bin - level.first_bin] += std::min<size_t>(stop, bin_start + bin_size)
+                                     - std::max<size_t>(start, bin_start);
+    }
+  }
+}
+
+static void bam_fetch_bins_func(const ReadRecord& read, void* data)
+{
+  if (read.tid < 0 || read.fetch_end == 0) return;
+
+  BinsData* bdata = (BinsData*) data;
+
+  const char strand = read_strand(read);
+  for (size_t m = 0; m < bdata->modes.size(); ++m)
+  {
+    unsigned int start, stop;
+    if (read_span(strand, read.pos, read.length, bdata->modes[m].strand, bdata->modes[m].extendlen,
+                  start, stop))
+    {
+      add_to_bins(*bdata, m, read, start, stop);
+    }
+  }
+}
+
+// the same as bam_fetch_bins_func for the usual single mode
+template <char Strand, bool Extended>
+struct SingleModeBinsKernel
+{
+  static void count(const ReadRecord& read, void* data)
+  {
+    if (read.tid < 0 || read.fetch_end == 0) return;
+
+    BinsData* bdata = (BinsData*) data;
+
+    unsigned int start, stop;
+    if (read_span<Strand, Extended>(read, bdata->modes[0].extendlen, start, stop))
+    {
+      add_to_bins(*bdata, 0, read, start, stop);
+    }
+  }
+};
+
+std::vector<uint64_t> liquidate_bins(const samfile_t* fp, const bam_index_t* bamidx,
+                                     const std::string& chromosome, const unsigned int bin_size,
+                                     const size_t first_bin, const size_t last_bin,
+                                     const char strand, const unsigned int extendlen)
+{
+  return liquidate_bins(fp, bamidx, chromosome, bin_size, first_bin, last_bin,
+                        std::vector<CountingMode>(1, CountingMode{strand, extendlen}))[0];
+}
+
+std::vector<std::vector<uint64_t>> liquidate_bins(const samfile_t* fp, const bam_index_t* bamidx,
+                                                  const std::string& chromosome, const unsigned int bin_size,
+                                                  const size_t first_bin, const size_t last_bin,
+                                                  const std::vector<CountingMode>& modes)
+{
+  return liquidate_bins(fp, bamidx, chromosome,
+                        std::vector<BinRange>(1, BinRange{bin_size, first_bin, last_bin}), modes)[0];
+}
+
+static std::vector<std::vector<std::vector<uint64_t>>> liquidate_bins(const BamSource& source,
+                                                                      const std::string& chromosome,
+                                                                      const std::vector<BinRange>& ranges,
+                                                                      const std::vector<CountingMode>& modes)
+{
+  BinsData d;
+  d.modes = modes;
+
+  // the fetch covers the union of the ranges, and each level skips the reads outside of it
+  size_t fetch_start = 0;
+  size_t fetch_stop = 0;
+  for (const BinRange& range : ranges)
+  {
+    BinsLevel level;
+    level.first_bin = range.first_bin;
+    level.bins = range.last_bin > range.first_bin && range.bin_size > 0 ? range.last_bin - range.first_bin : 0;
+    level.bin_size = range.bin_size;
+    level.counts.assign(modes.size(), std::vector<uint64_t>(level.bins, 0));
+    if (level.bins > 0)
+    {
+      const size_t level_start = range.first_bin * range.bin_size;
+      const size_t level_stop = range.last_bin * range.bin_size;
+      fetch_start = fetch_stop == 0 ? level_start : std::min(fetch_start, level_start);
+      fetch_stop = std::max(fetch_stop, level_stop);
+    }
+    d.levels.push_back(std::move(level));
+  }
+
+  if (fetch_stop > fetch_start)
+  {
+    std::stringstream ss;
+    ss << chromosome << ':' << fetch_start << '-' << fetch_stop;
+    fetch_region(source,ss.str(),&d,
+                 modes.size() == 1 ? choose_kernel<SingleModeBinsKernel>(modes[0].strand, modes[0].extendlen)
+                                   : bam_fetch_bins_func);
+  }
+
+  std::vector<std::vector<std::vector<uint64_t>>> counts;
+  for (BinsLevel& level : d.levels)
+  {
+    counts.push_back(std::move(level.counts));
+  }
+  return counts;
+}
+
+std::vector<std::vector<std::vector<uint64_t>>> liquidate_bins(const samfile_t* fp, const bam_index_t* bamidx,
+                                                               const std::string& chromosome,
+                                                               const std::vector<BinRange>& ranges,
+                                                               const std::vector<CountingMode>& modes)
+{
+  return liquidate_bins(BamSource{fp, bamidx, NULL}, chromosome, ranges, modes);
+}
+
+// Regions are swept in coordinate order along with the reads: a region is admitted to
+// the active set once a read reaches past its fetch begin (regions are sorted by start,
+// so admission is in order), and is evicted once reads start at or after its stop.  The
+// active set is a min heap on stop, so each read only visits the regions that are open
+// at its position, and the cost scales with reads plus overlaps rather than reads times
+// regions.
+struct RegionsData
+{
+  RegionCount* regions;
+  size_t size;
+  // regions[next] is the first region not yet admitted to active
+  size_t next;
+  unsigned int max_read_end;
+  std::vector<size_t> active;
+
+  bool operator()(size_t a, size_t b) const
+  {
+    return regions[a].stop > regions[b].stop;
+  }
+};
+
+// the strand that read_span counts for a requested strand
+static inline char counted_strand(char strand)
+{
+  return strand == '+' || strand == '-' ? strand : '.';
+}
+
+static inline unsigned int fetch_begin(const RegionCount& region)
+{
+  return region.start > 0 ? region.start - 1 : 0;
+}
+
+// admits the regions that the read reaches and evicts the ones that end before it
+static inline void sweep_regions(RegionsData& rdata, const ReadRecord& read)
+{
+  const unsigned int pos = read.pos;
+  rdata.max_read_end = std::max(rdata.max_read_end, read.fetch_end);
+  for (; rdata.next < rdata.size && fetch_begin(rdata.regions[rdata.next]) < rdata.max_read_end; ++rdata.next)
+  {
+    if (rdata.regions[rdata.next].stop > pos)
+    {
+      rdata.active.push_back(rdata.next);
+      std::push_heap(rdata.active.begin(), rdata.active.end(), rdata);
+    }
+  }
+  while (!rdata.active.empty() && rdata.regions[rdata.active.front()].stop <= pos)
+  {
+    std::pop_heap(rdata.active.begin(), rdata.active.end(), rdata);
+    rdata.active.pop_back();
+  }
+}
+
+// A per region bam_fetch only returns the reads that overlap the region before they are
+// extended, so only those regions are credited to keep the counts identical: region [s, e)
+// is fetched as "chr:s-e", which bam_parse_region turns into the zero based [s - 1, e), or
+// [0, e) when s is 0.
+static inline void add_to_region(RegionCount& region, const ReadRecord& read,
+                                 unsigned int start, unsigned int stop)
+{
+  if (fetch_begin(region) >= read.fetch_end) return;
+
+  const unsigned int lo = std::max(start, region.start);
+  const unsigned int hi = std::min(stop, region.stop);
+  if (lo < hi)
+  {
+    region.count += hi - lo;
+  }
+}
+
+static void bam_fetch_regions_func(const ReadRecord& read, void* data)
+{
+  if (read.tid < 0) return;
+
+  RegionsData* rdata = (RegionsData*) data;
+  sweep_regions(*rdata, read);
+
+  const char strand = read_strand(read);
+  for (size_t i : rdata->active)
+  {
+    RegionCount& region = rdata->regions[i];
+    unsigned int start, stop;
+    if (read_span(strand, read.pos, read.length, region.strand, region.extendlen, start, stop))
+    {
+      add_to_region(region, read, start, stop);
+    }
+  }
+}
+
+// the same as bam_fetch_regions_func when every region has the same strand and extension
+// length, so each read's span is found once instead of once per open region
+template <char Strand, bool Extended>
+struct SameModeRegionsKernel
+{
+  static void count(const ReadRecord& read, void* data)
+  {
+    if (read.tid < 0) return;
+
+    RegionsData* rdata = (RegionsData*) data;
+    sweep_regions(*rdata, read);
+
+    unsigned int start, stop;
+    if (!read_span<Strand, Extended>(read, rdata->regions[0].extendlen, start, stop)) return;
+    for (size_t i : rdata->active)
+    {
+      add_to_region(rdata->regions[i], read, start, stop);
+    }
+  }
+};
+
+static void liquidate_regions(const BamSource& source, const std::string& chromosome,
+                              std::vector<RegionCount>& regions)
+{
+  if (regions.empty()) return;
+
+  unsigned int stop = 0;
+  bool same_mode = true;
+  for (size_t i = 0; i < regions.size(); ++i)
+  {
+    if (i > 0 && regions[i].start < regions[i-1].start)
+    {
+      throw std::runtime_error("liquidate_regions requires regions sorted by start");
+    }
+    regions[i].count = 0;
+    stop = std::max(stop, regions[i].stop);
+    same_mode = same_mode && regions[i].extendlen == regions[0].extendlen
+                && counted_strand(regions[i].strand) == counted_strand(regions[0].strand);
+  }
+
+  std::stringstream ss;
+  ss << chromosome << ':' << regions.front().start << '-' << stop;
+
+  RegionsData data;
+  data.regions = regions.data();
+  data.size = regions.size();
+  data.next = 0;
+  data.max_read_end = 0;
+  fetch_region(source, ss.str(), &data,
+               same_mode ? choose_kernel<SameModeRegionsKernel>(regions[0].strand, regions[0].extendlen)
+                         : bam_fetch_regions_func);
+}
+
+void liquidate_regions(const samfile_t* fp, const bam_index_t* bamidx,
+                       const std::string& chromosome, std::vector<RegionCount>& regions)
+{
+  liquidate_regions(BamSource{fp, bamidx, NULL}, chromosome, regions);
+}
+
+static samfile_t* open_bam(const std::string& bam_file_path)
+{
+  samfile_t* fp = samopen(bam_file_path.c_str(),"rb",0);
+  if(fp == NULL)
+  {
+    throw std::runtime_error("samopen() error with " + bam_file_path);
+  }
+  return fp;
+}
+
+static std::shared_ptr<const bam_index_t> load_index(const std::string& bam_file_path)
+{
+  bam_index_t* bamidx = bam_index_load(bam_file_path.c_str());
+  if (bamidx == NULL)
+  {
+    throw std::runtime_error("bam_index_load() error with " + bam_file_path);
+  }
+  return std::shared_ptr<const bam_index_t>(bamidx, [](const bam_index_t* idx)
+  {
+    bam_index_destroy(const_cast<bam_index_t*>(idx));
+  });
+}
+
+// The coverage index file is a Header, followed by a CoverageChromosome per bam file target,
+// followed by the blocks and offsets of each chromosome's points, each starting at a
+// multiple of 8 bytes.  Everything is in the native byte order.
+namespace
+{
+const char coverage_magic[8] = {'B', 'L', 'C', 'O', 'V', 'I', 'D', 'X'};
+const uint32_t coverage_version = 1;
+
+struct CoverageHeader
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t resolution;
+  int64_t bam_size;
+  int64_t bam_mtime;
+  uint32_t chromosomes;
+  uint32_t reserved;
+};
+
+// The kinds of points, where the ends are the position after the read's last base (as
+// counted by ReadRecord::length), except that forward reads without a cigar are fetched as if
+// they ended one base later, so their ends are also kept separately to handle that.
+enum PointKind
+{
+  forward_starts,
+  forward_ends,
+  reverse_starts,
+  reverse_ends,
+  no_cigar_forward_ends,
+  point_kinds
+};
+
+struct CoveragePoints
+{
+  uint64_t blocks_offset;
+  uint64_t number_of_blocks;
+  uint64_t offsets_offset;
+  uint64_t number_of_points;
+};
+
+struct CoverageChromosome
+{
+  char name[256];
+  // 0 if the chromosome's name is too long, or it has reads that are fetched with a
+  // different end than ReadRecord::length (e.g. with = and X cigar operations), which the index
+  // can't count identically
+  uint32_t indexed;
+  uint32_t reserved;
+  CoveragePoints points[point_kinds];
+};
+
+struct CoverageData
+{
+  std::vector<uint32_t> points[point_kinds];
+  bool regular;
+};
+
+void bam_fetch_coverage_func(const ReadRecord& read, void* data)
+{
+  if (read.tid < 0 || read.pos < 0) return;
+
+  CoverageData* cdata = (CoverageData*) data;
+
+  const unsigned int pos = read.pos;
+  const unsigned int end = pos + read.length;
+  if (read.fetch_end != end + (read.n_cigar ? 0 : 1))
+  {
+    cdata->regular = false;
+  }
+
+  if (read_strand(read) == '+')
+  {
+    cdata->points[forward_starts].push_back(pos);
+    cdata->points[forward_ends].push_back(end);
+    if (read.n_cigar == 0)
+    {
+      cdata->points[no_cigar_forward_ends].push_back(end);
+    }
+  }
+  else
+  {
+    cdata->points[reverse_starts].push_back(pos);
+    cdata->points[reverse_ends].push_back(end);
+  }
+}
+
+void write_at(FILE* file, uint64_t offset, const void* data, size_t size, const std::string& path)
+{
+  if (fseeko(file, offset, SEEK_SET) != 0 || (size > 0 && fwrite(data, size, 1, file) != 1))
+  {
+    throw std::runtime_error("failed to write " + path);
+  }
+}
+
+uint64_t aligned(uint64_t offset)
+{
+  return (offset + 7) / 8 * 8;
+}
+}
+
+std::string coverage_index_path(const std::string& bam_file_path)
+{
+  return bam_file_path + ".coverage";
+}
+
+void build_coverage_index(const std::string& bam_file_path, unsigned int resolution)
+{
+  if (resolution == 0 || resolution > 65536)
+  {
+    throw std::runtime_error("coverage index resolution must be between 1 and 65536");
+  }
+
+  // the size and modification time are taken before reading, so that the index is stale
+  // if the bam file is replaced while it is being built
+  struct stat st;
+  if (stat(bam_file_path.c_str(), &st) != 0)
+  {
+    throw std::runtime_error("stat() error with " + bam_file_path);
+  }
+
+  std::shared_ptr<const bam_index_t> bamidx = load_index(bam_file_path);
+  std::shared_ptr<samfile_t> fp(open_bam(bam_file_path), samclose);
+  std::shared_ptr<const BlockIndex> blocks = load_block_index(bam_file_path);
+
+  const std::string path = coverage_index_path(bam_file_path);
+  std::stringstream temporary_path;
+  temporary_path << path << ".tmp." << getpid();
+  FILE* file = fopen(temporary_path.str().c_str(), "wb");
+  if (file == NULL)
+  {
+    throw std::runtime_error("failed to open " + temporary_path.str());
+  }
+
+  try
+  {
+    CoverageHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, coverage_magic, sizeof(header.magic));
+    header.version = coverage_version;
+    header.resolution = resolution;
+    header.bam_size = st.st_size;
+    header.bam_mtime = st.st_mtime;
+    header.chromosomes = fp->header->n_targets;
+
+    std::vector<CoverageChromosome> chromosomes(header.chromosomes);
+    uint64_t offset = aligned(sizeof(header) + chromosomes.size() * sizeof(CoverageChromosome));
+    for (int32_t tid = 0; tid < fp->header->n_targets; ++tid)
+    {
+      CoverageChromosome& chromosome = chromosomes[tid];
+      memset(&chromosome, 0, sizeof(chromosome));
+      const std::string name = fp->header->target_name[tid];
+      strncpy(chromosome.name, name.c_str(), sizeof(chromosome.name) - 1);
+
+      CoverageData data;
+      data.regular = name.size() < sizeof(chromosome.name);
+      fetch(BamSource{fp.get(), bamidx.get(), blocks.get()}, tid, 0, 1 << 29, &data, bam_fetch_coverage_func);
+      chromosome.indexed = data.regular ? 1 : 0;
+
+      for (int kind = 0; kind < point_kinds && data.regular; ++kind)
+      {
+        std::vector<uint32_t>& points = data.points[kind];
+        std::sort(points.begin(), points.end());
+
+        const uint64_t number_of_blocks = points.empty() ? 0 : points.back() / resolution + 1;
+        std::vector<uint64_t> blocks(2 * (number_of_blocks + 1), 0);
+        std::vector<uint16_t> offsets(points.size());
+        uint64_t count = 0;
+        uint64_t sum = 0;
+        for (uint64_t block = 0, i = 0; block <= number_of_blocks; ++block)
+        {
+          blocks[2*block] = count;
+          blocks[2*block + 1] = sum;
+          for (; i < points.size() && points[i] / resolution == block; ++i)
+          {
+            offsets[i] = points[i] - block * resolution;
+            ++count;
+            sum += points[i];
+          }
+        }
+
+        CoveragePoints& entry = chromosome.points[kind];
+        entry.number_of_blocks = number_of_blocks;
+        entry.number_of_points = points.size();
+        entry.blocks_offset = offset;
+        write_at(file, offset, blocks.data(), blocks.size() * sizeof(uint64_t), temporary_path.str());
+        offset = aligned(offset + blocks.size() * sizeof(uint64_t));
+        entry.offsets_offset = offset;
+        write_at(file, offset, offsets.data(), offsets.size() * sizeof(uint16_t), temporary_path.str());
+        offset = aligned(offset + offsets.size() * sizeof(uint16_t));
+      }
+    }
+
+    write_at(file, 0, &header, sizeof(header), temporary_path.str());
+    write_at(file, sizeof(header), chromosomes.data(), chromosomes.size() * sizeof(CoverageChromosome),
+             temporary_path.str());
+    if (fclose(file) != 0)
+    {
+      file = NULL;
+      throw std::runtime_error("failed to write " + temporary_path.str());
+    }
+    file = NULL;
+
+    if (rename(temporary_path.str().c_str(), path.c_str()) != 0)
+    {
+      throw std::runtime_error("failed to rename " + temporary_path.str() + " to " + path);
+    }
+  }
+  catch(...)
+  {
+    if (file != NULL) fclose(file);
+    unlink(temporary_path.str().c_str());
+    throw;
+  }
+}
+
+std::shared_ptr<const CoverageIndex> CoverageIndex::open(const std::string& bam_file_path)
+{
+  struct stat bam_st;
+  if (stat(bam_file_path.c_str(), &bam_st) != 0)
+  {
+    return nullptr;
+  }
+
+  const int fd = ::open(coverage_index_path(bam_file_path).c_str(), O_RDONLY);
+  if (fd < 0)
+  {
+    return nullptr;
+  }
+  struct stat st;
+  void* data = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && (size_t) st.st_size >= sizeof(CoverageHeader))
+  {
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (data == MAP_FAILED)
+  {
+    return nullptr;
+  }
+
+  std::shared_ptr<const CoverageIndex> index(new CoverageIndex(data, st.st_size));
+
+  const CoverageHeader* header = (const CoverageHeader*) data;
+  if (memcmp(header->magic, coverage_magic, sizeof(coverage_magic)) != 0
+      || header->version != coverage_version
+      || header->bam_size != bam_st.st_size
+      || header->bam_mtime != bam_st.st_mtime
+      || sizeof(CoverageHeader) + header->chromosomes * sizeof(CoverageChromosome) > (size_t) st.st_size)
+  {
+    return nullptr;
+  }
+
+  CoverageIndex* mutable_index = const_cast<CoverageIndex*>(index.get());
+  mutable_index->resolution = header->resolution;
+  const CoverageChromosome* chromosomes = (const CoverageChromosome*) (header + 1);
+  for (uint32_t i = 0; i < header->chromosomes; ++i)
+  {
+    const CoverageChromosome& entry = chromosomes[i];
+    if (!entry.indexed) continue;
+
+    Chromosome chromosome;
+    for (int kind = 0; kind < point_kinds; ++kind)
+    {
+      const CoveragePoints& points = entry.points[kind];
+      if (points.blocks_offset + 2 * (points.number_of_blocks + 1) * sizeof(uint64_t) > (uint64_t) st.st_size
+          || points.offsets_offset + points.number_of_points * sizeof(uint16_t) > (uint64_t) st.st_size)
+      {
+        return nullptr;
+      }
+      Points p;
+      p.blocks = (const uint64_t*) ((const char*) data + points.blocks_offset);
+      p.number_of_blocks = points.number_of_blocks;
+      p.offsets = (const uint16_t*) ((const char*) data + points.offsets_offset);
+      chromosome.points.push_back(p);
+    }
+    mutable_index->chromosomes[std::string(entry.name, strnlen(entry.name, sizeof(entry.name)))] = chromosome;
+  }
+
+  return index;
+}
+
+CoverageIndex::CoverageIndex(void* data, size_t size):
+  data(data),
+  size(size),
+  resolution(1)
+{}
+
+CoverageIndex::~CoverageIndex()
+{
+  munmap(data, size);
+}
+
+bool CoverageIndex::indexed(const std::string& chromosome) const
+{
+  return chromosomes.count(chromosome) > 0;
+}
+
+// sets count and sum to the number and sum of the points before x
+void CoverageIndex::before(const Points& points, int64_t x, int64_t& count, int64_t& sum) const
+{
+  if (x <= 0)
+  {
+    count = 0;
+    sum = 0;
+    return;
+  }
+
+  const uint64_t block = std::min<uint64_t>(x / resolution, points.number_of_blocks);
+  count = points.blocks[2*block];
+  sum = points.blocks[2*block + 1];
+  if (block == points.number_of_blocks) return;
+
+  const int64_t block_start = block * resolution;
+  const int64_t block_end = points.blocks[2*(block + 1)];
+  for (; count < block_end && block_start + points.offsets[count] < x; ++count)
+  {
+    sum += block_start + points.offsets[count];
+  }
+}
+
+// the sum of min(point, y) over the points before limit
+int64_t CoverageIndex::sum_min(const Points& points, int64_t y, int64_t limit) const
+{
+  const int64_t z = std::max<int64_t>(0, std::min(y, limit));
+  int64_t limit_count, limit_sum, z_count, z_sum;
+  before(points, limit, limit_count, limit_sum);
+  before(points, z, z_count, z_sum);
+  return z_sum + y * (limit_count - z_count);
+}
+
+/* The count for [lo, hi) within the region [start, stop), which is fetched as [w, stop) for
+   w = max(0, start - 1).  A read covering [s, e) is extended to [max(0, s - x), e) on the
+   reverse strand or [s, e + x) on the forward strand, and its count is the overlap of that
+   with [lo, hi), using that the overlap of [s, e) with [0, X) is min(e, X) - min(s, X).
+   Extending reads can add the extensions of reads that aren't fetched, i.e. forward reads
+   ending at or before w and reverse reads starting at or after stop, so their extensions
+   are subtracted back out.
+*/
+int64_t CoverageIndex::count(const Chromosome& chromosome, int64_t start, int64_t stop, int64_t lo, int64_t hi,
+                             char strand, int64_t x) const
+{
+  if (lo >= hi) return 0;
+
+  const int64_t all = std::numeric_limits<int64_t>::max();
+  const int64_t w = start > 0 ? start - 1 : 0;
+  auto F = [&](PointKind kind, int64_t y, int64_t limit)
+  {
+    return sum_min(chromosome.points[kind], y, limit);
+  };
+
+  int64_t total = 0;
+  if (strand != '-')
+  {
+    total += F(forward_ends, hi, all) - F(forward_starts, hi, all)
+           - F(forward_ends, lo, all) + F(forward_starts, lo, all);
+    if (x > 0)
+    {
+      total += F(forward_ends, hi - x, all) - F(forward_ends, hi, all)
+             - F(forward_ends, lo - x, all) + F(forward_ends, lo, all);
+
+      // reads without a cigar are fetched if they end after w - 1 instead of w
+      auto excluded = [&](PointKind kind, int64_t limit)
+      {
+        return F(kind, hi - x, limit) - F(kind, lo - x, limit);
+      };
+      total -= excluded(forward_ends, w + 1)
+             - excluded(no_cigar_forward_ends, w + 1)
+             + excluded(no_cigar_forward_ends, w);
+    }
+  }
+  if (strand != '+')
+  {
+    total += F(reverse_ends, hi, all) - F(reverse_starts, hi, all)
+           - F(reverse_ends, lo, all) + F(reverse_starts, lo, all);
+    if (x > 0)
+    {
+      total += F(reverse_starts, hi, all) - F(reverse_starts, hi + x, all)
+             - F(reverse_starts, lo, all) + F(reverse_starts, lo + x, all);
+
+      int64_t all_count, stop_count, sum;
+      before(chromosome.points[reverse_starts], all, all_count, sum);
+      before(chromosome.points[reverse_starts], stop, stop_count, sum);
+      total -= (all_count - stop_count) * (hi - lo)
+             - (F(reverse_starts, hi + x, all) - F(reverse_starts, hi + x, stop))
+             + (F(reverse_starts, lo + x, all) - F(reverse_starts, lo + x, stop));
+    }
+  }
+  return total;
+}
+
+bool CoverageIndex::liquidate(const std::string& chromosome, unsigned int start, unsigned int stop,
+                              char strand, unsigned int spnum, unsigned int extendlen, uint64_t* counts) const
+{
+  const auto it = chromosomes.find(chromosome);
+  if (it == chromosomes.end() || stop <= start || spnum == 0)
+  {
+    return false;
+  }
+
+  const int64_t pieceLength = (stop-start) / spnum;
+  for (unsigned int i = 0; i < spnum; ++i)
+  {
+    const int64_t lo = start + pieceLength*i;
+    counts[i] = count(it->second, start, stop, lo, lo + pieceLength, strand, extendlen);
+  }
+  return true;
+}
+
+Liquidator::Liquidator(const std::string& bam_file_path):
+  bam_file_path(bam_file_path),
+  bamidx(load_index(bam_file_path)),
+  coverage(CoverageIndex::open(bam_file_path)),
+  blocks(load_block_index(bam_file_path)),
+  fp(open_bam(bam_file_path), samclose)
+{
+  // bam_parse_region otherwise builds the header's name hash on first use, which would race
+  // between the copies sharing the header of a mapped bam file
+  bam_init_header_hash(fp->header);
+}
+
+Liquidator::Liquidator(const Liquidator& other):
+  bam_file_path(other.bam_file_path),
+  bamidx(other.bamidx),
+  coverage(other.coverage),
+  blocks(other.blocks),
+  fp(blocks && blocks->mapped != nullptr ? other.fp : std::shared_ptr<samfile_t>(open_bam(bam_file_path), samclose))
+{}
+
+uint64_t Liquidator::liquidate(const std::string& chromosome, unsigned int start, unsigned int stop,
+                               char strand, unsigned int extension)
+{
+  uint64_t count = 0;
+  if (!coverage || !coverage->liquidate(chromosome, start, stop, strand, 1, extension, &count))
+  {
+    ::liquidate(BamSource{fp.get(), bamidx.get(), blocks.get()}, chromosome, start, stop, strand, 1, extension, &count);
+  }
+  return count;
+}
+
+std::vector<uint64_t> Liquidator::liquidate_bins(const std::string& chromosome, size_t first_bin, size_t last_bin,
+                                                 unsigned int bin_size, char strand, unsigned int extension)
+{
+  return liquidate_bins(chromosome, first_bin, last_bin, bin_size,
+                        std::vector<CountingMode>(1, CountingMode{strand, extension}))[0];
+}
+
+std::vector<std::vector<uint64_t>> Liquidator::liquidate_bins(const std::string& chromosome,
+                                                              size_t first_bin, size_t last_bin,
+                                                              unsigned int bin_size,
+                                                              const std::vector<CountingMode>& modes)
+{
+  return liquidate_bins(chromosome, std::vector<BinRange>(1, BinRange{bin_size, first_bin, last_bin}), modes)[0];
+}
+
+std::vector<std::vector<std::vector<uint64_t>>> Liquidator::liquidate_bins(const std::string& chromosome,
+                                                                           const std::vector<BinRange>& ranges,
+                                                                           const std::vector<CountingMode>& modes)
+{
+  if (!coverage || !coverage->indexed(chromosome))
+  {
+    return ::liquidate_bins(BamSource{fp.get(), bamidx.get(), blocks.get()}, chromosome, ranges, modes);
+  }
+
+  // each bin is fetched as its own region, so each is counted like a single summary point
+  std::vector<std::vector<std::vector<uint64_t>>> counts;
+  for (const BinRange& range : ranges)
+  {
+    const size_t bins = range.last_bin > range.first_bin && range.bin_size > 0 ? range.last_bin - range.first_bin : 0;
+    counts.push_back(std::vector<std::vector<uint64_t>>(modes.size(), std::vector<uint64_t>(bins, 0)));
+    for (size_t m = 0; m < modes.size(); ++m)
+    {
+      for (size_t i = 0; i < bins; ++i)
+      {
+        const unsigned int start = (range.first_bin + i) * range.bin_size;
+        coverage->liquidate(chromosome, start, start + range.bin_size, modes[m].strand, 1, modes[m].extendlen,
+                            &counts.back()[m][i]);
+      }
+    }
+  }
+  return counts;
+}
+
+void Liquidator::liquidate_regions(const std::string& chromosome, std::vector<RegionCount>& regions)
+{
+  if (!coverage || !coverage->indexed(chromosome))
+  {
+    ::liquidate_regions(BamSource{fp.get(), bamidx.get(), blocks.get()}, chromosome, regions);
+    return;
+  }
+
+  for (RegionCount& region : regions)
+  {
+    region.count = 0;
+    coverage->liquidate(chromosome, region.start, region.stop, region.strand, 1, region.extendlen, &region.count);
+  }
+}
+
+bool Liquidator::coverage_indexed() const
+{
+  return coverage != nullptr;
+}
+
+std::vector<ReferenceStats> reference_stats(const std::string& bam_file_path, bool with_window_bytes)
+{
+  std::vector<ReferenceStats> stats;
+  {
+    std::shared_ptr<samfile_t> fp(open_bam(bam_file_path), samclose);
+    for (int32_t i = 0; i < fp->header->n_targets; ++i)
+    {
+      stats.push_back(ReferenceStats{fp->header->target_name[i], fp->header->target_len[i], 0, 0});
+    }
+  }
+
+  std::string index_path;
+  const std::vector<char> index = read_bam_index(bam_file_path, index_path);
+  size_t offset = 0;
+  auto read = [&](void* value, size_t size)
+  {
+    if (index.size() - offset < size)
+    {
+      throw std::runtime_error("truncated bam index " + index_path);
+    }
+    memcpy(value, index.data() + offset, size);
+    offset += size;
+  };
+
+  char magic[4];
+  int32_t references = 0;
+  read(magic, sizeof(magic));
+  read(&references, sizeof(references));
+  if (memcmp(magic, "BAI\1", sizeof(magic)) != 0 || references != (int32_t) stats.size())
+  {
+    throw std::runtime_error("bam index " + index_path + " doesn't match " + bam_file_path);
+  }
+
+  for (ReferenceStats& reference : stats)
+  {
+    // the virtual offset just past the reference's last read
+    uint64_t end = 0;
+    int32_t bins = 0;
+    read(&bins, sizeof(bins));
+    for (int32_t b = 0; b < bins; ++b)
+    {
+      uint32_t bin = 0;
+      int32_t chunks = 0;
+      read(&bin, sizeof(bin));
+      read(&chunks, sizeof(chunks));
+      if (bin == index_metadata_bin && chunks == 2)
+      {
+        uint64_t unmapped_offsets[2];
+        read(unmapped_offsets, sizeof(unmapped_offsets));
+        read(&reference.mapped, sizeof(reference.mapped));
+        read(&reference.unmapped, sizeof(reference.unmapped));
+      }
+      else if (!with_window_bytes)
+      {
+        offset += std::min<size_t>(index.size() - offset, 2 * sizeof(uint64_t) * (size_t) std::max(chunks, 0));
+      }
+      else
+      {
+        for (int32_t c = 0; c < chunks; ++c)
+        {
+          uint64_t chunk[2];
+          read(chunk, sizeof(chunk));
+          end = std::max(end, chunk[1]);
+        }
+      }
+    }
+    int32_t intervals = 0;
+    read(&intervals, sizeof(intervals));
+    if (!with_window_bytes)
+    {
+      offset += std::min<size_t>(index.size() - offset, sizeof(uint64_t) * (size_t) std::max(intervals, 0));
+      continue;
+    }
+    if ((index.size() - offset) / sizeof(uint64_t) < (size_t) std::max(intervals, 0))
+    {
+      throw std::runtime_error("truncated bam index " + index_path);
+    }
+    std::vector<uint64_t> linear(std::max(intervals, 0));
+    read(linear.data(), linear.size() * sizeof(uint64_t));
+
+    // Window w holds the offset of the first read that overlaps it, so the reads starting in
+    // it are about the compressed bytes up to the next window with a later offset.  Windows
+    // without reads are 0 before the first read, and copies of the previous offset after.
+    reference.window_bytes.assign(linear.size(), 0);
+    uint64_t next = end >> 16;
+    for (size_t w = linear.size(); w-- > 0; )
+    {
+      if (linear[w] == 0 || (w > 0 && linear[w - 1] == linear[w]))
+      {
+        continue;
+      }
+      const uint64_t begin = linear[w] >> 16;
+      reference.window_bytes[w] = next > begin ? next - begin : 0;
+      next = begin;
+    }
+  }
+
+  return stats;
 }
@@ -3,6 +3,8 @@
 
 #include <samtools/sam.h>
 
+#include <map>
+#include <memory>
 #include <vector>
 #include <string>
 
@@ -44,6 +46,271 @@ std::vector<double> liquidate(const samfile_t* bamfile, const bam_index_t* bamid
                               char strand, unsigned int spnum,
                               unsigned int extendlen);
 
+/**
+ * Same as above function, except the spnum counts are written to the caller's counts
+ * buffer instead of being returned, so that many ranges can be liquidated into one
+ * preallocated array without intermediate allocations or copies.
+ */
+void liquidate(const samfile_t* bamfile, const bam_index_t* bamidx,
+               const std::string& chromosome,
+               unsigned int start, unsigned int stop,
+               char strand, unsigned int spnum,
+               unsigned int extendlen, uint64_t* counts);
+
+/**
+ * A strand and extension length to count reads with, with the same meaning as the strand
+ * and extendlen arguments to liquidate.
+ */
+struct CountingMode
+{
+  char strand;
+  unsigned int extendlen;
+};
+
+/**
+ * Count the reads in each of the bins [first_bin, last_bin) of a chromosome, where bin
+ * number n covers base pairs [n*bin_size, (n+1)*bin_size).  Unlike calling the above
+ * functions once per bin, this walks the chromosome once in coordinate order with a
+ * single index lookup, adding each read's overlap to every bin it reaches.  The counts
+ * are identical to calling liquidate(fp, bamidx, chromosome, n*bin_size, (n+1)*bin_size,
+ * strand, 1, extendlen) for each bin.  Like the above function, this is not thread safe.
+ *
+ * @return the read counts, where element i is the count for bin first_bin + i
+ */
+std::vector<uint64_t> liquidate_bins(const samfile_t* bamfile, const bam_index_t* bamidx,
+                                     const std::string& chromosome, unsigned int bin_size,
+                                     size_t first_bin, size_t last_bin,
+                                     char strand, unsigned int extendlen);
+
+/**
+ * Same as above function, except the bins are counted with each of the modes from a
+ * single decode of each read, e.g. to get forward, reverse and both strand counts in one
+ * pass.
+ *
+ * @return the read counts, where element m is the counts with modes[m]
+ */
+std::vector<std::vector<uint64_t>> liquidate_bins(const samfile_t* bamfile, const bam_index_t* bamidx,
+                                                  const std::string& chromosome, unsigned int bin_size,
+                                                  size_t first_bin, size_t last_bin,
+                                                  const std::vector<CountingMode>& modes);
+
+/**
+ * The bins [first_bin, last_bin) of bin_size base pairs each, e.g. one level of a
+ * multi-resolution set of bins.
+ */
+struct BinRange
+{
+  unsigned int bin_size;
+  size_t first_bin;
+  size_t last_bin;
+};
+
+/**
+ * Same as above function, except each of the bin ranges is counted from the same single
+ * decode of each read, e.g. to get 1 kb, 10 kb and 100 kb bins over the same part of a
+ * chromosome in one pass.  The counts for each range are identical to calling the above
+ * function with just that range.
+ *
+ * @return the read counts, where element r of m is the counts for ranges[r] with modes[m]
+ */
+std::vector<std::vector<std::vector<uint64_t>>> liquidate_bins(const samfile_t* bamfile, const bam_index_t* bamidx,
+                                                               const std::string& chromosome,
+                                                               const std::vector<BinRange>& ranges,
+                                                               const std::vector<CountingMode>& modes);
+
+/**
+ * A region counted by liquidate_regions, where start, stop, strand and extendlen have the
+ * same meaning as the arguments to liquidate, and count is set to the region's read count.
+ * Each region may have its own strand and extendlen, so the same range may be counted
+ * several ways in one pass by repeating it with different ones.
+ */
+struct RegionCount
+{
+  unsigned int start;
+  unsigned int stop;
+  char strand;
+  unsigned int extendlen;
+  uint64_t count;
+};
+
+/**
+ * Count the reads in each of the regions, which must all be on the chromosome and be
+ * sorted by start.  Instead of one index lookup and fetch per region, this fetches once
+ * across all of the regions and sweeps through the reads and regions together, adding
+ * each read to the currently open regions it overlaps.  Reads shared by overlapping or
+ * neighbouring regions are decompressed and decoded only once, and the cost scales with
+ * the number of reads plus overlaps rather than reads times regions.
+ * The counts are identical to calling liquidate(fp, bamidx, chromosome, start, stop,
+ * strand, 1, extendlen) for each region.  Like the above functions that take a
+ * samfile_t, this is not thread safe.
+ */
+void liquidate_regions(const samfile_t* bamfile, const bam_index_t* bamidx,
+                       const std::string& chromosome, std::vector<RegionCount>& regions);
+
+/**
+ * A coverage index is a sidecar file next to a bam file (see coverage_index_path), built
+ * once by build_coverage_index, that answers the same queries as liquidate without
+ * reading the bam file again.  For every chromosome it stores the sorted start and end
+ * positions of the forward and reverse reads, along with the number and sum of the
+ * positions before every resolution base pairs, so each count is a few block lookups plus
+ * a scan of at most one block per lookup, regardless of how many reads the range has.
+ * Every strand and extension is answered from the same index, and the counts are
+ * identical to liquidating the bam file, including reads that are only partly counted
+ * because they are extended into the range.
+ *
+ * The index records the size and modification time of the bam file, and open returns null
+ * if there is no index or if it is stale, so callers fall back to the bam file.  The index
+ * is memory mapped read-only, and may be used simultaneously in different threads.
+ */
+class CoverageIndex
+{
+public:
+  // returns null if the bam file has no coverage index, or its index is stale or unreadable
+  static std::shared_ptr<const CoverageIndex> open(const std::string& bam_file_path);
+
+  CoverageIndex(const CoverageIndex&) = delete;
+  CoverageIndex& operator=(const CoverageIndex&) = delete;
+  ~CoverageIndex();
+
+  /**
+   * Sets counts to the same spnum counts as liquidate, returning false instead if the
+   * chromosome isn't indexed (e.g. it isn't in the bam file), or stop isn't after start, in
+   * which case the bam file should be liquidated instead.
+   */
+  bool liquidate(const std::string& chromosome, unsigned int start, unsigned int stop,
+                 char strand, unsigned int spnum, unsigned int extendlen, uint64_t* counts) const;
+
+  // true if liquidate answers queries on the chromosome
+  bool indexed(const std::string& chromosome) const;
+
+private:
+  // the sorted positions of one kind of read end on one chromosome
+  struct Points
+  {
+    // blocks[2*k] and blocks[2*k + 1] are the number and sum of the positions before
+    // k*resolution, for k in [0, number_of_blocks]
+    const uint64_t* blocks;
+    uint64_t number_of_blocks;
+    // the positions in block k are k*resolution + offsets[i] for i in
+    // [blocks[2*k], blocks[2*(k+1)])
+    const uint16_t* offsets;
+  };
+
+  struct Chromosome
+  {
+    std::vector<Points> points;
+  };
+
+  CoverageIndex(void* data, size_t size);
+
+  void before(const Points& points, int64_t x, int64_t& count, int64_t& sum) const;
+  int64_t sum_min(const Points& points, int64_t y, int64_t limit) const;
+  int64_t count(const Chromosome& chromosome, int64_t start, int64_t stop, int64_t lo, int64_t hi,
+                char strand, int64_t extendlen) const;
+
+  void* data;
+  size_t size;
+  uint32_t resolution;
+  std::map<std::string, Chromosome> chromosomes;
+};
+
+// e.g. "/data/mm1s.bam.coverage" for "/data/mm1s.bam"
+std::string coverage_index_path(const std::string& bam_file_path);
+
+/**
+ * Writes the coverage index of the bam file, sweeping through each chromosome once.  The
+ * index is written to a temporary file and then renamed into place, so concurrent readers
+ * see either the old index or the new one.  A smaller resolution (at most 65536) makes
+ * queries faster and the index larger.  Throws if the bam file or its index can't be read
+ * or the coverage index can't be written.
+ */
+void build_coverage_index(const std::string& bam_file_path, unsigned int resolution);
+
+// the number of base pairs in each window of a .bai linear index
+const unsigned int linear_index_window = 1 << 14;
+
+// A reference sequence in a bam file's header, with the number of mapped and unmapped reads
+// on it from the bam index -- the same as a line of samtools idxstats.  window_bytes[w]
+// estimates how many compressed bytes of the bam file hold the reads starting in window w of
+// linear_index_window base pairs, from the offsets in the linear index, and is empty if the
+// reference has no reads or window_bytes wasn't requested.
+struct ReferenceStats
+{
+  std::string name;
+  size_t length;
+  uint64_t mapped;
+  uint64_t unmapped;
+  std::vector<uint64_t> window_bytes;
+};
+
+/**
+ * Reads the reference sequences of the bam file from its header, and their read counts (and
+ * window_bytes if with_window_bytes) from the .bai index, without reading any alignments or
+ * keeping the index in memory.  Throws if the bam file or its index can't be read.
+ */
+std::vector<ReferenceStats> reference_stats(const std::string& bam_file_path, bool with_window_bytes);
+
+// the value of the environment variable (e.g. one of the BAMLIQUIDATOR_ tunables), or
+// default_value if it isn't set to a number
+uint64_t environment_number(const char* name, uint64_t default_value);
+
+// the bins and linear index of a bam file's .bai index, see bamliquidator.cpp
+struct BlockIndex;
+
+/**
+ * A bam file opened for liquidating, for use with tbb::enumerable_thread_specific or
+ * anything else that gives each thread its own copy.  The bam index is loaded once, when
+ * the first Liquidator is constructed from the bam file path, and then shared read-only
+ * by every copy, while each copy opens its own file handle (and so has its own
+ * decompression state).  A single Liquidator is not thread safe, but copies of the same
+ * Liquidator may be used simultaneously in different threads.  If the bam file has an up
+ * to date coverage index, then it is shared the same way, and queries are answered from
+ * it instead of the bam file.  The .bai index is also parsed once and shared, so that fetches
+ * over many blocks (e.g. a whole chromosome) read the blocks ahead and inflate them on helper
+ * threads while the reads are counted, instead of inflating every block on the calling thread.
+ * With BAMLIQUIDATOR_MMAP=1 in the environment, the bam file is instead mapped once and the
+ * copies share the mapping and the header without opening the file again, and every fetch
+ * inflates its blocks straight from the mapped pages.
+ */
+class Liquidator
+{
+public:
+  // throws if the bam file or its index can't be opened
+  explicit Liquidator(const std::string& bam_file_path);
+  Liquidator(const Liquidator& other);
+  Liquidator& operator=(const Liquidator& other) = delete;
+
+  // the count for the range [start, stop) as a single summary point
+  uint64_t liquidate(const std::string& chromosome, unsigned int start, unsigned int stop,
+                     char strand, unsigned int extension);
+
+  std::vector<uint64_t> liquidate_bins(const std::string& chromosome, size_t first_bin, size_t last_bin,
+                                       unsigned int bin_size, char strand, unsigned int extension);
+
+  std::vector<std::vector<uint64_t>> liquidate_bins(const std::string& chromosome, size_t first_bin, size_t last_bin,
+                                                    unsigned int bin_size, const std::vector<CountingMode>& modes);
+
+  std::vector<std::vector<std::vector<uint64_t>>> liquidate_bins(const std::string& chromosome,
+                                                                 const std::vector<BinRange>& ranges,
+                                                                 const std::vector<CountingMode>& modes);
+
+  void liquidate_regions(const std::string& chromosome, std::vector<RegionCount>& regions);
+
+  // true if the bam file has an up to date coverage index, which then answers the queries
+  bool coverage_indexed() const;
+
+private:
+  const std::string bam_file_path;
+  const std::shared_ptr<const bam_index_t> bamidx;
+  // null unless the bam file has an up to date coverage index, which then answers every query
+  // on the chromosomes it indexes
+  const std::shared_ptr<const CoverageIndex> coverage;
+  // null if the .bai index couldn't be parsed, in which case every fetch uses bam_fetch
+  const std::shared_ptr<const BlockIndex> blocks;
+  // each copy opens its own, unless the bam file is mapped, when only the header is used
+  const std::shared_ptr<samfile_t> fp;
+};
+
 /* The MIT License (MIT) 
 
    Copyright (c) 2013 Xin Zhong and Charles Lin
@@ -1,8 +1,20 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/stat.h>
 
-#include <vector>
+#include <condition_variable>
+#include <deque>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
 #include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/algorithm/string.hpp>
 
 #include "bamliquidator.h"
 
@@ -29,6 +41,55 @@
    THE SOFTWARE. 
  */
 
+// parses the seven query fields (bam file through extension length), returning an error
+// message, or an empty string on success
+std::string parseQuery(char* const fields[],
+                       std::string& bamfile, std::string& chromosome,
+                       unsigned int& start, unsigned int& stop,
+                       char& strand, unsigned int& spnum,
+                       unsigned int& extendlen)
+{
+  char message[1024];
+
+  bamfile=fields[0];
+  chromosome=fields[1];
+
+  char* tail=NULL;
+  start=strtol(fields[2],&tail,10);
+  if(tail[0]!='\0')
+  {
+    snprintf(message, sizeof(message), "wrong start (%s)", fields[2]);
+    return message;
+  }
+  stop=strtol(fields[3],&tail,10);
+  if(tail[0]!='\0' || stop<=start)
+  {
+    snprintf(message, sizeof(message), "wrong stop (%s)", fields[3]);
+    return message;
+  }
+  strand=fields[4][0];
+  if(strand!='+' && strand!='-' && strand!='.')
+  {
+    return "wrong strand, must be +/-/.";
+  }
+  spnum=strtol(fields[5],&tail,10);
+  if(tail[0]!='\0' || spnum<=0)
+  {
+    snprintf(message, sizeof(message), "wrong spnum (%s)", fields[5]);
+    return message;
+  }
+  extendlen=(unsigned short)strtol(fields[6],&tail,10);
+  if(tail[0]!='\0')
+  {
+    snprintf(message, sizeof(message), "wrong extension length (%s)", fields[6]);
+    return message;
+  }
+
+  return "";
+}
+
+const unsigned int default_coverage_resolution = 4096;
+
 int parseArgs(std::string& bamfile, std::string& chromosome, 
               unsigned int& start, unsigned int& stop,
               char& strand, unsigned int& spnum,
@@ -37,43 +98,281 @@ int parseArgs(std::string& bamfile, std::string& chromosome,
 {
   if(argc!=8)
   {
-    printf("[ bamliquidator ] output to stdout\n1. bam file (.bai file has to be at same location)\n2. chromosome\n3. start\n4. stop\n5. strand +/-, use dot (.) for both strands\n6. number of summary points\n7. extension length\n\nNote that each summary point is floor((stop-start)/(number of summary points)) long,\nand if it doesn't divide evenly then the range is truncated.\n");
+    printf("[ bamliquidator ] output to stdout\n1. bam file (.bai file has to be at same location)\n2. chromosome\n3. start\n4. stop\n5. strand +/-, use dot (.) for both strands\n6. number of summary points\n7. extension length\n\nNote that each summary point is floor((stop-start)/(number of summary points)) long,\nand if it doesn't divide evenly then the range is truncated.\n\nAlternatively, run as a server with\n  bamliquidator --server [number of threads] [max open bam files]\nwhich reads one query per line from stdin, with the tab separated fields\n  id, bam file, chromosome, start, stop, strand, number of summary points, extension length\nand writes one line to stdout per query, with the tab separated fields\n  id, count 1, ..., count n\nor on failure\n  id, ERROR, error message\nResponses may be written in a different order than the queries were read.\n\nTo answer queries without reading the bam file again, first build a coverage index with\n  bamliquidator --coverage-index bam_file [resolution]\nwhich is written next to the bam file as bam_file.coverage, and is used by every query on the\nbam file until the bam file is modified.  The resolution (default %u, at most 65536) trades\nindex size for query time.\n", default_coverage_resolution);
     return 1;
   }
 
-  bamfile=argv[1];
-  chromosome=argv[2];
-
-  char* tail=NULL;
-  start=strtol(argv[3],&tail,10);
-  if(tail[0]!='\0')
+  const std::string error = parseQuery(argv + 1, bamfile, chromosome, start, stop, strand, spnum, extendlen);
+  if(!error.empty())
   {
-    fprintf(stderr, "wrong start (%s)\n", argv[3]);
+    fprintf(stderr, "%s\n", error.c_str());
     return 1;
   }
-  stop=strtol(argv[4],&tail,10);
-  if(tail[0]!='\0' || stop<=start)
+
+  return 0;
+}
+
+// A bam file and its index, opened for reading.  A handle may only be used by one thread
+// at a time.
+struct BamHandle
+{
+  std::string path;
+  // the size and modification time when opened, to detect the file being replaced
+  off_t size;
+  time_t mtime;
+  samfile_t* fp;
+  bam_index_t* bamidx;
+  // null unless the bam file has an up to date coverage index
+  std::shared_ptr<const CoverageIndex> coverage;
+};
+
+// Keeps recently used BamHandles open so that repeated queries on the same bam file
+// don't pay for reopening the file and reloading the index.  Handles are exclusively
+// checked out while in use, so a file queried from several threads at once gets several
+// handles, and the least recently used idle handles are closed beyond capacity.
+class BamHandleCache
+{
+public:
+  explicit BamHandleCache(size_t capacity):
+    capacity(capacity)
+  {}
+
+  BamHandleCache(const BamHandleCache&) = delete;
+  BamHandleCache& operator=(const BamHandleCache&) = delete;
+
+  ~BamHandleCache()
   {
-    fprintf(stderr, "wrong stop (%s)\n", argv[4]);
-    return 1;
+    for (BamHandle* handle : idle)
+    {
+      close(handle);
+    }
   }
-  strand=argv[5][0];
-  if(strand!='+' && strand!='-' && strand!='.')
+
+  // the caller has exclusive use of the returned handle until passing it to checkin
+  BamHandle* checkout(const std::string& path)
   {
-    fputs("wrong strand, must be +/-/.\n",stderr);
-    return 1;
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0)
+    {
+      throw std::runtime_error("stat() error with " + path);
+    }
+
+    BamHandle* stale = nullptr;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      for (auto it = idle.begin(); it != idle.end(); ++it)
+      {
+        if ((*it)->path == path)
+        {
+          BamHandle* handle = *it;
+          idle.erase(it);
+          if (handle->size == st.st_size && handle->mtime == st.st_mtime)
+          {
+            return handle;
+          }
+          stale = handle;
+          break;
+        }
+      }
+    }
+    if (stale != nullptr)
+    {
+      close(stale);
+    }
+
+    BamHandle* handle = new BamHandle();
+    handle->path = path;
+    handle->size = st.st_size;
+    handle->mtime = st.st_mtime;
+    handle->fp = samopen(path.c_str(), "rb", 0);
+    if (handle->fp == NULL)
+    {
+      delete handle;
+      throw std::runtime_error("samopen() error with " + path);
+    }
+    handle->bamidx = bam_index_load(path.c_str());
+    if (handle->bamidx == NULL)
+    {
+      samclose(handle->fp);
+      delete handle;
+      throw std::runtime_error("bam_index_load() error with " + path);
+    }
+    handle->coverage = CoverageIndex::open(path);
+    return handle;
   }
-  spnum=strtol(argv[6],&tail,10);
-  if(tail[0]!='\0' || spnum<=0)
+
+  void checkin(BamHandle* handle)
   {
-    fprintf(stderr, "wrong spnum (%s)\n", argv[6]);
-    return 1;
+    std::vector<BamHandle*> evicted;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      idle.push_front(handle);
+      while (idle.size() > capacity)
+      {
+        evicted.push_back(idle.back());
+        idle.pop_back();
+      }
+    }
+    for (BamHandle* evict : evicted)
+    {
+      close(evict);
+    }
   }
-  extendlen=(unsigned short)strtol(argv[7],&tail,10);
-  if(tail[0]!='\0')
+
+private:
+  const size_t capacity;
+  std::mutex mutex;
+  std::list<BamHandle*> idle; // most recently used first
+
+  static void close(BamHandle* handle)
   {
-    fprintf(stderr, "wrong extension length (%s)\n", argv[7]);
-    return 1;
+    bam_index_destroy(handle->bamidx);
+    samclose(handle->fp);
+    delete handle;
+  }
+};
+
+// answers a single server query line, returning the response line
+std::string serve(const std::string& line, BamHandleCache& cache)
+{
+  std::vector<std::string> fields;
+  boost::split(fields, line, boost::is_any_of("\t"));
+
+  std::stringstream response;
+  response << fields[0];
+
+  try
+  {
+    if (fields.size() != 8)
+    {
+      throw std::runtime_error("expected 8 tab separated fields");
+    }
+
+    std::vector<char*> query;
+    for (size_t i = 1; i < fields.size(); ++i)
+    {
+      query.push_back(&fields[i][0]);
+    }
+
+    std::string bamfile;
+    std::string chromosome;
+    unsigned int start = 0;
+    unsigned int stop  = 0;
+    char strand = 0;
+    unsigned int spnum = 0;
+    unsigned int extendlen = 0;
+    const std::string error = parseQuery(query.data(), bamfile, chromosome, start, stop, strand, spnum, extendlen);
+    if (!error.empty())
+    {
+      throw std::runtime_error(error);
+    }
+
+    BamHandle* handle = cache.checkout(bamfile);
+    std::vector<double> counts;
+    try
+    {
+      std::vector<uint64_t> index_counts(spnum, 0);
+      if (handle->coverage && handle->coverage->liquidate(chromosome, start, stop, strand, spnum, extendlen,
+                                                          index_counts.data()))
+      {
+        counts.assign(index_counts.begin(), index_counts.end());
+      }
+      else
+      {
+        counts = liquidate(handle->fp, handle->bamidx, chromosome, start, stop, strand, spnum, extendlen);
+      }
+    }
+    catch(...)
+    {
+      cache.checkin(handle);
+      throw;
+    }
+    cache.checkin(handle);
+
+    for(double count : counts)
+    {
+      response << '\t' << (int) count;
+    }
+  }
+  catch(const std::exception& e)
+  {
+    response.str("");
+    response << fields[0] << "\tERROR\t" << e.what();
+  }
+
+  response << '\n';
+  return response.str();
+}
+
+// Reads queries from stdin until EOF, answering them on a pool of threads.
+int runServer(unsigned int number_of_threads, size_t max_open_files)
+{
+  BamHandleCache cache(max_open_files);
+
+  std::mutex queue_mutex;
+  std::condition_variable queue_changed;
+  std::deque<std::string> queue;
+  bool done = false;
+  const size_t max_queued = 4 * number_of_threads;
+
+  std::mutex output_mutex;
+
+  std::vector<std::thread> workers;
+  for (unsigned int i = 0; i < number_of_threads; ++i)
+  {
+    workers.push_back(std::thread([&]()
+    {
+      for (;;)
+      {
+        std::string line;
+        {
+          std::unique_lock<std::mutex> lock(queue_mutex);
+          queue_changed.wait(lock, [&]() { return done || !queue.empty(); });
+          if (queue.empty())
+          {
+            return;
+          }
+          line = queue.front();
+          queue.pop_front();
+        }
+        queue_changed.notify_all();
+
+        const std::string response = serve(line, cache);
+
+        std::lock_guard<std::mutex> lock(output_mutex);
+        fwrite(response.data(), 1, response.size(), stdout);
+        fflush(stdout);
+      }
+    }));
+  }
+
+  for (std::string line; std::getline(std::cin, line); )
+  {
+    if (!line.empty() && line[line.size() - 1] == '\r')
+    {
+      line.erase(line.size() - 1);
+    }
+    if (line.empty())
+    {
+      continue;
+    }
+
+    std::unique_lock<std::mutex> lock(queue_mutex);
+    queue_changed.wait(lock, [&]() { return queue.size() < max_queued; });
+    queue.push_back(line);
+    lock.unlock();
+    queue_changed.notify_all();
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(queue_mutex);
+    done = true;
+  }
+  queue_changed.notify_all();
+
+  for (std::thread& worker : workers)
+  {
+    worker.join();
   }
 
   return 0;
@@ -81,6 +380,63 @@ int parseArgs(std::string& bamfile, std::string& chromosome,
 
 int main(int argc, char* argv[])
 {
+  if (argc >= 2 && std::string(argv[1]) == "--server")
+  {
+    unsigned int number_of_threads = std::thread::hardware_concurrency();
+    size_t max_open_files = 64;
+    char* tail=NULL;
+    if (argc >= 3)
+    {
+      number_of_threads = strtol(argv[2],&tail,10);
+      if (tail[0]!='\0')
+      {
+        fprintf(stderr, "wrong number of threads (%s)\n", argv[2]);
+        return 1;
+      }
+    }
+    if (argc >= 4)
+    {
+      max_open_files = strtol(argv[3],&tail,10);
+      if (tail[0]!='\0')
+      {
+        fprintf(stderr, "wrong max open bam files (%s)\n", argv[3]);
+        return 1;
+      }
+    }
+    if (number_of_threads == 0)
+    {
+      number_of_threads = 1;
+    }
+
+    return runServer(number_of_threads, max_open_files);
+  }
+
+  if ((argc == 3 || argc == 4) && std::string(argv[1]) == "--coverage-index")
+  {
+    unsigned int resolution = default_coverage_resolution;
+    char* tail=NULL;
+    if (argc == 4)
+    {
+      resolution = strtol(argv[3],&tail,10);
+      if (tail[0]!='\0')
+      {
+        fprintf(stderr, "wrong resolution (%s)\n", argv[3]);
+        return 1;
+      }
+    }
+
+    try
+    {
+      build_coverage_index(argv[2], resolution);
+    }
+    catch(const std::exception& e)
+    {
+      fprintf(stderr, "%s\n", e.what());
+      return 1;
+    }
+    return 0;
+  }
+
   std::string bamfile;
   std::string chromosome;
   unsigned int start = 0;
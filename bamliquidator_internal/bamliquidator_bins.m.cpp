@@ -1,9 +1,14 @@
 #include "bamliquidator.h"
 #include "bamliquidator_util.h"
 
+#include <algorithm>
+#include <atomic>
 #include <cmath>
+#include <cstring>
 #include <fstream>
 #include <iostream>
+#include <map>
+#include <memory>
 #include <sstream>
 #include <stdexcept>
 #include <string>
@@ -18,6 +23,7 @@
 #include <tbb/blocked_range.h>
 #include <tbb/enumerable_thread_specific.h>
 #include <tbb/parallel_for.h>
+#include <tbb/pipeline.h>
 #include <tbb/task_scheduler_init.h>
 
 // this CountH5Record must match exactly the structure in HDF5
@@ -32,7 +38,7 @@ struct CountH5Record
 };
 
 
-void write(hid_t& file,
+void write(hid_t& file, const std::string& table_name,
            const std::vector<CountH5Record>& records)
 {
   const size_t record_size = sizeof(CountH5Record);
@@ -49,74 +55,102 @@ void write(hid_t& file,
                            sizeof(CountH5Record::count),
                            sizeof(CountH5Record::bam_file_key) };
 
-  herr_t status = H5TBappend_records(file, "bin_counts", records.size(), record_size,
+  herr_t status = H5TBappend_records(file, table_name.c_str(), records.size(), record_size,
                                      record_offset, field_sizes, records.data());
   if (status != 0)
   {
     std::stringstream ss;
-    ss << "Failed to append records, status = " << status;
+    ss << "Failed to append records to " << table_name << ", status = " << status;
     throw std::runtime_error(ss.str());
   }
 }
 
-class Liquidator 
+// this CompactCountH5Record must match exactly the structure in HDF5
+// -- see the compact layout in bamliquidator_batch.py BinLiquidator.create_counts_table
+struct CompactCountH5Record
 {
-public:
-  Liquidator(const std::string& bam_file_path):
-    bam_file_path(bam_file_path),
-    fp(nullptr),
-    bamidx(nullptr)
-  {
-    init();
-  }
+  uint32_t bin_number;
+  uint16_t cell_type_key;
+  uint32_t chromosome_key;
+  uint64_t count;
+  uint32_t bam_file_key;
+};
 
-  Liquidator(const Liquidator& other):
-    bam_file_path(other.bam_file_path),
-    fp(nullptr),
-    bamidx(nullptr)
-  {
-    init();
-  }
+void write(hid_t& file, const std::string& table_name,
+           const std::vector<CompactCountH5Record>& records)
+{
+  const size_t record_size = sizeof(CompactCountH5Record);
 
-  Liquidator& operator=(const Liquidator& other) = delete;
+  size_t record_offset[] = { HOFFSET(CompactCountH5Record, bin_number), 
+                             HOFFSET(CompactCountH5Record, cell_type_key),
+                             HOFFSET(CompactCountH5Record, chromosome_key),
+                             HOFFSET(CompactCountH5Record, count),
+                             HOFFSET(CompactCountH5Record, bam_file_key) };
 
-  ~Liquidator()
+  size_t field_sizes[] = { sizeof(CompactCountH5Record::bin_number),
+                           sizeof(CompactCountH5Record::cell_type_key),
+                           sizeof(CompactCountH5Record::chromosome_key),
+                           sizeof(CompactCountH5Record::count),
+                           sizeof(CompactCountH5Record::bam_file_key) };
+
+  herr_t status = H5TBappend_records(file, table_name.c_str(), records.size(), record_size,
+                                     record_offset, field_sizes, records.data());
+  if (status != 0)
   {
-    bam_index_destroy(bamidx);
-    samclose(fp);
+    std::stringstream ss;
+    ss << "Failed to append records to " << table_name << ", status = " << status;
+    throw std::runtime_error(ss.str());
   }
+}
 
-  double liquidate(const std::string& chromosome, int start, int stop, char strand, unsigned int extension)
+// writes the records with keys instead of names if the file has the compact layout
+void write(hid_t& file, const std::string& table_name,
+           const std::vector<CountH5Record>& records, const NameKeys& keys)
+{
+  if (records.empty())
   {
-    std::vector<double> counts = ::liquidate(fp, bamidx, chromosome, start, stop, strand, 1, extension);
-    if (counts.size() != 1)
-    {
-      throw std::runtime_error("liquidate failed to provide exactly one count (count is " +
-        boost::lexical_cast<std::string>(counts.size()) + ")");
-    }
-    return counts[0];
+    return;
   }
 
-private:
-  std::string bam_file_path;
-  samfile_t* fp;
-  bam_index_t* bamidx;
+  if (!keys.compact())
+  {
+    write(file, table_name, records);
+    return;
+  }
 
-  void init()
+  std::vector<CompactCountH5Record> compact_records(records.size());
+  for (size_t i=0; i < records.size(); ++i)
   {
-    fp = samopen(bam_file_path.c_str(),"rb",0);
-    if(fp == NULL)
+    const CountH5Record& record = records[i];
+    CompactCountH5Record& compact_record = compact_records[i];
+    compact_record.bin_number = record.bin_number;
+    compact_record.count = record.count;
+    compact_record.bam_file_key = record.bam_file_key;
+    if (i > 0 && strcmp(record.chromosome, records[i-1].chromosome) == 0
+              && strcmp(record.cell_type, records[i-1].cell_type) == 0)
     {
-      throw std::runtime_error("samopen() error with " + bam_file_path);
+      compact_record.chromosome_key = compact_records[i-1].chromosome_key;
+      compact_record.cell_type_key = compact_records[i-1].cell_type_key;
     }
-
-    bamidx = bam_index_load(bam_file_path.c_str());
-    if (bamidx == NULL)
+    else
     {
-      throw std::runtime_error("bam_index_load() error with " + bam_file_path);
+      compact_record.chromosome_key = name_key(keys.chromosomes, record.chromosome);
+      compact_record.cell_type_key = name_key(keys.cell_types, record.cell_type);
     }
   }
-};
+  write(file, table_name, compact_records);
+}
+
+// true if bamliquidator_batch.py created the bin_counts table with --sparse, in which case
+// only the bins with nonzero counts are written, along with the last bin of each chromosome
+// so that the number of bins in the chromosome is still known
+bool is_sparse(hid_t& file)
+{
+  int sparse = 0;
+  return H5Aexists_by_name(file, "bin_counts", "sparse", H5P_DEFAULT) > 0
+      && H5LTget_attribute_int(file, "bin_counts", "sparse", &sparse) >= 0
+      && sparse == 1;
+}
 
 // my testing doesn't show using ets keys significantly improving performance,
 // but it doesn't hurt and I guess might help with the right hardware
@@ -126,113 +160,479 @@ typedef tbb::enumerable_thread_specific<Liquidator,
         Liquidators;
 
 
-void liquidate_bins(std::vector<CountH5Record>& counts, const std::string& bam_file_path,
-                    size_t region_begin, size_t region_end, const size_t bin_size,
-                    unsigned int extension, const char strand,
-                    Liquidators& liquidators)
+// A run of consecutive base pairs [start, stop) on a single chromosome, which is liquidated
+// with a single sweep through the bam file.  With several bin sizes, start and stop are
+// multiples of the largest bin size (except stop at the end of the chromosome), so that
+// every bin is in exactly one shard.
+struct Shard
 {
-  Liquidator& liquidator = liquidators.local();
+  std::string chromosome;
+  size_t chromosome_length;
+  size_t start;
+  size_t stop;
+};
+
+// Each shard sweeps at most this many base pairs, which is large enough that the index
+// lookup and the reads spanning shard boundaries are negligible, but small enough that
+// large chromosomes are still split up between threads.
+const size_t shard_base_pairs = 8000000;
+
+// A shard is cut short once it holds about this many compressed bytes of the bam file, so
+// that pileups like chrM and dense chromosomes are split between threads while sparse
+// stretches are still swept together, and no single shard holds up the others.
+const uint64_t shard_bytes = 4 << 20;
+
+// At most this many shards are liquidated or wait in memory to be written at once, so that
+// memory use doesn't grow with the genome size or the number of bins.
+const size_t max_shards_in_flight = 64;
 
-  for (size_t i=region_begin; i < region_end; ++i)
+// the estimated compressed bytes of the reads starting before base pair position, from the
+// running totals of the linear index windows of a chromosome
+uint64_t bytes_before(const std::vector<uint64_t>& window_totals, const size_t position)
+{
+  const size_t w = position / linear_index_window;
+  if (w + 1 >= window_totals.size())
   {
-    try
+    return window_totals.back();
+  }
+  const uint64_t window = window_totals[w + 1] - window_totals[w];
+  return window_totals[w] + window * (position % linear_index_window) / linear_index_window;
+}
+
+// Cuts the chromosomes into shards of about shard_bytes, estimated from the bam file's
+// linear index, or shard_base_pairs if shorter.  Without an index the shards are all
+// shard_base_pairs, and liquidating reports the error.
+std::vector<Shard> shards(const BamFile& bam_file, const std::vector<unsigned int>& bin_sizes)
+{
+  const size_t largest_bin_size = *std::max_element(bin_sizes.begin(), bin_sizes.end());
+  const size_t shard_length = std::max<size_t>(1, shard_base_pairs / largest_bin_size) * largest_bin_size;
+
+  std::map<std::string, std::vector<uint64_t>> window_totals;
+  try
+  {
+    for (const ReferenceStats& reference : reference_stats(bam_file.path, true))
     {
-      const size_t start = counts[i].bin_number * bin_size;
-      const size_t stop = start + bin_size;
-      counts[i].count = liquidator.liquidate(counts[i].chromosome,
-                                              start, 
-                                              stop, 
-                                              strand,
-                                              extension);
-    } catch(const std::exception& e)
+      std::vector<uint64_t>& totals = window_totals[reference.name];
+      totals.push_back(0);
+      for (const uint64_t bytes : reference.window_bytes)
+      {
+        totals.push_back(totals.back() + bytes);
+      }
+    }
+  }
+  catch (const std::exception&)
+  {
+    window_totals.clear();
+  }
+
+  std::vector<Shard> shards;
+  for (auto& chr_length : bam_file.chromosome_lengths)
+  {
+    const std::vector<uint64_t> no_reads(1, 0);
+    const auto totals = window_totals.find(chr_length.first);
+    const std::vector<uint64_t>& chr_totals = totals == window_totals.end() ? no_reads : totals->second;
+
+    for (size_t start = 0; start < chr_length.second; )
     {
-      Logger::warn() << "Skipping " << counts[i].chromosome
-                     << " bin " << i << " due to error: " << e.what();
+      Shard shard;
+      shard.chromosome = chr_length.first;
+      shard.chromosome_length = chr_length.second;
+      shard.start = start;
+      shard.stop = start + largest_bin_size;
+      const uint64_t start_bytes = bytes_before(chr_totals, start);
+      while (shard.stop - start < shard_length && shard.stop < chr_length.second
+             && bytes_before(chr_totals, shard.stop) - start_bytes < shard_bytes)
+      {
+        shard.stop += largest_bin_size;
+      }
+      shards.push_back(shard);
+      start = shard.stop;
     }
   }
+
+  return shards;
 }
 
-void batch_liquidate(std::vector<CountH5Record>& counts,
-                     const unsigned int bin_size,
-                     const unsigned int extension,
-                     const char strand,
-                     const std::string& bam_file_path)
+size_t chromosome_bins(const Shard& shard, const unsigned int bin_size)
 {
-  Liquidators liquidators((Liquidator(bam_file_path))); 
-
-  tbb::parallel_for(
-    tbb::blocked_range<int>(0, counts.size(), 1),
-    [&](const tbb::blocked_range<int>& range)
-    {
-      liquidate_bins(counts, bam_file_path, range.begin(), range.end(), bin_size, extension, strand, liquidators);
-    },
-    tbb::auto_partitioner());
+  return std::ceil(shard.chromosome_length / (double) bin_size);
 }
 
-std::vector<CountH5Record> count_placeholders(
-  const std::vector<std::pair<std::string, size_t>>& chromosome_lengths,
-  const std::string& cell_type,
-  const unsigned int bam_file_key,
-  const unsigned int bin_size)
+// the bins of bin_size in the shard
+BinRange shard_bins(const Shard& shard, const unsigned int bin_size)
 {
-  size_t num_records = 0;
-  for (auto& chr_length : chromosome_lengths)
-  {
-    int bins = std::ceil(chr_length.second / (double) bin_size);
-    num_records += bins; 
-  }
+  const size_t stop_bin = (shard.stop + bin_size - 1) / bin_size;
+  return BinRange{bin_size, shard.start / bin_size, std::min(chromosome_bins(shard, bin_size), stop_bin)};
+}
+
+// the records of a single shard, where element m is the records for modes[m]
+typedef std::vector<std::vector<CountH5Record>> ModeCounts;
+
+// the records of a single shard, where element l is the records for bin_sizes[l]
+typedef std::vector<ModeCounts> LevelCounts;
 
+std::vector<CountH5Record> count_placeholders(const Shard& shard, const BinRange& bins,
+                                              const std::string& cell_type, const unsigned int bam_file_key)
+{
   CountH5Record empty_record;
   empty_record.bam_file_key = bam_file_key;
   empty_record.bin_number = 0;
   empty_record.count      = 0;
   copy(empty_record.cell_type, cell_type, sizeof(CountH5Record::cell_type));
-  copy(empty_record.chromosome, "", sizeof(CountH5Record::chromosome));
+  copy(empty_record.chromosome, shard.chromosome, sizeof(CountH5Record::chromosome));
 
-  std::vector<CountH5Record> records(num_records, empty_record);
+  std::vector<CountH5Record> records(bins.last_bin - bins.first_bin, empty_record);
+  for (size_t i=0; i < records.size(); ++i)
+  {
+    records[i].bin_number = bins.first_bin + i;
+  }
+
+  return records;
+}
 
-  size_t i=0;
-  for (auto& chr_length : chromosome_lengths)
+// the placeholder records of the shard, and in ranges the bins of each size in the shard
+LevelCounts shard_placeholders(const Shard& shard, const BamFile& bam_file, const std::vector<unsigned int>& bin_sizes,
+                               const size_t modes, std::vector<BinRange>& ranges)
+{
+  LevelCounts counts;
+  for (const unsigned int bin_size : bin_sizes)
+  {
+    ranges.push_back(shard_bins(shard, bin_size));
+    counts.push_back(ModeCounts(modes, count_placeholders(shard, ranges.back(), bam_file.cell_type, bam_file.key)));
+  }
+  return counts;
+}
+
+// the number of counts the shard has in a cache entry, which are stored level major, then
+// mode major, then in bin order
+size_t shard_cache_size(const Shard& shard, const std::vector<unsigned int>& bin_sizes, const size_t modes)
+{
+  size_t size = 0;
+  for (const unsigned int bin_size : bin_sizes)
   {
-    int bins = std::ceil(chr_length.second / (double) bin_size);
-    for (int j=0; j < bins; ++j, ++i)
+    const BinRange bins = shard_bins(shard, bin_size);
+    size += (bins.last_bin - bins.first_bin) * modes;
+  }
+  return size;
+}
+
+void remove_zero_counts(LevelCounts& counts, const Shard& shard, const std::vector<unsigned int>& bin_sizes)
+{
+  for (size_t l=0; l < counts.size(); ++l)
+  {
+    const size_t bins = chromosome_bins(shard, bin_sizes[l]);
+    for (std::vector<CountH5Record>& records : counts[l])
     {
-      records[i].bin_number = j;
-      copy(records[i].chromosome, chr_length.first, sizeof(CountH5Record::chromosome));
+      records.erase(std::remove_if(records.begin(), records.end(), [&](const CountH5Record& record)
+      {
+        return record.count == 0 && record.bin_number + 1 != bins;
+      }), records.end());
     }
   }
+}
 
-  return records;
+// Liquidates the shard, also writing its counts to the cache entry at cache_offset.  If the
+// shard fails, it is skipped with zero counts and complete is cleared so that the entry isn't
+// committed.
+LevelCounts liquidate_shard(const Shard& shard, const BamFile& bam_file, const std::vector<unsigned int>& bin_sizes,
+                            const std::vector<CountingMode>& modes, const bool sparse, Liquidators& liquidators,
+                            CacheEntry& entry, const size_t cache_offset, std::atomic<bool>& complete)
+{
+  std::vector<BinRange> ranges;
+  LevelCounts counts = shard_placeholders(shard, bam_file, bin_sizes, modes.size(), ranges);
+
+  Liquidator& liquidator = liquidators.local();
+
+  try
+  {
+    // every bin size is counted from the same sweep, so each read is only decoded once
+    const std::vector<std::vector<std::vector<uint64_t>>> shard_counts = liquidator.liquidate_bins(shard.chromosome,
+                                                                                                   ranges,
+                                                                                                   modes);
+    std::vector<uint64_t> cached_counts;
+    for (size_t l=0; l < shard_counts.size(); ++l)
+    {
+      for (size_t m=0; m < shard_counts[l].size(); ++m)
+      {
+        for (size_t i=0; i < shard_counts[l][m].size(); ++i)
+        {
+          counts[l][m][i].count = shard_counts[l][m][i];
+        }
+        cached_counts.insert(cached_counts.end(), shard_counts[l][m].begin(), shard_counts[l][m].end());
+      }
+    }
+    entry.write(cache_offset, cached_counts.data(), cached_counts.size());
+  } catch(const std::exception& e)
+  {
+    Logger::warn() << "Skipping " << shard.chromosome << " bins " << ranges[0].first_bin
+                   << " through " << ranges[0].last_bin - 1 << " due to error: " << e.what();
+    complete = false;
+  }
+
+  if (sparse)
+  {
+    remove_zero_counts(counts, shard, bin_sizes);
+  }
+
+  return counts;
+}
+
+// reads the shard's counts from the cache entry at cache_offset instead of liquidating it
+LevelCounts cached_shard(const Shard& shard, const BamFile& bam_file, const std::vector<unsigned int>& bin_sizes,
+                         const size_t modes, const bool sparse, const CacheEntry& entry, const size_t cache_offset)
+{
+  std::vector<BinRange> ranges;
+  LevelCounts counts = shard_placeholders(shard, bam_file, bin_sizes, modes, ranges);
+
+  std::vector<uint64_t> cached_counts(shard_cache_size(shard, bin_sizes, modes));
+  entry.read(cache_offset, cached_counts.data(), cached_counts.size());
+
+  size_t c = 0;
+  for (ModeCounts& mode_counts : counts)
+  {
+    for (std::vector<CountH5Record>& records : mode_counts)
+    {
+      for (CountH5Record& record : records)
+      {
+        record.count = cached_counts[c++];
+      }
+    }
+  }
+
+  if (sparse)
+  {
+    remove_zero_counts(counts, shard, bin_sizes);
+  }
+
+  return counts;
+}
+
+// Every parameter the cached counts of a bam file depend on, including where the shards are
+// cut, since it determines the order of the counts in the entry and depends on the index.
+std::string bins_cache_key(const BamFile& bam_file, const std::vector<Shard>& work,
+                           const std::vector<unsigned int>& bin_sizes, const std::vector<CountingMode>& modes)
+{
+  std::stringstream ss;
+  ss << "bamliquidator_bins";
+  for (const Shard& shard : work)
+  {
+    ss << (shard.start == 0 ? " " : ",") << shard.start;
+  }
+  ss << "\n" << bam_file_identity(bam_file.path) << "\n";
+  for (size_t l=0; l < bin_sizes.size(); ++l)
+  {
+    ss << (l == 0 ? "" : ",") << bin_sizes[l];
+  }
+  ss << "\n" << counting_modes_key(modes)
+     << "\n" << chromosome_lengths_key(bam_file.chromosome_lengths);
+  return ss.str();
+}
+
+// the offset of each shard's counts in a cache entry, followed by the size of the entry
+std::vector<size_t> shard_cache_offsets(const std::vector<Shard>& work, const std::vector<unsigned int>& bin_sizes,
+                                        const size_t modes)
+{
+  std::vector<size_t> cache_offsets(1, 0);
+  for (const Shard& shard : work)
+  {
+    cache_offsets.push_back(cache_offsets.back() + shard_cache_size(shard, bin_sizes, modes));
+  }
+  return cache_offsets;
+}
+
+// The state shared by the shards of one bam file while they are liquidated: the cache entry
+// for the file's counts, which is committed once every shard is written unless a shard
+// failed, and on a cache miss the file's liquidators, which are closed once its last shard is
+// written.
+struct BamFileLiquidation
+{
+  BamFileLiquidation(const BamFile& bam_file, const std::vector<Shard>& work, const std::vector<unsigned int>& bin_sizes,
+                     const std::vector<CountingMode>& modes, const CountsCache& cache):
+    cache_offsets(shard_cache_offsets(work, bin_sizes, modes.size())),
+    entry(cache, cache.enabled() ? bins_cache_key(bam_file, work, bin_sizes, modes) : "", cache_offsets.back()),
+    liquidators(entry.hit() ? nullptr : new Liquidators(liquidator_for(bam_file.path))),
+    complete(true)
+  {}
+
+  std::vector<size_t> cache_offsets;
+  CacheEntry entry;
+  std::unique_ptr<Liquidators> liquidators;
+  std::atomic<bool> complete;
+};
+
+// A shard on its way through the pipeline in liquidate_and_write
+struct ShardTask
+{
+  size_t file;
+  size_t shard;
+  std::shared_ptr<BamFileLiquidation> liquidation;
+  LevelCounts counts;
+};
+
+// Liquidates the shards of the bam files in a tbb pipeline: the shards are started in the order
+// of bam_files and then genomic order, liquidated (or read from the cache) in parallel, and
+// appended to the HDF5 file in that same order as soon as each shard and all before it are
+// counted.  So threads that run out of shards in one file move on to the next file instead of
+// idling until the slowest shard of the file finishes, writing overlaps with counting, and at
+// most max_shards_in_flight shards are held in memory at once, without any thread waiting for
+// another shard to finish.
+void liquidate_and_write(hid_t& file, const std::vector<BamFile>& bam_files,
+                         const std::vector<unsigned int>& bin_sizes, const std::vector<CountingMode>& modes,
+                         const NameKeys& keys, const bool sparse, const CountsCache& cache)
+{
+  // planning reads every index, which is mostly waiting on i/o, so many are read at once
+  std::vector<std::vector<Shard>> work(bam_files.size());
+  tbb::parallel_for(
+    tbb::blocked_range<size_t>(0, bam_files.size(), 1),
+    [&](const tbb::blocked_range<size_t>& range)
+    {
+      for (size_t i = range.begin(); i < range.end(); ++i)
+      {
+        work[i] = shards(bam_files[i], bin_sizes);
+      }
+    });
+
+  std::vector<std::vector<std::string>> table_names(bin_sizes.size());
+  for (size_t l=0; l < bin_sizes.size(); ++l)
+  {
+    const std::string base = l == 0 ? "bin_counts" : level_counts_table_name("bin_counts", bin_sizes[l]);
+    for (size_t m=0; m < modes.size(); ++m)
+    {
+      table_names[l].push_back(m == 0 ? base : counts_table_name(base, modes[m]));
+    }
+  }
+
+  size_t next_file = 0;
+  size_t next_shard = 0;
+  std::shared_ptr<BamFileLiquidation> liquidation;
+
+  tbb::parallel_pipeline(max_shards_in_flight,
+    tbb::make_filter<void, ShardTask>(tbb::filter::serial_in_order,
+      [&](tbb::flow_control& control) -> ShardTask
+      {
+        for (; next_file < bam_files.size() && next_shard == work[next_file].size(); next_shard = 0)
+        {
+          ++next_file;
+          liquidation.reset();
+        }
+        if (next_file == bam_files.size())
+        {
+          control.stop();
+          return ShardTask();
+        }
+        if (next_shard == 0)
+        {
+          liquidation = std::make_shared<BamFileLiquidation>(bam_files[next_file], work[next_file], bin_sizes, modes,
+                                                             cache);
+        }
+        return ShardTask{next_file, next_shard++, liquidation, LevelCounts()};
+      })
+    & tbb::make_filter<ShardTask, ShardTask>(tbb::filter::parallel,
+      [&](ShardTask task) -> ShardTask
+      {
+        const BamFile& bam_file = bam_files[task.file];
+        const Shard& shard = work[task.file][task.shard];
+        BamFileLiquidation& state = *task.liquidation;
+        const size_t cache_offset = state.cache_offsets[task.shard];
+        task.counts = state.entry.hit()
+                    ? cached_shard(shard, bam_file, bin_sizes, modes.size(), sparse, state.entry, cache_offset)
+                    : liquidate_shard(shard, bam_file, bin_sizes, modes, sparse, *state.liquidators, state.entry,
+                                      cache_offset, state.complete);
+        return task;
+      })
+    & tbb::make_filter<ShardTask, void>(tbb::filter::serial_in_order,
+      [&](ShardTask task)
+      {
+        for (size_t l=0; l < bin_sizes.size(); ++l)
+        {
+          for (size_t m=0; m < modes.size(); ++m)
+          {
+            write(file, table_names[l][m], task.counts[l][m], keys);
+          }
+        }
+
+        BamFileLiquidation& state = *task.liquidation;
+        if (task.shard + 1 == work[task.file].size() && state.complete)
+        {
+          state.entry.commit();
+        }
+      }));
 }
 
 int main(int argc, char* argv[])
 {
   try
   {
-    if (argc < 13 || argc % 2 != 1)
+    const bool use_manifest = argc > 1 && std::string(argv[1]) == "--manifest";
+    if (use_manifest ? (argc != 10 && argc != 12) : (argc < 13 || argc % 2 != 1))
     {
       std::cerr << "usage: " << argv[0] 
         << " number_of_threads cell_type bin_size extension strand bam_file bam_file_key hdf5_file log_file write_warnings_to_stderr chr1 length1 ... \n"
         << "\ne.g. " << argv[0] << " mm1s 100000 0 . /ifs/hg18/mm1s/04032013_D1L57ACXX_4.TTAGGC.hg18.bwt.sorted.bam "
         << "137 counts.hdf5 output/log.txt 1 chr1 247249719 chr2 242951149 chr3 199501827"
+        << "\nextension and strand may be comma separated lists, e.g. 0,200 and +,-,. to count every combination in one pass:"
+        << "\nthe first combination is written to the bin_counts table, and the others to tables such as bin_counts_reverse_200."
+        << "\nbin_size may also be a comma separated list, e.g. 1000,10000,100000, to count every bin size in one pass:"
+        << "\nthe first is written to the bin_counts table, and the others to tables such as bin_counts_10000."
+        << "\nevery bin size must divide the largest bin size."
         << "\nnumber of threads <= 0 means use a number of threads equal to the number of logical cpus."
-        << "\nnote that this application is intended to be run from bamliquidator_batch.py -- see"
+        << "\n\nalternatively, to liquidate many bam files in a single process:"
+        << "\n  " << argv[0] << " --manifest number_of_threads bin_size extension strand manifest_file hdf5_file log_file "
+        << "write_warnings_to_stderr [cache_directory cache_megabytes]"
+        << "\nwhere manifest_file has one tab separated line per bam file: bam_file bam_file_key cell_type chr1 length1 ..."
+        << "\nor bam_file bam_file_key cell_type patterns_to_skip, to count on every chromosome in the bam file header"
+        << "\nwhose name doesn't contain any of the comma separated patterns (e.g. chrUn,_random), and to add the bam file"
+        << "\nto the files table with its mapped read count from the bam index."
+        << "\nwith a cache_directory, counts are cached there (shared with other processes), and a bam file that was"
+        << "\nalready liquidated with the same bin sizes, extensions, strands and chromosomes is read from the cache"
+        << "\ninstead, with the least recently used counts evicted once the cache exceeds cache_megabytes."
+        << "\n\nnote that this application is intended to be run from bamliquidator_batch.py -- see"
         << "\nhttps://github.com/BradnerLab/pipeline/wiki for more information"
         << std::endl;
       return 1;
     }
 
-    const int number_of_threads = boost::lexical_cast<int>(argv[1]);
-    const std::string cell_type = argv[2];
-    const unsigned int bin_size = boost::lexical_cast<unsigned int>(argv[3]);
-    const unsigned int extension = boost::lexical_cast<unsigned int>(argv[4]);
-    const char strand = boost::lexical_cast<char>(argv[5]);
-    const std::string bam_file_path = argv[6];
-    const unsigned int bam_file_key = boost::lexical_cast<unsigned int>(argv[7]);
-    const std::string hdf5_file_path = argv[8];
-    const std::string log_file_path = argv[9];
-    const bool write_warnings_to_stderr = boost::lexical_cast<bool>(argv[10]);
-    const std::vector<std::pair<std::string, size_t>> chromosome_lengths = extract_chromosome_lengths(argc, argv, 11);
+    int number_of_threads;
+    std::vector<unsigned int> bin_sizes;
+    std::vector<CountingMode> modes;
+    std::string manifest_path;
+    std::string hdf5_file_path;
+    std::string log_file_path;
+    bool write_warnings_to_stderr;
+    std::vector<BamFile> bam_files;
+    CountsCache cache{"", 0};
+    if (use_manifest)
+    {
+      number_of_threads = boost::lexical_cast<int>(argv[2]);
+      bin_sizes = extract_bin_sizes(argv[3]);
+      modes = extract_counting_modes(argv[5], argv[4]);
+      manifest_path = argv[6];
+      hdf5_file_path = argv[7];
+      log_file_path = argv[8];
+      write_warnings_to_stderr = boost::lexical_cast<bool>(argv[9]);
+      if (argc == 12)
+      {
+        cache.directory = argv[10];
+        cache.max_bytes = boost::lexical_cast<uint64_t>(argv[11]) << 20;
+      }
+    }
+    else
+    {
+      number_of_threads = boost::lexical_cast<int>(argv[1]);
+      bin_sizes = extract_bin_sizes(argv[3]);
+      modes = extract_counting_modes(argv[5], argv[4]);
+      hdf5_file_path = argv[8];
+      log_file_path = argv[9];
+      write_warnings_to_stderr = boost::lexical_cast<bool>(argv[10]);
+
+      BamFile bam_file;
+      bam_file.path = argv[6];
+      bam_file.key = boost::lexical_cast<unsigned int>(argv[7]);
+      bam_file.cell_type = argv[2];
+      bam_file.chromosome_lengths = extract_chromosome_lengths(argc, argv, 11);
+      bam_file.chromosomes_from_header = false;
+      bam_files.push_back(bam_file);
+    }
 
     tbb::task_scheduler_init init( number_of_threads <= 0 
                                  ? tbb::task_scheduler_init::automatic
@@ -240,12 +640,17 @@ int main(int argc, char* argv[])
 
     Logger::configure(log_file_path, write_warnings_to_stderr);
 
-    if (bin_size == 0)
+    if (std::find(bin_sizes.begin(), bin_sizes.end(), 0) != bin_sizes.end())
     {
       Logger::error() << "Bin size cannot be zero";
       return 2;
     }
 
+    if (use_manifest)
+    {
+      bam_files = read_manifest(manifest_path);
+    }
+
     hid_t h5file = H5Fopen(hdf5_file_path.c_str(), H5F_ACC_RDWR, H5P_DEFAULT);
     if (h5file < 0)
     {
@@ -253,9 +658,9 @@ int main(int argc, char* argv[])
       return 3;
     }
 
-    std::vector<CountH5Record> counts = count_placeholders(chromosome_lengths, cell_type, bam_file_key, bin_size);
-    batch_liquidate(counts, bin_size, extension, strand, bam_file_path);
-    write(h5file, counts);
+    read_bam_file_headers(h5file, bam_files);
+
+    liquidate_and_write(h5file, bam_files, bin_sizes, modes, read_name_keys(h5file), is_sparse(h5file), cache);
 
     H5Fclose(h5file);
 
@@ -0,0 +1,370 @@
+// Python.h must be included first, see https://docs.python.org/3/c-api/intro.html
+#include <Python.h>
+
+#include "bamliquidator.h"
+
+#include <samtools/sam.h>
+
+#include <cctype>
+#include <cstring>
+#include <exception>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/* The MIT License (MIT)
+
+   Copyright (c) 2013 Xin Zhong and Charles Lin
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+ */
+
+// The bamliquidator_native Python module, which counts reads in-process instead of
+// running the bamliquidator executable and parsing its output.  Only the CPython API is
+// used at compile time: position arrays are read through the buffer protocol (so NumPy
+// arrays are read in place) and the result arrays are created by calling numpy.zeros
+// and written in place, so the module doesn't need to be rebuilt for each NumPy version.
+
+struct BamLiquidatorObject
+{
+  PyObject_HEAD
+  samfile_t* fp;
+  bam_index_t* bamidx;
+  // the samtools file and index can't be used by two threads at once, and the GIL is
+  // released while counting, so calls on the same object are serialized with this
+  std::mutex* mutex;
+};
+
+static void BamLiquidator_dealloc(BamLiquidatorObject* self)
+{
+  if (self->bamidx != NULL) bam_index_destroy(self->bamidx);
+  if (self->fp != NULL) samclose(self->fp);
+  delete self->mutex;
+  Py_TYPE(self)->tp_free((PyObject*) self);
+}
+
+static int BamLiquidator_init(BamLiquidatorObject* self, PyObject* args, PyObject* kwds)
+{
+  static const char* kwlist[] = {"bam_file_path", NULL};
+  const char* bam_file_path = NULL;
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "s", (char**) kwlist, &bam_file_path))
+  {
+    return -1;
+  }
+  if (self->fp != NULL)
+  {
+    PyErr_SetString(PyExc_RuntimeError, "BamLiquidator is already initialized");
+    return -1;
+  }
+
+  samfile_t* fp = NULL;
+  bam_index_t* bamidx = NULL;
+  Py_BEGIN_ALLOW_THREADS
+  fp = samopen(bam_file_path, "rb", 0);
+  if (fp != NULL)
+  {
+    bamidx = bam_index_load(bam_file_path);
+  }
+  Py_END_ALLOW_THREADS
+
+  if (fp == NULL)
+  {
+    PyErr_Format(PyExc_IOError, "samopen() error with %s", bam_file_path);
+    return -1;
+  }
+  if (bamidx == NULL)
+  {
+    samclose(fp);
+    PyErr_Format(PyExc_IOError, "bam_index_load() error with %s", bam_file_path);
+    return -1;
+  }
+
+  self->fp = fp;
+  self->bamidx = bamidx;
+  self->mutex = new std::mutex();
+  return 0;
+}
+
+template <typename T>
+static void copy_positions(const Py_buffer& buffer, std::vector<long long>& positions)
+{
+  const T* values = (const T*) buffer.buf;
+  for (size_t i = 0; i < positions.size(); ++i)
+  {
+    positions[i] = (long long) values[i];
+  }
+}
+
+// Reads a one dimensional sequence of integers, e.g. a NumPy array or a list, returning
+// false with a Python exception set on failure.
+static bool read_positions(PyObject* object, const char* name, std::vector<long long>& positions)
+{
+  if (PyObject_CheckBuffer(object))
+  {
+    Py_buffer buffer;
+    if (PyObject_GetBuffer(object, &buffer, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) != 0)
+    {
+      return false;
+    }
+
+    const char* format = buffer.format == NULL ? "B" : buffer.format;
+    if (format[0] == '@' || format[0] == '=' || format[0] == '<')
+    {
+      ++format;
+    }
+
+    // the element type comes from itemsize, since with a '<' or '=' prefix the letters have
+    // standard sizes, e.g. '<l' is 4 bytes even where a long is 8
+    bool ok = buffer.ndim <= 1 && std::strlen(format) == 1 && std::strchr("bBhHiIlLqQ", format[0]) != NULL;
+    if (ok)
+    {
+      const bool is_signed = std::islower(format[0]);
+      positions.resize(buffer.len / buffer.itemsize);
+      switch (buffer.itemsize)
+      {
+        case 1: is_signed ? copy_positions<int8_t>(buffer, positions) : copy_positions<uint8_t>(buffer, positions); break;
+        case 2: is_signed ? copy_positions<int16_t>(buffer, positions) : copy_positions<uint16_t>(buffer, positions); break;
+        case 4: is_signed ? copy_positions<int32_t>(buffer, positions) : copy_positions<uint32_t>(buffer, positions); break;
+        case 8: is_signed ? copy_positions<int64_t>(buffer, positions) : copy_positions<uint64_t>(buffer, positions); break;
+        default: ok = false;
+      }
+    }
+    PyBuffer_Release(&buffer);
+
+    if (!ok)
+    {
+      PyErr_Format(PyExc_TypeError, "%s must be a one dimensional array of integers", name);
+    }
+    return ok;
+  }
+
+  PyObject* sequence = PySequence_Fast(object, "positions must be a sequence of integers");
+  if (sequence == NULL)
+  {
+    return false;
+  }
+  const Py_ssize_t size = PySequence_Fast_GET_SIZE(sequence);
+  positions.resize(size);
+  for (Py_ssize_t i = 0; i < size; ++i)
+  {
+    positions[i] = PyLong_AsLongLong(PySequence_Fast_GET_ITEM(sequence, i));
+    if (positions[i] == -1 && PyErr_Occurred())
+    {
+      Py_DECREF(sequence);
+      return false;
+    }
+  }
+  Py_DECREF(sequence);
+  return true;
+}
+
+static PyObject* BamLiquidator_liquidate(BamLiquidatorObject* self, PyObject* args, PyObject* kwds)
+{
+  static const char* kwlist[] = {"chromosome", "starts", "stops", "strand", "spnum", "extension", "out", NULL};
+  const char* chromosome = NULL;
+  PyObject* starts_object = NULL;
+  PyObject* stops_object = NULL;
+  const char* strand = ".";
+  unsigned int spnum = 1;
+  unsigned int extension = 0;
+  PyObject* out = NULL;
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "sOO|sIIO", (char**) kwlist, &chromosome,
+                                   &starts_object, &stops_object, &strand, &spnum,
+                                   &extension, &out))
+  {
+    return NULL;
+  }
+  if (self->fp == NULL)
+  {
+    PyErr_SetString(PyExc_RuntimeError, "BamLiquidator is not initialized");
+    return NULL;
+  }
+
+  std::vector<long long> starts;
+  std::vector<long long> stops;
+  if (!read_positions(starts_object, "starts", starts) || !read_positions(stops_object, "stops", stops))
+  {
+    return NULL;
+  }
+  if (starts.size() != stops.size())
+  {
+    PyErr_SetString(PyExc_ValueError, "starts and stops must be the same length");
+    return NULL;
+  }
+  if (spnum == 0)
+  {
+    PyErr_SetString(PyExc_ValueError, "spnum must be positive");
+    return NULL;
+  }
+  if (std::strcmp(strand, "+") != 0 && std::strcmp(strand, "-") != 0 && std::strcmp(strand, ".") != 0)
+  {
+    PyErr_Format(PyExc_ValueError, "strand must be '+', '-' or '.', not '%s'", strand);
+    return NULL;
+  }
+  for (size_t i = 0; i < starts.size(); ++i)
+  {
+    if (starts[i] < 0 || stops[i] <= starts[i] || stops[i] > 0xffffffffLL)
+    {
+      PyErr_Format(PyExc_ValueError, "invalid range %lld to %lld at index %zu",
+                   starts[i], stops[i], i);
+      return NULL;
+    }
+  }
+
+  if (out == NULL)
+  {
+    PyObject* numpy = PyImport_ImportModule("numpy");
+    if (numpy == NULL)
+    {
+      return NULL;
+    }
+    out = PyObject_CallMethod(numpy, (char*) "zeros", (char*) "((nI)s)",
+                              (Py_ssize_t) starts.size(), spnum, "uint64");
+    Py_DECREF(numpy);
+    if (out == NULL)
+    {
+      return NULL;
+    }
+  }
+  else
+  {
+    Py_INCREF(out);
+  }
+
+  Py_buffer buffer;
+  if (PyObject_GetBuffer(out, &buffer, PyBUF_C_CONTIGUOUS | PyBUF_WRITABLE | PyBUF_FORMAT) != 0)
+  {
+    Py_DECREF(out);
+    return NULL;
+  }
+  const char* format = buffer.format == NULL ? "B" : buffer.format;
+  if (format[0] == '@' || format[0] == '=' || format[0] == '<')
+  {
+    ++format;
+  }
+  if (buffer.itemsize != sizeof(uint64_t)
+      || std::strlen(format) != 1 || (format[0] != 'L' && format[0] != 'Q')
+      || buffer.len != (Py_ssize_t) (starts.size() * spnum * sizeof(uint64_t)))
+  {
+    PyBuffer_Release(&buffer);
+    Py_DECREF(out);
+    PyErr_SetString(PyExc_ValueError, "out must be a contiguous uint64 array with len(starts) * spnum elements");
+    return NULL;
+  }
+
+  uint64_t* counts = (uint64_t*) buffer.buf;
+  std::string error;
+  Py_BEGIN_ALLOW_THREADS
+  try
+  {
+    std::lock_guard<std::mutex> lock(*self->mutex);
+    for (size_t i = 0; i < starts.size(); ++i)
+    {
+      liquidate(self->fp, self->bamidx, chromosome, starts[i], stops[i], strand[0], spnum,
+                extension, counts + i*spnum);
+    }
+  }
+  catch(const std::exception& e)
+  {
+    error = e.what();
+  }
+  Py_END_ALLOW_THREADS
+  PyBuffer_Release(&buffer);
+
+  if (!error.empty())
+  {
+    Py_DECREF(out);
+    PyErr_SetString(PyExc_RuntimeError, error.c_str());
+    return NULL;
+  }
+
+  return out;
+}
+
+static PyMethodDef BamLiquidator_methods[] =
+{
+  {"liquidate", (PyCFunction) BamLiquidator_liquidate, METH_VARARGS | METH_KEYWORDS,
+   "liquidate(chromosome, starts, stops, strand='.', spnum=1, extension=0, out=None)\n\n"
+   "Counts the reads in each range [starts[i], stops[i]) of the chromosome, split into\n"
+   "spnum summary points, exactly as the bamliquidator executable does.  Returns a\n"
+   "len(starts) by spnum numpy.uint64 array, or writes the counts into out if given,\n"
+   "which must be a contiguous uint64 array of that size.  The GIL is released while\n"
+   "counting, so separate BamLiquidator objects can count in parallel threads."},
+  {NULL, NULL, 0, NULL}
+};
+
+static PyTypeObject BamLiquidatorType =
+{
+  PyVarObject_HEAD_INIT(NULL, 0)
+  "bamliquidator_native.BamLiquidator", // tp_name
+  sizeof(BamLiquidatorObject),           // tp_basicsize
+};
+
+#if PY_MAJOR_VERSION >= 3
+static struct PyModuleDef bamliquidator_native_module =
+{
+  PyModuleDef_HEAD_INIT,
+  "bamliquidator_native",
+  "Counts reads in bam files in-process, see BamLiquidator.",
+  -1,
+  NULL
+};
+#endif
+
+static PyObject* create_module()
+{
+  BamLiquidatorType.tp_dealloc = (destructor) BamLiquidator_dealloc;
+  BamLiquidatorType.tp_flags = Py_TPFLAGS_DEFAULT;
+  BamLiquidatorType.tp_doc = "BamLiquidator(bam_file_path)\n\n"
+                             "An open bam file and its index (which must be at bam_file_path + '.bai').";
+  BamLiquidatorType.tp_methods = BamLiquidator_methods;
+  BamLiquidatorType.tp_init = (initproc) BamLiquidator_init;
+  BamLiquidatorType.tp_new = PyType_GenericNew;
+  if (PyType_Ready(&BamLiquidatorType) < 0)
+  {
+    return NULL;
+  }
+
+#if PY_MAJOR_VERSION >= 3
+  PyObject* module = PyModule_Create(&bamliquidator_native_module);
+#else
+  PyObject* module = Py_InitModule3("bamliquidator_native", NULL,
+                                    "Counts reads in bam files in-process, see BamLiquidator.");
+#endif
+  if (module == NULL)
+  {
+    return NULL;
+  }
+
+  Py_INCREF(&BamLiquidatorType);
+  PyModule_AddObject(module, "BamLiquidator", (PyObject*) &BamLiquidatorType);
+  return module;
+}
+
+#if PY_MAJOR_VERSION >= 3
+PyMODINIT_FUNC PyInit_bamliquidator_native()
+{
+  return create_module();
+}
+#else
+PyMODINIT_FUNC initbamliquidator_native()
+{
+  create_module();
+}
+#endif
@@ -1,15 +1,27 @@
 #include "bamliquidator.h"
 #include "bamliquidator_util.h"
 
+#include <algorithm>
+#include <cerrno>
 #include <cmath>
+#include <cstring>
+#include <exception>
 #include <fstream>
 #include <iostream>
+#include <limits>
 #include <map>
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <typeinfo>
+#include <unordered_map>
 #include <vector>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include <boost/algorithm/string.hpp>
 #include <boost/lexical_cast.hpp>
 
@@ -40,144 +52,544 @@ struct Region
   char strand;
   uint64_t count;
   double normalized_count;
+};
 
-  bool is_valid(const std::map<std::string, size_t>& chromosome_to_length)
+std::ostream& operator<<(std::ostream& os, const Region& r)
+{
+  os << "bam file key " << r.bam_file_key << ' ' << r.chromosome << ' '
+     << r.region_name << ' ' << r.start << " -> " << r.stop << ' '
+     << r.strand << ' ' << r.normalized_count;
+  return os;
+}
+
+// The region file's contents, memory mapped, or read into memory if it can't be mapped
+// (e.g. a named pipe).
+class RegionFile
+{
+public:
+  explicit RegionFile(const std::string& path):
+    mapped(nullptr),
+    mapped_size(0)
   {
-    const auto it = chromosome_to_length.find(chromosome);
-    if ( it != chromosome_to_length.end() )
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
     {
-      if ( stop <= it->second )
+      throw std::runtime_error("failed to open region_file " + path);
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+    {
+      void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (data != MAP_FAILED)
       {
-        return true;
+        mapped = static_cast<const char*>(data);
+        mapped_size = st.st_size;
+        madvise(data, mapped_size, MADV_SEQUENTIAL);
       }
     }
 
-    return false;
+    if (mapped == nullptr)
+    {
+      char block[1 << 16];
+      for (ssize_t n; (n = read(fd, block, sizeof(block))) != 0; )
+      {
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) break;
+        buffer.insert(buffer.end(), block, block + n);
+      }
+    }
+    close(fd);
   }
+
+  ~RegionFile()
+  {
+    if (mapped != nullptr)
+    {
+      munmap(const_cast<char*>(mapped), mapped_size);
+    }
+  }
+
+  const char* begin() const
+  {
+    return mapped != nullptr ? mapped : buffer.data();
+  }
+
+  const char* end() const
+  {
+    return begin() + (mapped != nullptr ? mapped_size : buffer.size());
+  }
+
+private:
+  RegionFile(const RegionFile&) = delete;
+  RegionFile& operator=(const RegionFile&) = delete;
+
+  const char* mapped;
+  size_t mapped_size;
+  std::vector<char> buffer;
 };
 
-std::ostream& operator<<(std::ostream& os, const Region& r)
+// the columns of a region file format, where min_columns are required on every line
+struct RegionColumns
 {
-  os << "bam file key " << r.bam_file_key << ' ' << r.chromosome << ' '
-     << r.region_name << ' ' << r.start << " -> " << r.stop << ' '
-     << r.strand << ' ' << r.normalized_count;
-  return os;
-}
+  size_t chromosome;
+  size_t name;
+  size_t start;
+  size_t stop;
+  size_t strand;
+  size_t min_columns;
+};
 
-// default_strand: optional argument, default _ indicates to use 
-//                 gff strand column or . (both) for .bed region file
-std::vector<Region> parse_regions(const std::string& region_file_path,
-                                  const std::string& region_format,
-                                  const unsigned int bam_file_key,
-                                  const std::map<std::string, size_t>& chromosome_to_length, 
-                                  const char default_strand = '_') 
+// a column of a line in the region file, pointing into the RegionFile
+struct Column
 {
-  int chromosome_column = 0;
-  int name_column = 0;
-  int start_column = 0;
-  int stop_column = 0;
-  int strand_column = 0;
-  unsigned int min_columns = 0;
-
-  if (region_format == "gff")
-  {
-    chromosome_column = 0;
-    name_column = 1;
-    start_column = 3;
-    stop_column = 4;
-    strand_column = 6;
-    min_columns = 7;
+  const char* begin;
+  const char* end;
+
+  size_t size() const
+  {
+    return end - begin;
+  }
+
+  std::string str() const
+  {
+    return std::string(begin, end);
   }
-  else if (region_format == "bed")
-  {
-    chromosome_column = 0;
-    name_column = 3;
-    start_column = 1;
-    stop_column = 2;
-    strand_column = 5;
-    min_columns = 3;
+};
+
+// only this many columns of a line are kept, which covers every column that is parsed
+const size_t max_region_columns = 8;
+
+// like copy, but from a column
+inline void copy(char* dest, const Column& column, size_t dest_size)
+{
+  const size_t size = strnlen(column.begin, std::min(column.size(), dest_size - 1));
+  memcpy(dest, column.begin, size);
+  memset(dest + size, '\0', dest_size - size);
+}
+
+// Parses like boost::lexical_cast<uint64_t>, which accepts a leading sign (wrapping negative
+// values around) and nothing but digits otherwise, throwing boost::bad_lexical_cast if the
+// column isn't a number or overflows.
+inline uint64_t parse_uint64(const Column& column)
+{
+  const char* c = column.begin;
+  const bool negative = c != column.end && *c == '-';
+  if (c != column.end && (*c == '-' || *c == '+'))
+  {
+    ++c;
   }
-  else
+  if (c == column.end)
   {
-    throw std::runtime_error("unsupported region file format (" + region_format + " for " + region_file_path
-                             + "), please supply a .gff or .bed file");
+    throw boost::bad_lexical_cast(typeid(std::string), typeid(uint64_t));
   }
 
-  std::ifstream region_file(region_file_path.c_str());
-  if (!region_file.is_open())
+  uint64_t value = 0;
+  for (; c != column.end; ++c)
   {
-    throw std::runtime_error("failed to open region_file " + region_file_path);
+    const unsigned int digit = (unsigned char) *c - '0';
+    if (digit > 9 || value > (std::numeric_limits<uint64_t>::max() - digit) / 10)
+    {
+      throw boost::bad_lexical_cast(typeid(std::string), typeid(uint64_t));
+    }
+    value = value * 10 + digit;
   }
+  return negative ? 0 - value : value;
+}
+
+// A warning or error about a line of a chunk, where line is counted from the start of the
+// chunk, since the line numbers of a chunk aren't known until the chunks before it are parsed.
+struct LineMessage
+{
+  size_t line;
+  std::string before;
+  std::string after;
+};
 
+// The regions parsed from a run of whole lines of the region file.  If a line failed to
+// parse, parsing stopped there, and either error or exception is set.
+struct ParsedChunk
+{
   std::vector<Region> regions;
-  int line_number = 1;
+  std::vector<char> file_strands;
+  size_t lines;
+  std::vector<LineMessage> warnings;
+  bool failed;
+  LineMessage error;
+  std::exception_ptr exception;
+};
+
+void parse_chunk(const char* begin, const char* end, const std::string& region_file_path,
+                 const RegionColumns& format, const unsigned int bam_file_key,
+                 const std::unordered_map<std::string, size_t>& chromosome_to_length,
+                 const char default_strand, ParsedChunk& chunk)
+{
+  chunk.lines = 0;
+  chunk.failed = false;
+
+  // consecutive lines almost always have the same chromosome, so it is only looked up when it changes
+  char chromosome[sizeof(Region::chromosome)] = "";
+  bool chromosome_found = false;
+  size_t chromosome_length = 0;
+  bool looked_up = false;
+
+  try
+  {
+    for (const char* line = begin; line < end; ++chunk.lines)
+    {
+      const char* line_end = static_cast<const char*>(memchr(line, '\n', end - line));
+      if (line_end == nullptr)
+      {
+        line_end = end;
+      }
+
+      Column columns[max_region_columns];
+      size_t number_of_columns = 0;
+      for (const char* column = line; ; ++number_of_columns)
+      {
+        const char* column_end = static_cast<const char*>(memchr(column, '\t', line_end - column));
+        if (column_end == nullptr)
+        {
+          column_end = line_end;
+        }
+        if (number_of_columns < max_region_columns)
+        {
+          columns[number_of_columns] = Column{column, column_end};
+        }
+        if (column_end == line_end)
+        {
+          ++number_of_columns;
+          break;
+        }
+        column = column_end + 1;
+      }
+
+      if (number_of_columns < format.min_columns)
+      {
+        chunk.failed = true;
+        chunk.error = LineMessage{chunk.lines, "Not enough columns parsing line ",
+                                  " '" + std::string(line, line_end) + "' of " + region_file_path};
+        return;
+      }
+
+      Region region;
+      region.bam_file_key = bam_file_key;
+      copy(region.chromosome, columns[format.chromosome], sizeof(Region::chromosome));
+      if (number_of_columns > format.name)
+      {
+        copy(region.region_name, columns[format.name], sizeof(Region::region_name));
+        if (columns[format.name].size() >= sizeof(Region::region_name))
+        {
+          chunk.warnings.push_back(LineMessage{chunk.lines, "Truncated region on line ",
+                                               " from '" + columns[format.name].str() + "' to '"
+                                               + region.region_name + "'"});
+        }
+      }
+      else
+      {
+        copy(region.region_name, "", sizeof(Region::region_name));
+      }
+      region.start = parse_uint64(columns[format.start]);
+      region.stop  = parse_uint64(columns[format.stop]);
+      if (region.start > region.stop)
+      {
+        std::swap(region.start, region.stop);
+      }
+
+      const bool has_strand = number_of_columns > format.strand;
+      if (has_strand && columns[format.strand].size() != 1)
+      {
+        chunk.failed = true;
+        chunk.error = LineMessage{chunk.lines, "error parsing strand: '" + columns[format.strand].str() + "' on line ",
+                                  ""};
+        return;
+      }
+      const char file_strand = has_strand ? *columns[format.strand].begin : '.';
+      region.strand = default_strand == '_' ? file_strand : default_strand;
+      region.count = 0;
+      region.normalized_count = 0.0;
+
+      if (!looked_up || strcmp(chromosome, region.chromosome) != 0)
+      {
+        strcpy(chromosome, region.chromosome);
+        const auto it = chromosome_to_length.find(chromosome);
+        chromosome_found = it != chromosome_to_length.end();
+        chromosome_length = chromosome_found ? it->second : 0;
+        looked_up = true;
+      }
+
+      if (chromosome_found && region.stop <= chromosome_length)
+      {
+        chunk.regions.push_back(region);
+        chunk.file_strands.push_back(file_strand);
+      }
+      else
+      {
+        std::stringstream ss;
+        ss << ": " << region;
+        chunk.warnings.push_back(LineMessage{chunk.lines, "Excluding invalid region on line ", ss.str()});
+      }
+
+      line = line_end + (line_end == end ? 0 : 1);
+    }
+  }
+  catch (...)
+  {
+    chunk.failed = true;
+    chunk.exception = std::current_exception();
+  }
+}
+
+// A large region file is split into chunks of about this many bytes, which are parsed in
+// parallel.  BAMLIQUIDATOR_REGION_CHUNK_BYTES overrides it, e.g. so that the tests can split a
+// small region file into many chunks (0 makes every line its own chunk).
+size_t region_chunk_bytes()
+{
+  static const size_t bytes = environment_number("BAMLIQUIDATOR_REGION_CHUNK_BYTES", 4 << 20);
+  return bytes;
+}
+
+// The line by line parser that parse_chunk replaced, kept as the reference that the tests
+// compare RegionParser with (BAMLIQUIDATOR_REGION_LINE_PARSER=1 selects it).  Parses the
+// lines [begin, end) with getline and boost::split, logging each warning and throwing on the
+// first bad line as it goes, where line_number is the line number of the first line.
+void parse_lines(const char* begin, const char* end, const std::string& region_file_path,
+                 const RegionColumns& format, const unsigned int bam_file_key,
+                 const std::map<std::string, size_t>& chromosome_to_length,
+                 const char default_strand, size_t& line_number,
+                 std::vector<Region>& regions, std::vector<char>* file_strands)
+{
+  std::istringstream region_file(std::string(begin, end));
   for(std::string line; std::getline(region_file, line); ++line_number)
   {
     std::vector<std::string> columns;
     boost::split(columns, line, boost::is_any_of("\t"));
-    if (columns.size() < min_columns)
+    if (columns.size() < format.min_columns)
     {
       std::stringstream ss;
       ss << "Not enough columns parsing line " << line_number << " '" << line << "' of " << region_file_path;
       throw std::runtime_error(ss.str());
     }
     Region region;
-    region.bam_file_key = bam_file_key; 
-    copy(region.chromosome,  columns[chromosome_column], sizeof(Region::chromosome));
-    if (columns.size() > name_column)
+    region.bam_file_key = bam_file_key;
+    copy(region.chromosome, columns[format.chromosome], sizeof(Region::chromosome));
+    if (columns.size() > format.name)
     {
-      copy(region.region_name, columns[name_column], sizeof(Region::region_name));
-      if (columns[name_column].size() >= sizeof(Region::region_name))
+      copy(region.region_name, columns[format.name], sizeof(Region::region_name));
+      if (columns[format.name].size() >= sizeof(Region::region_name))
       {
-        Logger::warn() << "Truncated region on line " << line_number << " from '" << columns[name_column] << "' to '" << region.region_name << "'";
+        Logger::warn() << "Truncated region on line " << line_number << " from '" << columns[format.name]
+                       << "' to '" << region.region_name << "'";
       }
     }
     else
     {
       copy(region.region_name, "", sizeof(Region::region_name));
     }
-    region.start = boost::lexical_cast<uint64_t>(columns[start_column]);
-    region.stop  = boost::lexical_cast<uint64_t>(columns[stop_column]);
+    region.start = boost::lexical_cast<uint64_t>(columns[format.start]);
+    region.stop  = boost::lexical_cast<uint64_t>(columns[format.stop]);
     if (region.start > region.stop)
     {
       std::swap(region.start, region.stop);
     }
 
-    if (columns.size() > strand_column)
-    {
-      if (columns[strand_column].size() != 1)
-      {
-        std::stringstream ss;
-        ss << "error parsing strand: '" << columns[strand_column] << "' on line " << line_number;
-        throw std::runtime_error(ss.str());
-      }
-      region.strand = default_strand == '_'
-                    ? columns[strand_column][0]
-                    : default_strand;
-    }
-    else
+    if (columns.size() > format.strand && columns[format.strand].size() != 1)
     {
-      region.strand = default_strand == '_'
-                    ? '.'
-                    : default_strand; 
+      std::stringstream ss;
+      ss << "error parsing strand: '" << columns[format.strand] << "' on line " << line_number;
+      throw std::runtime_error(ss.str());
     }
+    const char file_strand = columns.size() > format.strand ? columns[format.strand][0] : '.';
+    region.strand = default_strand == '_' ? file_strand : default_strand;
     region.count = 0;
     region.normalized_count = 0.0;
 
-    if (region.is_valid(chromosome_to_length))
+    const auto it = chromosome_to_length.find(region.chromosome);
+    if (it != chromosome_to_length.end() && region.stop <= it->second)
     {
       regions.push_back(region);
+      if (file_strands != nullptr)
+      {
+        file_strands->push_back(file_strand);
+      }
     }
     else
     {
       Logger::warn() << "Excluding invalid region on line " << line_number << ": " << region;
     }
   }
+}
+
+// Parses the region file a batch of lines at a time, e.g. so that a huge region file can be
+// liquidated without holding all of its regions in memory.
+//
+// default_strand: _ indicates to use gff strand column or . (both) for .bed region file
+//
+// The region file is memory mapped, and each batch is split into chunks of whole lines that
+// are parsed in parallel, without copying the columns, and then the regions, warnings and any
+// error are taken from the chunks in order, the same as if the lines were parsed one after
+// another.
+class RegionParser
+{
+public:
+  RegionParser(const std::string& a_region_file_path,
+               const std::string& region_format,
+               const unsigned int a_bam_file_key,
+               const std::map<std::string, size_t>& a_chromosome_to_length,
+               const char a_default_strand):
+    region_file_path(a_region_file_path),
+    bam_file_key(a_bam_file_key),
+    default_strand(a_default_strand),
+    format(region_columns(region_format, a_region_file_path)),
+    region_file(a_region_file_path),
+    chromosome_to_length(a_chromosome_to_length),
+    chromosome_lengths(a_chromosome_to_length.begin(), a_chromosome_to_length.end()),
+    chunk_bytes(region_chunk_bytes()),
+    line_parser(environment_number("BAMLIQUIDATOR_REGION_LINE_PARSER", 0) != 0),
+    position(region_file.begin()),
+    line_number(1)
+  {}
+
+  // Sets regions to the valid regions of the next max_lines lines (or of the rest of the file),
+  // and if file_strands isn't null, sets it to the strand column (or .) of each region
+  // regardless of default_strand.  Returns false, with no regions, once the whole file is parsed.
+  bool next(std::vector<Region>& regions, std::vector<char>* file_strands,
+            const size_t max_lines = std::numeric_limits<size_t>::max())
+  {
+    regions.clear();
+    if (file_strands != nullptr)
+    {
+      file_strands->clear();
+    }
+    if (position == region_file.end())
+    {
+      return false;
+    }
+
+    const char* batch_end = region_file.end();
+    if (max_lines != std::numeric_limits<size_t>::max())
+    {
+      batch_end = position;
+      for (size_t lines = 0; lines < max_lines && batch_end != region_file.end(); ++lines)
+      {
+        const char* newline = static_cast<const char*>(memchr(batch_end, '\n', region_file.end() - batch_end));
+        batch_end = newline == nullptr ? region_file.end() : newline + 1;
+      }
+    }
+
+    if (line_parser)
+    {
+      parse_lines(position, batch_end, region_file_path, format, bam_file_key, chromosome_to_length,
+                  default_strand, line_number, regions, file_strands);
+      position = batch_end;
+      return true;
+    }
+
+    // each chunk starts at the beginning of a line
+    std::vector<const char*> chunk_begins(1, position);
+    while (batch_end - chunk_begins.back() > (ptrdiff_t) chunk_bytes)
+    {
+      const char* target = chunk_begins.back() + chunk_bytes;
+      const char* newline = static_cast<const char*>(memchr(target, '\n', batch_end - target));
+      if (newline == nullptr || newline + 1 == batch_end) break;
+      chunk_begins.push_back(newline + 1);
+    }
+    chunk_begins.push_back(batch_end);
+
+    std::vector<ParsedChunk> chunks(chunk_begins.size() - 1);
+    tbb::parallel_for(
+      tbb::blocked_range<size_t>(0, chunks.size(), 1),
+      [&](const tbb::blocked_range<size_t>& range)
+      {
+        for (size_t i = range.begin(); i < range.end(); ++i)
+        {
+          parse_chunk(chunk_begins[i], chunk_begins[i+1], region_file_path, format, bam_file_key,
+                      chromosome_lengths, default_strand, chunks[i]);
+        }
+      });
+
+    for (ParsedChunk& chunk : chunks)
+    {
+      for (const LineMessage& warning : chunk.warnings)
+      {
+        Logger::warn() << warning.before << line_number + warning.line << warning.after;
+      }
+      if (chunk.exception)
+      {
+        std::rethrow_exception(chunk.exception);
+      }
+      if (chunk.failed)
+      {
+        std::stringstream ss;
+        ss << chunk.error.before << line_number + chunk.error.line << chunk.error.after;
+        throw std::runtime_error(ss.str());
+      }
 
+      regions.insert(regions.end(), chunk.regions.begin(), chunk.regions.end());
+      if (file_strands != nullptr)
+      {
+        file_strands->insert(file_strands->end(), chunk.file_strands.begin(), chunk.file_strands.end());
+      }
+      line_number += chunk.lines;
+
+      // frees each chunk as soon as it is copied, so the regions are only held twice one chunk at a time
+      std::vector<Region>().swap(chunk.regions);
+      std::vector<char>().swap(chunk.file_strands);
+    }
+
+    position = batch_end;
+    return true;
+  }
+
+private:
+  static RegionColumns region_columns(const std::string& region_format, const std::string& region_file_path)
+  {
+    if (region_format == "gff")
+    {
+      return RegionColumns{0, 1, 3, 4, 6, 7};
+    }
+    if (region_format == "bed")
+    {
+      return RegionColumns{0, 3, 1, 2, 5, 3};
+    }
+    throw std::runtime_error("unsupported region file format (" + region_format + " for " + region_file_path
+                             + "), please supply a .gff or .bed file");
+  }
+
+  RegionParser(const RegionParser&) = delete;
+  RegionParser& operator=(const RegionParser&) = delete;
+
+  const std::string region_file_path;
+  const unsigned int bam_file_key;
+  const char default_strand;
+  const RegionColumns format;
+  const RegionFile region_file;
+  const std::map<std::string, size_t> chromosome_to_length;
+  const std::unordered_map<std::string, size_t> chromosome_lengths;
+  const size_t chunk_bytes;
+  const bool line_parser;
+  const char* position;
+  size_t line_number;
+};
+
+// default_strand: optional argument, default _ indicates to use 
+//                 gff strand column or . (both) for .bed region file
+// file_strands:   optional argument, if not null then set to the strand column (or .) of
+//                 each returned region regardless of default_strand
+std::vector<Region> parse_regions(const std::string& region_file_path,
+                                  const std::string& region_format,
+                                  const unsigned int bam_file_key,
+                                  const std::map<std::string, size_t>& chromosome_to_length, 
+                                  const char default_strand = '_',
+                                  std::vector<char>* file_strands = nullptr) 
+{
+  RegionParser parser(region_file_path, region_format, bam_file_key, chromosome_to_length, default_strand);
+  std::vector<Region> regions;
+  parser.next(regions, file_strands);
   return regions;
 }
 
-void write(hid_t& file, std::vector<Region>& regions)
+void write(hid_t& file, const std::string& table_name, std::vector<Region>& regions)
 {
   const size_t record_size = sizeof(Region);
 
@@ -199,125 +611,408 @@ void write(hid_t& file, std::vector<Region>& regions)
                            sizeof(Region::count),
                            sizeof(Region::normalized_count) };
 
-  herr_t status = H5TBappend_records(file, "region_counts", regions.size(), record_size, record_offset,
+  herr_t status = H5TBappend_records(file, table_name.c_str(), regions.size(), record_size, record_offset,
                                      field_sizes, regions.data());
   if (status != 0)
   {
     std::stringstream ss;
-    ss << "Error appending record, status = " << status;
+    ss << "Error appending record to " << table_name << ", status = " << status;
     throw std::runtime_error(ss.str());
   }
 }
 
-class Liquidator 
+// this CompactRegion must match exactly the structure in HDF5
+// -- see the compact layout in bamliquidator_batch.py RegionLiquidator.create_counts_table
+struct CompactRegion
 {
-public:
-  Liquidator(const std::string& bam_file_path):
-    bam_file_path(bam_file_path),
-    fp(nullptr),
-    bamidx(nullptr)
+  uint32_t bam_file_key;
+  uint32_t chromosome_key;
+  char region_name[region_name_length];
+  uint64_t start;
+  uint64_t stop;
+  char strand;
+  uint64_t count;
+  double normalized_count;
+};
+
+void write(hid_t& file, const std::string& table_name, std::vector<CompactRegion>& regions)
+{
+  const size_t record_size = sizeof(CompactRegion);
+
+  size_t record_offset[] = { HOFFSET(CompactRegion, bam_file_key),
+                             HOFFSET(CompactRegion, chromosome_key),
+                             HOFFSET(CompactRegion, region_name),
+                             HOFFSET(CompactRegion, start),
+                             HOFFSET(CompactRegion, stop),
+                             HOFFSET(CompactRegion, strand),
+                             HOFFSET(CompactRegion, count),
+                             HOFFSET(CompactRegion, normalized_count) };
+
+  size_t field_sizes[] = { sizeof(CompactRegion::bam_file_key),
+                           sizeof(CompactRegion::chromosome_key),
+                           sizeof(CompactRegion::region_name),
+                           sizeof(CompactRegion::start),
+                           sizeof(CompactRegion::stop),
+                           sizeof(CompactRegion::strand),
+                           sizeof(CompactRegion::count),
+                           sizeof(CompactRegion::normalized_count) };
+
+  herr_t status = H5TBappend_records(file, table_name.c_str(), regions.size(), record_size, record_offset,
+                                     field_sizes, regions.data());
+  if (status != 0)
   {
-    init();
+    std::stringstream ss;
+    ss << "Error appending record to " << table_name << ", status = " << status;
+    throw std::runtime_error(ss.str());
+  }
+}
+
+// writes the regions with chromosome keys instead of names if the file has the compact layout
+void write(hid_t& file, const std::string& table_name, std::vector<Region>& regions, const NameKeys& keys)
+{
+  if (!keys.compact())
+  {
+    write(file, table_name, regions);
+    return;
   }
 
-  Liquidator(const Liquidator& other):
-    bam_file_path(other.bam_file_path),
-    fp(nullptr),
-    bamidx(nullptr)
+  std::vector<CompactRegion> compact_regions(regions.size());
+  for (size_t i=0; i < regions.size(); ++i)
   {
-    init();
+    const Region& region = regions[i];
+    CompactRegion& compact_region = compact_regions[i];
+    compact_region.bam_file_key = region.bam_file_key;
+    compact_region.chromosome_key = i > 0 && strcmp(region.chromosome, regions[i-1].chromosome) == 0
+                                  ? compact_regions[i-1].chromosome_key
+                                  : name_key(keys.chromosomes, region.chromosome);
+    memcpy(compact_region.region_name, region.region_name, sizeof(CompactRegion::region_name));
+    compact_region.start = region.start;
+    compact_region.stop = region.stop;
+    compact_region.strand = region.strand;
+    compact_region.count = region.count;
+    compact_region.normalized_count = region.normalized_count;
   }
+  write(file, table_name, compact_regions);
+}
+
+typedef tbb::enumerable_thread_specific<Liquidator,
+                                        tbb::cache_aligned_allocator<Liquidator>,
+                                        tbb::ets_key_per_instance>
+        Liquidators;
+
+// A run of regions on a single chromosome that are liquidated together with a single
+// fetch, where order[begin, end) are the indexes of the regions sorted by start.
+struct Chunk
+{
+  size_t begin;
+  size_t end;
+};
 
-  Liquidator& operator=(const Liquidator& other) = delete;
+// a chunk stops growing at this many base pairs so that a chromosome densely covered
+// by regions is still split among threads
+const size_t chunk_base_pairs = 8000000;
 
-  ~Liquidator()
+// Groups the regions into chunks of overlapping or adjacent regions, returning them in
+// genomic order, so that each thread works through a contiguous part of the bam file
+// instead of jumping to wherever the next region in the file happens to be.
+std::vector<Chunk> chunks(const std::vector<Region>& regions, std::vector<size_t>& order)
+{
+  order.resize(regions.size());
+  for (size_t i=0; i < order.size(); ++i)
   {
-    bam_index_destroy(bamidx);
-    samclose(fp);
+    order[i] = i;
   }
+  std::sort(order.begin(), order.end(), [&](size_t a, size_t b)
+  {
+    const int chromosome_cmp = strcmp(regions[a].chromosome, regions[b].chromosome);
+    if (chromosome_cmp != 0) return chromosome_cmp < 0;
+    if (regions[a].start != regions[b].start) return regions[a].start < regions[b].start;
+    return a < b;
+  });
 
-  double liquidate(const std::string& chromosome, int start, int stop, char strand, unsigned int extension)
+  std::vector<Chunk> work;
+  uint64_t chunk_stop = 0;
+  for (size_t i=0; i < order.size(); ++i)
   {
-    std::vector<double> counts = ::liquidate(fp, bamidx, chromosome, start, stop, strand, 1, extension);
-    if (counts.size() != 1)
+    const Region& region = regions[order[i]];
+    if (work.empty()
+        || strcmp(region.chromosome, regions[order[work.back().begin]].chromosome) != 0
+        || region.start > chunk_stop
+        || region.start >= regions[order[work.back().begin]].start + chunk_base_pairs)
     {
-      throw std::runtime_error("liquidate failed to provide exactly one count (count is " +
-        boost::lexical_cast<std::string>(counts.size()) + ")");
+      work.push_back(Chunk{i, i});
+      chunk_stop = 0;
     }
-    return counts[0];
+    work.back().end = i + 1;
+    chunk_stop = std::max(chunk_stop, region.stop);
   }
 
-private:
-  std::string bam_file_path;
-  samfile_t* fp;
-  bam_index_t* bamidx;
+  return work;
+}
+
+// the strand a region with file_strand in the region file is counted on with mode
+inline char counted_strand(char file_strand, const CountingMode& mode)
+{
+  return mode.strand == '_' ? file_strand : mode.strand;
+}
+
+// Sets counts[m][i] to the count of region i with modes[m], for each region in the chunk.
+void liquidate_chunk(const std::vector<Region>& regions, const std::vector<char>& file_strands,
+                     const std::vector<size_t>& order, const Chunk& chunk,
+                     const std::vector<CountingMode>& modes,
+                     std::vector<std::vector<uint64_t>>& counts, Liquidators& liquidators)
+{
+  Liquidator& liquidator = liquidators.local();
 
-  void init()
+  // every mode of a region is counted in the same pass, so the reads are decoded once
+  std::vector<RegionCount> region_counts;
+  region_counts.reserve((chunk.end - chunk.begin) * modes.size());
+  for (size_t i=chunk.begin; i < chunk.end; ++i)
   {
-    fp = samopen(bam_file_path.c_str(),"rb",0);
-    if(fp == NULL)
+    const Region& region = regions[order[i]];
+    for (const CountingMode& mode : modes)
     {
-      throw std::runtime_error("samopen() error with " + bam_file_path);
+      region_counts.push_back(RegionCount{(unsigned int) region.start, (unsigned int) region.stop,
+                                          counted_strand(file_strands[order[i]], mode),
+                                          mode.extendlen, 0});
     }
+  }
+
+  try
+  {
+    liquidator.liquidate_regions(regions[order[chunk.begin]].chromosome, region_counts);
+  } catch(const std::exception& e)
+  {
+    const size_t i = *std::min_element(order.begin() + chunk.begin, order.begin() + chunk.end);
+    Logger::error() << "Aborting because failed to parse region " << i+1 << " (" << regions[i] << ") due to error: "
+                    << e.what();
+    throw;
+  }
 
-    bamidx = bam_index_load(bam_file_path.c_str());
-    if (bamidx == NULL)
+  for (size_t i=chunk.begin; i < chunk.end; ++i)
+  {
+    for (size_t m=0; m < modes.size(); ++m)
     {
-      throw std::runtime_error("bam_index_load() error with " + bam_file_path);
+      counts[m][order[i]] = region_counts[(i - chunk.begin) * modes.size() + m].count;
     }
   }
+}
+
+// The regions of a single bam file, where counts[m][i] is the count of regions[i] with modes[m]
+// and file_strands[i] is the strand of regions[i] in the region file.
+struct RegionCounts
+{
+  std::vector<Region> regions;
+  std::vector<char> file_strands;
+  std::vector<std::vector<uint64_t>> counts;
 };
 
-typedef tbb::enumerable_thread_specific<Liquidator,
-                                        tbb::cache_aligned_allocator<Liquidator>,
-                                        tbb::ets_key_per_instance>
-        Liquidators;
+void batch_liquidate(RegionCounts& result, const std::vector<CountingMode>& modes, Liquidators& liquidators)
+{
+  const std::vector<Region>& regions = result.regions;
+  const std::vector<char>& file_strands = result.file_strands;
+  std::vector<std::vector<uint64_t>>& counts = result.counts;
+
+  std::vector<size_t> order;
+  const std::vector<Chunk> work = chunks(regions, order);
+  counts.assign(modes.size(), std::vector<uint64_t>(regions.size(), 0));
+
+  tbb::parallel_for(
+    tbb::blocked_range<int>(0, work.size(), 1),
+    [&](const tbb::blocked_range<int>& range)
+    {
+      for (int i=range.begin(); i < range.end(); ++i)
+      {
+        liquidate_chunk(regions, file_strands, order, work[i], modes, counts, liquidators);
+      }
+    },
+    tbb::auto_partitioner());
+}
 
-void liquidate_regions(std::vector<Region>& regions, const std::string& bam_file_path,
-                       size_t region_begin, size_t region_end, unsigned int extension,
-                       Liquidators& liquidators)
+void batch_liquidate(RegionCounts& result, const std::vector<CountingMode>& modes,
+                     const std::string& bam_file_path)
 {
-  Liquidator& liquidator = liquidators.local();
+  Liquidators liquidators(liquidator_for(bam_file_path));
+  batch_liquidate(result, modes, liquidators);
+}
+
+// The first mode is written to the region_counts table, and each other mode to the table
+// named by counts_table_name.
+void write(hid_t& file, RegionCounts& result, const std::vector<CountingMode>& modes, const NameKeys& keys)
+{
+  std::vector<Region>& regions = result.regions;
+  for (size_t m=0; m < modes.size(); ++m)
+  {
+    for (size_t i=0; i < regions.size(); ++i)
+    {
+      regions[i].strand = counted_strand(result.file_strands[i], modes[m]);
+      regions[i].count = result.counts[m][i];
+    }
+    write(file, m == 0 ? "region_counts" : counts_table_name("region_counts", modes[m]), regions, keys);
+  }
+}
+
+// Every parameter the cached counts of a bam file depend on, where region_file_hash is the
+// file_hash of the region file.
+std::string regions_cache_key(const BamFile& bam_file, const std::string& region_file_hash,
+                              const std::string& region_format, const std::vector<CountingMode>& modes)
+{
+  std::stringstream ss;
+  ss << "bamliquidator_regions\n"
+     << bam_file_identity(bam_file.path) << "\n"
+     << region_file_hash << " " << region_format << "\n"
+     << counting_modes_key(modes) << "\n"
+     << chromosome_lengths_key(bam_file.chromosome_lengths);
+  return ss.str();
+}
+
+// Liquidates the result's regions, or reads their counts from the cache if the cache has them,
+// adding them to the cache otherwise.  The counts are cached mode major.
+void cached_batch_liquidate(RegionCounts& result, const std::vector<CountingMode>& modes,
+                            const BamFile& bam_file, const std::string& region_file_hash,
+                            const std::string& region_format, const CountsCache& cache)
+{
+  const size_t regions = result.regions.size();
+  CacheEntry entry(cache, cache.enabled() ? regions_cache_key(bam_file, region_file_hash, region_format, modes) : "",
+                   modes.size() * regions);
+  if (entry.hit())
+  {
+    result.counts.assign(modes.size(), std::vector<uint64_t>(regions, 0));
+    for (size_t m=0; m < modes.size(); ++m)
+    {
+      entry.read(m * regions, result.counts[m].data(), regions);
+    }
+    return;
+  }
+
+  batch_liquidate(result, modes, bam_file.path);
+
+  for (size_t m=0; m < modes.size(); ++m)
+  {
+    entry.write(m * regions, result.counts[m].data(), regions);
+  }
+  entry.commit();
+}
+
+// At most this many liquidated batches wait in memory for the HDF5 writer thread when streaming.
+const size_t writer_queue_batches = 2;
+
+// Like liquidate_and_write, except that the region file is parsed, liquidated and written
+// batch_lines lines at a time, so that memory use is bounded by the batch size instead of the
+// region file size.  The bam files are liquidated one after another (each batch in parallel),
+// while a dedicated writer thread appends the previous batch, and the counts aren't cached,
+// since the size of a cache entry isn't known until the whole region file is parsed.
+void stream_liquidate_and_write(hid_t& file, const std::string& region_file_path, const std::string& region_format,
+                                const std::vector<BamFile>& bam_files, const std::vector<CountingMode>& modes,
+                                const NameKeys& keys, const size_t batch_lines)
+{
+  BackgroundInOrderWriter<RegionCounts> writer([&](RegionCounts& result)
+  {
+    if (!result.regions.empty())
+    {
+      write(file, result, modes, keys);
+    }
+  }, writer_queue_batches);
 
-  for (size_t i=region_begin; i < region_end; ++i)
+  size_t batches = 0;
+  for (const BamFile& bam_file : bam_files)
   {
-    try
+    std::map<std::string, size_t> chromosome_to_length;
+    for (auto& chr_length : bam_file.chromosome_lengths)
+    {
+      chromosome_to_length[chr_length.first] = chr_length.second;
+    }
+
+    RegionParser parser(region_file_path, region_format, bam_file.key, chromosome_to_length, modes[0].strand);
+    Liquidators liquidators(liquidator_for(bam_file.path));
+    size_t valid_regions = 0;
+    for (RegionCounts result; parser.next(result.regions, &result.file_strands, batch_lines); result = RegionCounts())
     {
-      regions[i].count = liquidator.liquidate(regions[i].chromosome,
-                                              regions[i].start, 
-                                              regions[i].stop, 
-                                              regions[i].strand,
-                                              extension);
-    } catch(const std::exception& e)
+      if (!result.regions.empty())
+      {
+        batch_liquidate(result, modes, liquidators);
+        valid_regions += result.regions.size();
+      }
+      writer.submit(batches++, std::move(result));
+    }
+
+    if (valid_regions == 0)
     {
-      Logger::error() << "Aborting because failed to parse region " << i+1 << " (" << regions[i] << ") due to error: "
-                      << e.what();
-      throw;
+      Logger::warn() << "No valid regions detected in " << region_file_path << " for " << bam_file.path;
     }
   }
+
+  writer.finish(batches);
 }
 
-void liquidate_and_write(hid_t& file, std::vector<Region>& regions,
-                         unsigned int extension, const std::string& bam_file_path)
+// Liquidates the regions in each of the bam files, with the files, and the chunks of each
+// file, all scheduled in the same tbb pool so that threads that run out of chunks in one file
+// steal chunks from the other files.  The counts are written in the order of bam_files, as
+// soon as each file and all before it are done.
+void liquidate_and_write(hid_t& file, const std::string& region_file_path, const std::string& region_format,
+                         const std::vector<BamFile>& bam_files, const std::vector<CountingMode>& modes,
+                         const NameKeys& keys, const CountsCache& cache)
 {
-  Liquidators liquidators((Liquidator(bam_file_path))); 
+  const std::string region_file_hash = cache.enabled() ? file_hash(region_file_path) : "";
+
+  InOrderWriter<RegionCounts> writer([&](RegionCounts& result)
+  {
+    if (!result.regions.empty())
+    {
+      write(file, result, modes, keys);
+    }
+  });
 
   tbb::parallel_for(
-    tbb::blocked_range<int>(0, regions.size(), 1),
-    [&](const tbb::blocked_range<int>& range)
+    tbb::blocked_range<size_t>(0, bam_files.size(), 1),
+    [&](const tbb::blocked_range<size_t>& range)
     {
-      liquidate_regions(regions, bam_file_path, range.begin(), range.end(), extension, liquidators);
-    },
-    tbb::auto_partitioner());
+      for (size_t i = range.begin(); i < range.end(); ++i)
+      {
+        const BamFile& bam_file = bam_files[i];
+
+        #ifdef time_region_parsing 
+        boost::timer::cpu_timer timer; 
+        #endif
+
+        std::map<std::string, size_t> chromosome_to_length;
+        for (auto& chr_length : bam_file.chromosome_lengths)
+        {
+          chromosome_to_length[chr_length.first] = chr_length.second;
+        }
 
-  write(file, regions);
+        RegionCounts result;
+        result.regions = parse_regions(region_file_path,
+                                       region_format,
+                                       bam_file.key,
+                                       chromosome_to_length,
+                                       modes[0].strand,
+                                       &result.file_strands);
+        #ifdef time_region_parsing 
+        timer.stop();
+        std::cout << "parsing regions took" << timer.format() << std::endl;
+        #endif
+
+        if (result.regions.size() == 0)
+        {
+          Logger::warn() << "No valid regions detected in " << region_file_path << " for " << bam_file.path;
+        }
+        else
+        {
+          cached_batch_liquidate(result, modes, bam_file, region_file_hash, region_format, cache);
+        }
+        writer.submit(i, std::move(result));
+      }
+    },
+    tbb::simple_partitioner());
 }
 
 int main(int argc, char* argv[])
 {
   try
   {
-    if (argc < 13 || argc % 2 != 1)
+    const bool use_manifest = argc > 1 && std::string(argv[1]) == "--manifest";
+    if (use_manifest ? (argc != 11 && argc != 13 && argc != 14) : (argc < 13 || argc % 2 != 1))
     {
       std::cerr << "usage: " << argv[0] << " number_of_threads region_file gff_or_bed_format extension bam_file bam_file_key hdf5_file "
                 << "log_file write_warnings_to_stderr strand chr1 length1 ...\n"
@@ -325,24 +1020,78 @@ int main(int argc, char* argv[])
         << "\n      /ifs/labs/bradner/bam/hg18/mm1s/04032013_D1L57ACXX_4.TTAGGC.hg18.bwt.sorted.bam 137 counts.hdf5 "
         << "\n      output/log.txt 1 _ chr1 247249719 chr2 242951149 chr3 199501827\n"
         << "\nstrand value of _ means use strand that is specified in region file (and use . if strand not specified in region file)."
+        << "\nextension and strand may be comma separated lists, e.g. 0,200 and _,. to count every combination in one pass:"
+        << "\nthe first combination is written to the region_counts table, and the others to tables such as region_counts_both_200."
         << "\nnumber of threads <= 0 means use a number of threads equal to the number of logical cpus."
-        << "\nnote that this application is intended to be run from bamliquidator_batch.py -- see"
+        << "\n\nalternatively, to liquidate many bam files in a single process:"
+        << "\n  " << argv[0] << " --manifest number_of_threads region_file gff_or_bed_format extension manifest_file "
+        << "hdf5_file log_file write_warnings_to_stderr strand [cache_directory cache_megabytes [batch_lines]]"
+        << "\nwhere manifest_file has one tab separated line per bam file: bam_file bam_file_key cell_type chr1 length1 ..."
+        << "\nor bam_file bam_file_key cell_type patterns_to_skip, to count on every chromosome in the bam file header"
+        << "\nwhose name doesn't contain any of the comma separated patterns (e.g. chrUn,_random), and to add the bam file"
+        << "\nto the files table with its mapped read count from the bam index."
+        << "\n(cell_type is ignored)"
+        << "\nwith a cache_directory, counts are cached there (shared with other processes), and a bam file that was"
+        << "\nalready liquidated with the same region file, extensions, strands and chromosomes is read from the cache"
+        << "\ninstead, with the least recently used counts evicted once the cache exceeds cache_megabytes"
+        << "\n(an empty cache_directory disables the cache)."
+        << "\nwith batch_lines > 0, the region file is liquidated and written batch_lines lines at a time, so that memory"
+        << "\nuse is bounded by the batch instead of the region file (the bam files are then liquidated one after another,"
+        << "\nwithout the cache)."
+        << "\n\nnote that this application is intended to be run from bamliquidator_batch.py -- see"
         << "\nhttps://github.com/BradnerLab/pipeline/wiki for more information"
         << std::endl;
       return 1;
     }
 
-    const int number_of_threads = boost::lexical_cast<int>(argv[1]);
-    const std::string region_file_path = argv[2];
-    const std::string region_format = argv[3];
-    const unsigned int extension = boost::lexical_cast<unsigned int>(argv[4]);
-    const std::string bam_file_path = argv[5];
-    const unsigned int bam_file_key = boost::lexical_cast<unsigned int>(argv[6]);
-    const std::string hdf5_file_path = argv[7];
-    const std::string log_file_path = argv[8];
-    const bool write_warnings_to_stderr = boost::lexical_cast<bool>(argv[9]);
-    const char strand = boost::lexical_cast<char>(argv[10]);
-    const std::vector<std::pair<std::string, size_t>> chromosome_lengths = extract_chromosome_lengths(argc, argv, 11);
+    int number_of_threads;
+    std::string region_file_path;
+    std::string region_format;
+    std::vector<CountingMode> modes;
+    std::string manifest_path;
+    std::string hdf5_file_path;
+    std::string log_file_path;
+    bool write_warnings_to_stderr;
+    std::vector<BamFile> bam_files;
+    CountsCache cache{"", 0};
+    size_t batch_lines = 0;
+    if (use_manifest)
+    {
+      number_of_threads = boost::lexical_cast<int>(argv[2]);
+      region_file_path = argv[3];
+      region_format = argv[4];
+      manifest_path = argv[6];
+      hdf5_file_path = argv[7];
+      log_file_path = argv[8];
+      write_warnings_to_stderr = boost::lexical_cast<bool>(argv[9]);
+      modes = extract_counting_modes(argv[10], argv[5]);
+      if (argc >= 13)
+      {
+        cache.directory = argv[11];
+        cache.max_bytes = boost::lexical_cast<uint64_t>(argv[12]) << 20;
+      }
+      if (argc == 14)
+      {
+        batch_lines = boost::lexical_cast<size_t>(argv[13]);
+      }
+    }
+    else
+    {
+      number_of_threads = boost::lexical_cast<int>(argv[1]);
+      region_file_path = argv[2];
+      region_format = argv[3];
+      hdf5_file_path = argv[7];
+      log_file_path = argv[8];
+      write_warnings_to_stderr = boost::lexical_cast<bool>(argv[9]);
+      modes = extract_counting_modes(argv[10], argv[4]);
+
+      BamFile bam_file;
+      bam_file.path = argv[5];
+      bam_file.key = boost::lexical_cast<unsigned int>(argv[6]);
+      bam_file.chromosome_lengths = extract_chromosome_lengths(argc, argv, 11);
+      bam_file.chromosomes_from_header = false;
+      bam_files.push_back(bam_file);
+    }
 
     tbb::task_scheduler_init init( number_of_threads <= 0 
                                  ? tbb::task_scheduler_init::automatic
@@ -357,32 +1106,21 @@ int main(int argc, char* argv[])
       return 3;
     }
 
-    #ifdef time_region_parsing 
-    boost::timer::cpu_timer timer; 
-    #endif
-
-    std::map<std::string, size_t> chromosome_to_length;
-    for (auto& chr_length : chromosome_lengths)
+    if (use_manifest)
     {
-      chromosome_to_length[chr_length.first] = chr_length.second;
+      bam_files = read_manifest(manifest_path);
     }
+    read_bam_file_headers(h5file, bam_files);
 
-    std::vector<Region> regions = parse_regions(region_file_path,
-                                                region_format,
-                                                bam_file_key,
-                                                chromosome_to_length,
-                                                strand);
-    #ifdef time_region_parsing 
-    timer.stop();
-    std::cout << "parsing regions took" << timer.format() << std::endl;
-    #endif
-    if (regions.size() == 0)
+    if (batch_lines > 0)
     {
-      Logger::warn() << "No valid regions detected in " << region_file_path;
-      return 0;
+      stream_liquidate_and_write(h5file, region_file_path, region_format, bam_files, modes, read_name_keys(h5file),
+                                 batch_lines);
+    }
+    else
+    {
+      liquidate_and_write(h5file, region_file_path, region_format, bam_files, modes, read_name_keys(h5file), cache);
     }
-
-    liquidate_and_write(h5file, regions, extension, bam_file_path);
    
     H5Fclose(h5file);
 
@@ -2,9 +2,21 @@
 
 #include <iostream>
 #include <fstream>
+#include <cerrno>
+#include <cstdio>
 #include <ctime>
+#include <limits>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 #include <unistd.h>
 
+#include <hdf5_hl.h>
+
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+
 namespace
 {
   std::ofstream log_file;
@@ -28,6 +40,11 @@ Logger Logger::error()
   return Logger("ERROR", true);
 }
 
+Logger Logger::info()
+{
+  return Logger("INFO", false);
+}
+
 Logger::Logger(const std::string& a_level, bool a_write_to_stderr):
   level(a_level),
   write_to_stderr(a_write_to_stderr),
@@ -64,6 +81,535 @@ Logger::Logger(const Logger& logger):
   logger.copied = true;
 }
 
+std::vector<BamFile> read_manifest(const std::string& manifest_path)
+{
+  std::ifstream manifest(manifest_path);
+  if (!manifest.is_open())
+  {
+    throw std::runtime_error("failed to open manifest " + manifest_path);
+  }
+
+  std::vector<BamFile> bam_files;
+  int line_number = 1;
+  for (std::string line; std::getline(manifest, line); ++line_number)
+  {
+    if (line.empty()) continue;
+
+    std::vector<std::string> columns;
+    boost::split(columns, line, boost::is_any_of("\t"));
+    if (columns.size() < 3 || (columns.size() % 2 != 1 && columns.size() != 4))
+    {
+      std::stringstream ss;
+      ss << "malformed line " << line_number << " in manifest " << manifest_path;
+      throw std::runtime_error(ss.str());
+    }
+
+    BamFile bam_file;
+    bam_file.path = columns[0];
+    bam_file.key = boost::lexical_cast<unsigned int>(columns[1]);
+    bam_file.cell_type = columns[2];
+    bam_file.chromosomes_from_header = columns.size() == 4;
+    if (bam_file.chromosomes_from_header)
+    {
+      if (!columns[3].empty())
+      {
+        boost::split(bam_file.chromosome_patterns_to_skip, columns[3], boost::is_any_of(","));
+      }
+    }
+    else
+    {
+      for (size_t i = 3; i < columns.size(); i += 2)
+      {
+        bam_file.chromosome_lengths.push_back(
+          std::make_pair(columns[i], boost::lexical_cast<size_t>(columns[i+1])));
+      }
+    }
+    bam_files.push_back(bam_file);
+  }
+
+  return bam_files;
+}
+
+namespace
+{
+  // this NameH5Record must match exactly the structure in HDF5
+  // -- see bamliquidator_batch.py function create_names_table
+  struct NameH5Record
+  {
+    uint32_t key;
+    char name[64];
+  };
+
+  std::map<std::string, uint32_t> read_names(hid_t file, const std::string& table_name)
+  {
+    std::map<std::string, uint32_t> keys;
+    if (H5LTfind_dataset(file, table_name.c_str()) <= 0)
+    {
+      return keys;
+    }
+
+    hsize_t fields = 0;
+    hsize_t records = 0;
+    if (H5TBget_table_info(file, table_name.c_str(), &fields, &records) < 0)
+    {
+      throw std::runtime_error("failed to get table info for " + table_name);
+    }
+
+    size_t record_offset[] = { HOFFSET(NameH5Record, key),
+                               HOFFSET(NameH5Record, name) };
+
+    size_t field_sizes[] = { sizeof(NameH5Record::key),
+                             sizeof(NameH5Record::name) };
+
+    std::vector<NameH5Record> names(records);
+    if (records > 0 && H5TBread_table(file, table_name.c_str(), sizeof(NameH5Record), record_offset,
+                                      field_sizes, names.data()) < 0)
+    {
+      throw std::runtime_error("failed to read table " + table_name);
+    }
+
+    for (const NameH5Record& name : names)
+    {
+      keys[std::string(name.name, strnlen(name.name, sizeof(name.name)))] = name.key;
+    }
+    return keys;
+  }
+}
+
+NameKeys read_name_keys(hid_t file)
+{
+  NameKeys keys;
+  keys.chromosomes = read_names(file, "chromosome_names");
+  keys.cell_types = read_names(file, "cell_type_names");
+  return keys;
+}
+
+namespace
+{
+  // this FileH5Record must match exactly the structure in HDF5
+  // -- see bamliquidator_batch.py function create_files_table
+  struct FileH5Record
+  {
+    uint32_t key;
+    uint64_t length;
+  };
+
+  template <typename T>
+  void append(hid_t file, const std::string& table_name, const std::vector<T>& records,
+              const size_t* record_offset, const size_t* field_sizes)
+  {
+    if (!records.empty() && H5TBappend_records(file, table_name.c_str(), records.size(), sizeof(T),
+                                                record_offset, field_sizes, records.data()) < 0)
+    {
+      throw std::runtime_error("failed to append records to " + table_name);
+    }
+  }
+
+  // the max length of the chromosome names in the counts tables, including the null terminator
+  // -- see normalize_plot_and_summarize.py chromosome_name_length
+  const size_t chromosome_name_length = 64;
+}
+
+void read_bam_file_headers(hid_t file, std::vector<BamFile>& bam_files)
+{
+  // reading the headers and index metadata is mostly waiting on i/o, e.g. on network storage,
+  // so many bam files are read at once
+  std::vector<std::vector<ReferenceStats>> stats(bam_files.size());
+  tbb::parallel_for(
+    tbb::blocked_range<size_t>(0, bam_files.size(), 1),
+    [&](const tbb::blocked_range<size_t>& range)
+    {
+      for (size_t i = range.begin(); i < range.end(); ++i)
+      {
+        if (bam_files[i].chromosomes_from_header)
+        {
+          stats[i] = reference_stats(bam_files[i].path, false);
+        }
+      }
+    });
+
+  std::vector<FileH5Record> files;
+  std::vector<std::string> chromosomes;
+  for (size_t i=0; i < bam_files.size(); ++i)
+  {
+    BamFile& bam_file = bam_files[i];
+    if (!bam_file.chromosomes_from_header) continue;
+
+    uint64_t mapped = 0;
+    for (const ReferenceStats& reference : stats[i])
+    {
+      if (reference.name.size() >= chromosome_name_length)
+      {
+        std::stringstream ss;
+        ss << "Chromosome name \"" << reference.name << "\" exceeds the max supported chromosome name length ("
+           << chromosome_name_length << ").  This max chromosome length may be updated in the code if necessary "
+           << "-- please contact the bamliquidator developers for additional assistance.";
+        throw std::runtime_error(ss.str());
+      }
+      mapped += reference.mapped;
+
+      // like bamliquidator_batch.py, only the bins skip chromosomes, so every chromosome is named
+      chromosomes.push_back(reference.name);
+      const bool skip = std::any_of(bam_file.chromosome_patterns_to_skip.begin(),
+                                    bam_file.chromosome_patterns_to_skip.end(),
+                                    [&](const std::string& pattern)
+                                    {
+                                      return reference.name.find(pattern) != std::string::npos;
+                                    });
+      if (!skip)
+      {
+        bam_file.chromosome_lengths.push_back(std::make_pair(reference.name, reference.length));
+      }
+    }
+    files.push_back(FileH5Record{bam_file.key, mapped});
+  }
+
+  const size_t file_offsets[] = { HOFFSET(FileH5Record, key),
+                                  HOFFSET(FileH5Record, length) };
+  const size_t file_sizes[] = { sizeof(FileH5Record::key),
+                                sizeof(FileH5Record::length) };
+  append(file, "files", files, file_offsets, file_sizes);
+
+  if (H5LTfind_dataset(file, "chromosome_names") > 0)
+  {
+    std::map<std::string, uint32_t> keys = read_names(file, "chromosome_names");
+    std::vector<NameH5Record> names;
+    for (const std::string& chromosome : chromosomes)
+    {
+      if (keys.count(chromosome) == 0)
+      {
+        // keys are assigned in order like bamliquidator_batch.py function add_names
+        const uint32_t key = keys.size();
+        keys[chromosome] = key;
+        NameH5Record name;
+        name.key = key;
+        copy(name.name, chromosome, sizeof(name.name));
+        names.push_back(name);
+      }
+    }
+
+    const size_t name_offsets[] = { HOFFSET(NameH5Record, key),
+                                    HOFFSET(NameH5Record, name) };
+    const size_t name_sizes[] = { sizeof(NameH5Record::key),
+                                  sizeof(NameH5Record::name) };
+    append(file, "chromosome_names", names, name_offsets, name_sizes);
+  }
+
+  if (H5Fflush(file, H5F_SCOPE_GLOBAL) < 0)
+  {
+    throw std::runtime_error("failed to flush the files table");
+  }
+}
+
+Liquidator liquidator_for(const std::string& bam_file_path)
+{
+  Liquidator liquidator(bam_file_path);
+  if (liquidator.coverage_indexed())
+  {
+    Logger::info() << "Counting " << bam_file_path << " from its coverage index " << coverage_index_path(bam_file_path);
+  }
+  return liquidator;
+}
+
+namespace
+{
+  const char cache_magic[8] = {'B', 'L', 'C', 'A', 'C', 'H', 'E', '1'};
+
+  // temporary cache files older than this were abandoned by a process that crashed
+  const time_t abandoned_seconds = 24*60*60;
+
+  // 64 bit FNV-1a
+  uint64_t hash(const char* data, size_t size, uint64_t h = 14695981039346656037ULL)
+  {
+    for (size_t i=0; i < size; ++i)
+    {
+      h ^= (unsigned char) data[i];
+      h *= 1099511628211ULL;
+    }
+    return h;
+  }
+
+  std::string hex(uint64_t value)
+  {
+    char buffer[17];
+    snprintf(buffer, sizeof(buffer), "%016llx", (unsigned long long) value);
+    return buffer;
+  }
+
+  // hashes the first max_bytes of the file
+  uint64_t hash_contents(const std::string& path, uint64_t max_bytes)
+  {
+    std::ifstream file(path, std::ios::binary);
+    if (!file.is_open())
+    {
+      throw std::runtime_error("failed to open " + path);
+    }
+
+    uint64_t h = hash(nullptr, 0);
+    std::vector<char> buffer(1 << 16);
+    while (max_bytes > 0 && file)
+    {
+      file.read(buffer.data(), std::min<uint64_t>(buffer.size(), max_bytes));
+      h = hash(buffer.data(), file.gcount(), h);
+      max_bytes -= file.gcount();
+    }
+    if (file.bad())
+    {
+      throw std::runtime_error("failed to read " + path);
+    }
+    return h;
+  }
+
+  bool read_fully(int fd, void* data, size_t size, off_t offset)
+  {
+    char* bytes = static_cast<char*>(data);
+    while (size > 0)
+    {
+      const ssize_t n = pread(fd, bytes, size, offset);
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0) return false;
+      bytes += n;
+      size -= n;
+      offset += n;
+    }
+    return true;
+  }
+
+  bool write_fully(int fd, const void* data, size_t size, off_t offset)
+  {
+    const char* bytes = static_cast<const char*>(data);
+    while (size > 0)
+    {
+      const ssize_t n = pwrite(fd, bytes, size, offset);
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0) return false;
+      bytes += n;
+      size -= n;
+      offset += n;
+    }
+    return true;
+  }
+
+  // Removes the least recently used entries until the entries total at most max_bytes, along
+  // with abandoned temporary files.  Other processes may be evicting at the same time, so
+  // files that are already gone are just skipped.
+  void evict(const CountsCache& cache)
+  {
+    DIR* dir = opendir(cache.directory.c_str());
+    if (dir == NULL)
+    {
+      return;
+    }
+
+    struct EntryFile
+    {
+      time_t used;
+      uint64_t bytes;
+      std::string path;
+    };
+
+    std::vector<EntryFile> entries;
+    uint64_t total = 0;
+    const time_t now = std::time(NULL);
+    while (const dirent* dir_entry = readdir(dir))
+    {
+      const std::string name = dir_entry->d_name;
+      const std::string path = cache.directory + "/" + name;
+      struct stat st;
+      if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+      {
+        continue;
+      }
+
+      if (name.find(".counts.tmp.") != std::string::npos)
+      {
+        if (now - st.st_mtime > abandoned_seconds)
+        {
+          unlink(path.c_str());
+        }
+      }
+      else if (boost::algorithm::ends_with(name, ".counts"))
+      {
+        entries.push_back(EntryFile{st.st_mtime, uint64_t(st.st_size), path});
+        total += st.st_size;
+      }
+    }
+    closedir(dir);
+
+    std::sort(entries.begin(), entries.end(), [](const EntryFile& a, const EntryFile& b)
+    {
+      return a.used < b.used;
+    });
+    for (const EntryFile& entry : entries)
+    {
+      if (total <= cache.max_bytes) break;
+      if (unlink(entry.path.c_str()) == 0 || errno == ENOENT)
+      {
+        total -= entry.bytes;
+      }
+    }
+  }
+}
+
+std::string bam_file_identity(const std::string& bam_file_path)
+{
+  struct stat st;
+  if (stat(bam_file_path.c_str(), &st) != 0)
+  {
+    throw std::runtime_error("failed to stat " + bam_file_path);
+  }
+
+  std::stringstream ss;
+  ss << st.st_size << ":" << st.st_mtime << ":" << hex(hash_contents(bam_file_path, 1 << 16));
+  return ss.str();
+}
+
+std::string file_hash(const std::string& path)
+{
+  return hex(hash_contents(path, std::numeric_limits<uint64_t>::max()));
+}
+
+std::string counting_modes_key(const std::vector<CountingMode>& modes)
+{
+  std::stringstream ss;
+  for (size_t m=0; m < modes.size(); ++m)
+  {
+    ss << (m == 0 ? "" : ",") << modes[m].strand << "/" << modes[m].extendlen;
+  }
+  return ss.str();
+}
+
+std::string chromosome_lengths_key(const std::vector<std::pair<std::string, size_t>>& chromosome_lengths)
+{
+  std::stringstream ss;
+  for (size_t i=0; i < chromosome_lengths.size(); ++i)
+  {
+    ss << (i == 0 ? "" : ",") << chromosome_lengths[i].first << ":" << chromosome_lengths[i].second;
+  }
+  return ss.str();
+}
+
+CacheEntry::CacheEntry(const CountsCache& a_cache, const std::string& key, size_t size):
+  cache(a_cache),
+  fd(-1),
+  data_offset(sizeof(cache_magic) + 2*sizeof(uint64_t) + key.size()),
+  found(false),
+  failed(false)
+{
+  if (!cache.enabled())
+  {
+    return;
+  }
+
+  path = cache.directory + "/" + hex(hash(key.data(), key.size())) + ".counts";
+
+  // magic, key size, key, number of counts
+  std::vector<char> header(data_offset);
+  const uint64_t key_size = key.size();
+  const uint64_t counts_size = size;
+  memcpy(header.data(), cache_magic, sizeof(cache_magic));
+  memcpy(header.data() + sizeof(cache_magic), &key_size, sizeof(key_size));
+  memcpy(header.data() + sizeof(cache_magic) + sizeof(key_size), key.data(), key.size());
+  memcpy(header.data() + data_offset - sizeof(counts_size), &counts_size, sizeof(counts_size));
+
+  fd = open(path.c_str(), O_RDONLY);
+  if (fd >= 0)
+  {
+    std::vector<char> entry_header(data_offset);
+    struct stat st;
+    found = fstat(fd, &st) == 0
+         && uint64_t(st.st_size) == data_offset + size*sizeof(uint64_t)
+         && read_fully(fd, entry_header.data(), entry_header.size(), 0)
+         && entry_header == header;
+    if (found)
+    {
+      // marks the entry as recently used, so it is evicted last
+      utimes(path.c_str(), NULL);
+      return;
+    }
+    close(fd);
+    fd = -1;
+  }
+
+  if (mkdir(cache.directory.c_str(), 0777) != 0 && errno != EEXIST)
+  {
+    Logger::warn() << "Not caching counts because failed to create cache directory " << cache.directory;
+    failed = true;
+    return;
+  }
+
+  static std::atomic<unsigned int> temporaries(0);
+  std::stringstream ss;
+  ss << path << ".tmp." << getpid() << "." << temporaries++;
+  temporary_path = ss.str();
+  fd = open(temporary_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0 || !write_fully(fd, header.data(), header.size(), 0))
+  {
+    Logger::warn() << "Not caching counts because failed to write " << temporary_path;
+    failed = true;
+  }
+}
+
+CacheEntry::~CacheEntry()
+{
+  if (fd >= 0)
+  {
+    close(fd);
+  }
+  if (!temporary_path.empty())
+  {
+    unlink(temporary_path.c_str());
+  }
+}
+
+void CacheEntry::read(size_t offset, uint64_t* counts, size_t n) const
+{
+  if (!read_fully(fd, counts, n*sizeof(uint64_t), data_offset + offset*sizeof(uint64_t)))
+  {
+    throw std::runtime_error("failed to read cached counts from " + path);
+  }
+}
+
+void CacheEntry::write(size_t offset, const uint64_t* counts, size_t n)
+{
+  if (fd < 0 || failed)
+  {
+    return;
+  }
+  if (!write_fully(fd, counts, n*sizeof(uint64_t), data_offset + offset*sizeof(uint64_t))
+      && !failed.exchange(true))
+  {
+    Logger::warn() << "Not caching counts because failed to write " << temporary_path;
+  }
+}
+
+void CacheEntry::commit()
+{
+  if (found || temporary_path.empty())
+  {
+    return;
+  }
+
+  if (fd >= 0 && close(fd) != 0)
+  {
+    failed = true;
+  }
+  fd = -1;
+  if (failed)
+  {
+    return;
+  }
+
+  if (rename(temporary_path.c_str(), path.c_str()) != 0)
+  {
+    Logger::warn() << "Not caching counts because failed to rename " << temporary_path << " to " << path;
+    return;
+  }
+  temporary_path.clear();
+
+  evict(cache);
+}
+
 /* The MIT License (MIT) 
 
    Copyright (c) 2014 John DiMatteo (jdimatteo@gmail.com)
@@ -2,15 +2,28 @@
 #define PIPELINE_BAMLIQUIDATORINTERNAL_BAMLIQUIDATOR_UTIL_H
 
 #include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <map>
+#include <mutex>
 #include <ostream>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <vector>
 #include <utility>
 #include <cstring>
+#include <stdexcept>
 
+#include <boost/algorithm/string.hpp>
 #include <boost/lexical_cast.hpp>
 
+#include <hdf5.h>
+
+#include "bamliquidator.h"
+
 // todo: use a namespace here
 
 // copies str to dest
@@ -58,6 +71,15 @@ public:
    */
   static Logger error();
 
+  /* e.g. Logger::info() << "oops " << 123 results in a logged line like the following written to the log file
+   * only:
+   *
+   *  2014-08-05 13:25:06 INFO	oops 123
+   *
+   * Since copy constructor is private, returned value must be used as an anonymous temporary as in the example.
+   */
+  static Logger info();
+
   template<typename T>
   Logger& operator<<(const T& v)
   {
@@ -94,6 +116,371 @@ extract_chromosome_lengths(int argc, char* argv[], int chr1_arg)
   return chromosome_lengths;
 }
 
+// A bam file to liquidate, with its bamliquidator_batch.py file key and cell type, and the
+// chromosomes to count on.  If chromosomes_from_header, the chromosomes are instead every
+// chromosome in the bam file header that doesn't contain any of chromosome_patterns_to_skip
+// (see read_bam_file_headers).
+struct BamFile
+{
+  std::string path;
+  unsigned int key;
+  std::string cell_type;
+  std::vector<std::pair<std::string, size_t>> chromosome_lengths;
+  bool chromosomes_from_header;
+  std::vector<std::string> chromosome_patterns_to_skip;
+};
+
+// The keys of the chromosome and cell type names in a counts file with the compact layout,
+// where the counts tables have small integer chromosome_key and cell_type_key columns instead
+// of the names -- see bamliquidator_batch.py function create_names_table.  Both maps are
+// empty for a counts file with the usual layout, which stores the names in every row.
+struct NameKeys
+{
+  std::map<std::string, uint32_t> chromosomes;
+  std::map<std::string, uint32_t> cell_types;
+
+  bool compact() const
+  {
+    return !chromosomes.empty();
+  }
+};
+
+// Reads the chromosome_names and cell_type_names tables, if present.  Throws if they can't
+// be read.
+NameKeys read_name_keys(hid_t file);
+
+// Throws if name has no key, which means bamliquidator_batch.py didn't add it to the names table.
+inline uint32_t name_key(const std::map<std::string, uint32_t>& keys, const std::string& name)
+{
+  const auto it = keys.find(name);
+  if (it == keys.end())
+  {
+    throw std::runtime_error("no key for name " + name);
+  }
+  return it->second;
+}
+
+// Reads a manifest of bam files to liquidate in a single process, which has one tab
+// separated line per bam file, either listing the chromosomes to count on:
+//
+//   bam_file bam_file_key cell_type chr1 length1 chr2 length2 ...
+//
+// or with a (possibly empty) comma separated list of chromosome name patterns to skip
+// instead, to count on the other chromosomes in the bam file header:
+//
+//   bam_file bam_file_key cell_type chrUn,_random
+//
+// Throws if the manifest can't be read or a line is malformed.
+std::vector<BamFile> read_manifest(const std::string& manifest_path);
+
+// For each bam file with chromosomes_from_header, reads the chromosome lengths from the bam
+// file header and the number of mapped reads from the bam index, in parallel, and appends
+// the bam file to the files table with its key and mapped read count (which
+// bamliquidator_batch.py leaves to the executables, so that it doesn't have to read every
+// bam file first).  If the counts file has the compact layout, any new chromosome names are
+// also added to the chromosome_names table.  Throws if a bam file or its index can't be read,
+// a chromosome name is too long, or the tables can't be written.
+void read_bam_file_headers(hid_t file, std::vector<BamFile>& bam_files);
+
+// A Liquidator for the bam file, logging (at info level) when the bam file's counts will come
+// from its coverage index.  Throws if the bam file or its index can't be opened.
+Liquidator liquidator_for(const std::string& bam_file_path);
+
+// Calls write on results that are submitted from several threads in any order, one result
+// at a time and in index order (0, 1, 2, ...), holding results back until all of the
+// results before them have been written.  This lets e.g. many bam files be liquidated
+// concurrently while a single writer appends them to HDF5 (which isn't thread safe) in the
+// same order as if they had been liquidated one after another.
+template <typename T>
+class InOrderWriter
+{
+public:
+  explicit InOrderWriter(const std::function<void(T&)>& write):
+    write(write),
+    next(0)
+  {}
+
+  void submit(size_t index, T&& result)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    pending.insert(std::make_pair(index, std::move(result)));
+    for (auto it = pending.find(next); it != pending.end(); it = pending.find(next))
+    {
+      write(it->second);
+      pending.erase(it);
+      ++next;
+    }
+  }
+
+private:
+  const std::function<void(T&)> write;
+  std::mutex mutex;
+  std::map<size_t, T> pending;
+  size_t next;
+};
+
+// Like InOrderWriter, except that write is called on a dedicated writer thread, so that e.g.
+// appending to HDF5 overlaps with liquidating instead of waiting for it.  At most capacity
+// results are held back at once: submit blocks while that many are waiting, except for the
+// next result to write, which is always accepted so that the writer can't stall.  finish
+// waits until results 0 through count - 1 are written, and rethrows the first exception
+// thrown by write (once write throws, later results are discarded).  Since submit may wait
+// for other results, it must only be called from outside the tbb pool (e.g. by the main
+// thread, submitting in order): a tbb task waiting there could be the worker that would
+// otherwise run the task producing the next result.
+template <typename T>
+class BackgroundInOrderWriter
+{
+public:
+  BackgroundInOrderWriter(const std::function<void(T&)>& write, size_t capacity):
+    write(write),
+    capacity(std::max<size_t>(1, capacity)),
+    next(0),
+    count(0),
+    finishing(false),
+    stopping(false),
+    thread(&BackgroundInOrderWriter::run, this)
+  {}
+
+  // stops without waiting for the remaining results, e.g. when liquidation throws
+  ~BackgroundInOrderWriter()
+  {
+    cancel();
+    thread.join();
+  }
+
+  // stops writing, and releases every submit that is waiting for space
+  void cancel()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    ready.notify_all();
+    space.notify_all();
+  }
+
+  void submit(size_t index, T&& result)
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    space.wait(lock, [&] { return index == next || pending.size() < capacity || stopping; });
+    pending.insert(std::make_pair(index, std::move(result)));
+    ready.notify_all();
+  }
+
+  void finish(size_t total)
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      count = total;
+      finishing = true;
+    }
+    ready.notify_all();
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      space.wait(lock, [&] { return next >= count || stopping; });
+    }
+    if (error)
+    {
+      std::rethrow_exception(error);
+    }
+  }
+
+private:
+  void run()
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true)
+    {
+      ready.wait(lock, [&] { return pending.count(next) > 0 || (finishing && next >= count) || stopping; });
+      if (stopping || pending.count(next) == 0) break;
+
+      T result(std::move(pending[next]));
+      pending.erase(next);
+      lock.unlock();
+      if (!error)
+      {
+        try
+        {
+          write(result);
+        }
+        catch (...)
+        {
+          error = std::current_exception();
+        }
+      }
+      lock.lock();
+      ++next;
+      space.notify_all();
+    }
+    space.notify_all();
+  }
+
+  BackgroundInOrderWriter(const BackgroundInOrderWriter&) = delete;
+  BackgroundInOrderWriter& operator=(const BackgroundInOrderWriter&) = delete;
+
+  const std::function<void(T&)> write;
+  const size_t capacity;
+  std::mutex mutex;
+  std::condition_variable ready;
+  std::condition_variable space;
+  std::map<size_t, T> pending;
+  size_t next;
+  size_t count;
+  bool finishing;
+  bool stopping;
+  std::exception_ptr error;
+  std::thread thread;
+};
+
+// Parses comma separated strand and extension arguments, e.g. "+,-,." and "0,200", into
+// every combination of the two (strand major, so the example gives +/0, +/200, -/0, ...).
+// The first combination is written to the usual counts table, and each other combination
+// to the table named by counts_table_name -- see bamliquidator_batch.py function
+// mode_counts_table_name.
+inline std::vector<CountingMode> extract_counting_modes(const std::string& strands,
+                                                        const std::string& extensions)
+{
+  std::vector<std::string> strand_list;
+  std::vector<std::string> extension_list;
+  boost::split(strand_list, strands, boost::is_any_of(","));
+  boost::split(extension_list, extensions, boost::is_any_of(","));
+
+  std::vector<CountingMode> modes;
+  for (const std::string& strand : strand_list)
+  {
+    if (strand.size() != 1)
+    {
+      throw std::runtime_error("invalid strand '" + strand + "' in " + strands);
+    }
+    for (const std::string& extension : extension_list)
+    {
+      modes.push_back(CountingMode{strand[0], boost::lexical_cast<unsigned int>(extension)});
+    }
+  }
+  return modes;
+}
+
+// e.g. bin_counts_forward_200 for strand + and extension 200
+inline std::string counts_table_name(const std::string& base, const CountingMode& mode)
+{
+  const char* strand = mode.strand == '+' ? "forward"
+                     : mode.strand == '-' ? "reverse"
+                     : mode.strand == '_' ? "default"
+                     : "both";
+  return base + "_" + strand + "_" + boost::lexical_cast<std::string>(mode.extendlen);
+}
+
+// Parses a comma separated bin size argument, e.g. "1000,10000,100000", where every bin size
+// after the first is counted in the same pass and written to the table named by
+// level_counts_table_name.  Throws unless every bin size divides the largest one, so that
+// the bins of every size line up with each other at the largest bin boundaries.
+inline std::vector<unsigned int> extract_bin_sizes(const std::string& bin_sizes_arg)
+{
+  std::vector<std::string> bin_size_list;
+  boost::split(bin_size_list, bin_sizes_arg, boost::is_any_of(","));
+
+  std::vector<unsigned int> bin_sizes;
+  for (const std::string& bin_size : bin_size_list)
+  {
+    bin_sizes.push_back(boost::lexical_cast<unsigned int>(bin_size));
+  }
+
+  const unsigned int largest = *std::max_element(bin_sizes.begin(), bin_sizes.end());
+  for (const unsigned int bin_size : bin_sizes)
+  {
+    if (bin_size != 0 && largest % bin_size != 0)
+    {
+      throw std::runtime_error("bin size " + boost::lexical_cast<std::string>(bin_size)
+                               + " does not divide the largest bin size in " + bin_sizes_arg);
+    }
+  }
+  return bin_sizes;
+}
+
+// e.g. bin_counts_10000 for bin size 10000 -- see bamliquidator_batch.py function
+// level_counts_table_name
+inline std::string level_counts_table_name(const std::string& base, unsigned int bin_size)
+{
+  return base + "_" + boost::lexical_cast<std::string>(bin_size);
+}
+
+// An on-disk cache of liquidation counts, shared by any number of bamliquidator_bins and
+// bamliquidator_regions processes, so that liquidating a bam file again with the same
+// parameters (e.g. rerunning bamliquidator_batch.py with a different output directory)
+// reads the counts back instead of sweeping the bam file.  The cache is disabled if the
+// directory is empty.  Once the entries total more than max_bytes, the least recently used
+// entries are evicted.
+struct CountsCache
+{
+  std::string directory;
+  uint64_t max_bytes;
+
+  bool enabled() const
+  {
+    return !directory.empty();
+  }
+};
+
+// Identifies the contents of a bam file for a cache key by its path, size, modification time
+// and a hash of its first 64 KiB, which holds the header, so that a rewritten or replaced bam
+// file misses.  Throws if the bam file can't be read.
+std::string bam_file_identity(const std::string& bam_file_path);
+
+// A hash of the whole file, e.g. so that a cache key changes with an edited region file.
+// Throws if the file can't be read.
+std::string file_hash(const std::string& path);
+
+// e.g. "+/0,-/200"
+std::string counting_modes_key(const std::vector<CountingMode>& modes);
+
+// e.g. "chr1:247249719,chr2:242951149"
+std::string chromosome_lengths_key(const std::vector<std::pair<std::string, size_t>>& chromosome_lengths);
+
+/* The size counts cached with key, which are either a hit, to read, or a miss, to write and
+ * then commit.  Each entry is a file named by a hash of its key that also stores the whole
+ * key, so a hash collision is just a miss.  A miss is written to a temporary file that
+ * commit renames into place, so other processes only ever find complete entries, and two
+ * processes that miss the same key at once both liquidate and the last commit wins.  Errors
+ * writing a miss are logged as warnings and just leave the counts uncached, but errors
+ * reading a hit throw, since the cached counts are needed.
+ */
+class CacheEntry
+{
+public:
+  CacheEntry(const CountsCache& cache, const std::string& key, size_t size);
+
+  // removes the temporary file of an uncommitted miss
+  ~CacheEntry();
+
+  bool hit() const
+  {
+    return found;
+  }
+
+  // reads counts [offset, offset + n) of a hit
+  void read(size_t offset, uint64_t* counts, size_t n) const;
+
+  // writes counts [offset, offset + n) of a miss -- safe to call from several threads at once
+  void write(size_t offset, const uint64_t* counts, size_t n);
+
+  // makes a fully written miss visible to other lookups, and evicts entries if the cache is
+  // then too large
+  void commit();
+
+private:
+  CacheEntry(const CacheEntry&) = delete;
+  CacheEntry& operator=(const CacheEntry&) = delete;
+
+  const CountsCache cache;
+  std::string path;
+  std::string temporary_path;
+  int fd;
+  size_t data_offset;
+  bool found;
+  std::atomic<bool> failed;
+};
+
 /* The MIT License (MIT) 
 
    Copyright (c) 2014 John DiMatteo (jdimatteo@gmail.com)
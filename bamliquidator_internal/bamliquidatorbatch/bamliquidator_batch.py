@@ -4,7 +4,6 @@ import normalize_plot_and_summarize as nps
 from flattener import write_tab_for_all 
 
 import argparse
-import csv
 import errno
 import os
 import subprocess
@@ -23,6 +22,14 @@ __version__ = '1.5.1'
 
 default_black_list = ["chrUn", "_random", "Zv9_", "_hap"]
 
+# bin counts are appended by bamliquidator_bins one shard (about 8 million base pairs) at a time, so the table
+# is sized for about a human genome of bins per file, and compressed since the mostly empty chromosome and
+# cell_type strings shrink several fold (compact region counts tables are compressed as well)
+genome_base_pairs = 3100000000
+# megabytes -- see the --cache_size argument
+default_cache_size = 10240
+counts_filters = tables.Filters(complevel=1, complib='zlib', shuffle=True)
+
 def create_files_table(h5file):
     class Files(tables.IsDescription):
         key       = tables.UInt32Col(    pos=0) # is there an easier way to assign keys?
@@ -45,6 +52,37 @@ def create_file_names_array(h5file):
 
     return array
 
+# Creates a table of names for the small integer keys stored in compact counts tables instead of the names
+# themselves, e.g. the chromosome_names table has the chromosome name for each chromosome_key in bin_counts.
+# This table must match exactly the NameH5Record structure in bamliquidator_util.cpp.
+def create_names_table(h5file, table_name, title):
+    class Name(tables.IsDescription):
+        key  = tables.UInt32Col(pos=0)
+        name = tables.StringCol(nps.chromosome_name_length, pos=1)
+
+    table = h5file.create_table("/", table_name, Name, title)
+    table.flush()
+
+    return table
+
+# adds any of the names that aren't in the names table yet, with the next unused keys
+def add_names(table, names):
+    existing = set(row["name"].decode('utf-8') for row in table)
+    for name in names:
+        if name not in existing:
+            table.row["key"] = table.nrows
+            table.row["name"] = name
+            table.row.append()
+            table.flush()
+            existing.add(name)
+
+# the parent directory of the bam file, e.g. mm1s, truncated like the 16 character cell_type column
+def cell_type_for_bam_file(bam_file_path):
+    cell_type = basename(dirname(bam_file_path))
+    if cell_type == '':
+        cell_type = '-'
+    return cell_type[:15]
+
 def all_bam_file_paths_in_directory(bam_directory):
     bam_file_paths = []
     for dirpath, _, files in os.walk(bam_directory, followlinks=True):
@@ -62,14 +100,35 @@ def bam_file_paths_with_no_file_entries(file_names, bam_file_paths):
 
     return with_no_counts
 
+def as_list(value):
+    return value if isinstance(value, (list, tuple)) else [value]
+
+# Every (sense, extension) combination to count, in the same order as bamliquidator_util.h function
+# extract_counting_modes.  The first combination is counted into the usual counts table, and each
+# other combination into the table named by mode_counts_table_name.
+def counting_modes(senses, extensions):
+    return [(sense, extension) for sense in senses for extension in extensions]
+
+# e.g. bin_counts_forward_200 for sense '+' and extension 200 -- must match bamliquidator_util.h
+# function counts_table_name
+def mode_counts_table_name(base, sense, extension):
+    names = {'+': 'forward', '-': 'reverse', '_': 'default'}
+    return "%s_%s_%d" % (base, names.get(sense, 'both'), extension)
+
+# e.g. bin_counts_10000 for bin size 10000 -- must match bamliquidator_util.h function level_counts_table_name
+def level_counts_table_name(base, bin_size):
+    return "%s_%d" % (base, bin_size)
+
 # ABC compatible with Python 2 *and* 3 -- see explanation at https://stackoverflow.com/a/38668373
 ABC = abc.ABCMeta('ABC', (object,), {'__slots__': ()})
 
 # BaseLiquidator is an abstract base class, with concrete classes BinLiquidator and RegionLiquidator
 # that implement the abstract methods.
 class BaseLiquidator(ABC):
+    # liquidates every bam file listed in the manifest (see write_manifest) in a single process, where
+    # extensions and senses are comma separated lists, e.g. "0,200" and "+,-"
     @abc.abstractmethod
-    def liquidate(self, bam_file_path, extension, sense = None):
+    def liquidate(self, manifest_file_path, extensions, senses):
         pass
 
     @abc.abstractmethod
@@ -77,11 +136,23 @@ class BaseLiquidator(ABC):
         pass
 
     @abc.abstractmethod
-    def create_counts_table(self, h5file):
+    def create_counts_table(self, h5file, table_name):
         pass
 
+    # the tables that the first counting mode is counted into, each of which has a table per other mode -- see batch
+    def level_counts_table_names(self):
+        return [self.counts_table_name]
+
+    # if compact, then a new counts file stores small integer chromosome and cell type keys in the counts tables
+    # instead of the names (see create_names_table), while an existing counts file keeps its own layout
+    # if coverage_index, then each bam file's coverage index is built first if missing or older than the bam file
+    # (see build_coverage_indexes)
+    # if cache_directory, then counts are cached there, and a bam file that was already liquidated with the same
+    # parameters (by this or any other process sharing the directory) is read from the cache instead, with the
+    # least recently used counts evicted once the cache exceeds cache_size megabytes
     def __init__(self, executable, counts_table_name, output_directory, bam_file_path,
-                 include_cpp_warnings_in_stderr = True, counts_file_path = None, number_of_threads = 0):
+                 include_cpp_warnings_in_stderr = True, counts_file_path = None, number_of_threads = 0,
+                 compact = False, coverage_index = False, cache_directory = None, cache_size = default_cache_size):
         # clear all memoized values from any prior runs
         nps.file_keys_memo = {}
 
@@ -92,6 +163,11 @@ class BaseLiquidator(ABC):
         self.include_cpp_warnings_in_stderr = include_cpp_warnings_in_stderr
         self.number_of_threads = number_of_threads
         self.chromosome_patterns_to_skip = [] 
+        self.counts_table_name = counts_table_name
+        self.extra_counts_table_names = []
+        self.coverage_index = coverage_index
+        self.cache_directory = cache_directory
+        self.cache_size = cache_size
 
         # This script may be run by either a developer install from a git pipeline checkout,
         # or from a user install so that the exectuable is on the path.  First we try to
@@ -113,17 +189,24 @@ class BaseLiquidator(ABC):
         
             counts_file = tables.open_file(self.counts_file_path, mode = "w",
                                            title = 'bam liquidator genome read counts - version %s' % __version__)
+            self.compact = compact
         else:
             counts_file = tables.open_file(self.counts_file_path, "r+")
+            self.compact = "chromosome_names" in counts_file.root
+            if compact and not self.compact:
+                logging.warning("Not using the compact layout since %s has the usual layout", self.counts_file_path)
 
         try: 
             counts = counts_file.get_node("/", counts_table_name)
             files = counts_file.root.files
             file_names = counts_file.root.file_names
         except:
-            counts = self.create_counts_table(counts_file)
+            counts = self.create_counts_table(counts_file, counts_table_name)
             files = create_files_table(counts_file)
             file_names = create_file_names_array(counts_file)
+            if self.compact:
+                create_names_table(counts_file, "chromosome_names", "Chromosome names for the chromosome_key columns")
+                create_names_table(counts_file, "cell_type_names", "Cell type names for the cell_type_key columns")
 
         if os.path.isdir(bam_file_path):
             self.bam_file_paths = all_bam_file_paths_in_directory(bam_file_path)
@@ -132,77 +215,71 @@ class BaseLiquidator(ABC):
        
         self.bam_file_paths = bam_file_paths_with_no_file_entries(file_names, self.bam_file_paths)
 
-        self.preprocess(files, file_names)
+        self.preprocess(file_names)
+
+        if self.compact:
+            # the executable adds the chromosome names, once it reads them from the bam file headers
+            add_names(counts_file.root.cell_type_names,
+                      [cell_type_for_bam_file(bam_file_path) for bam_file_path in self.bam_file_paths])
 
         counts_file.close() # bamliquidator_bins/bamliquidator_regions will open this file and modify
                             # it, so it is probably best that we not hold an out of sync reference
 
     
-    # adds files being liquidated to the files table and populates the following member dictionaries:
-    # 1) file_name -> [(chromosome, sequence length), ...] 
-    # 2) file_name -> total mapped count
-    # 3) file_name -> file key number
-    def preprocess(self, files, file_names):
-        self.file_to_chromosome_length_pairs = {}
-        self.file_to_count = {}
+    # adds files being liquidated to the file_names array and populates the file_name -> file key number
+    # dictionary -- the files table is populated by the bamliquidator_bins/bamliquidator_regions executable, which
+    # reads the chromosomes and mapped read counts from the bam file headers and indexes (see write_manifest)
+    def preprocess(self, file_names):
         self.file_to_key = {}
 
-        chr_col         = 0
-        length_col      = 1
-        mapped_read_col = 2
-
-        # bam file keys start at 1.
+        # bam file keys start at 1, and are the index of the file name in file_names.
         # key 0 is special and denotes "no specific file", which
         # is used in normalizated_counts tables to mean an average or total for all bam files
         # of a specific cell type.
-        next_file_key = 0 # see += 1 below
-        for file_record in files:
-            next_file_key = max(next_file_key, file_record["key"])
-        next_file_key += 1
+        next_file_key = len(file_names)
 
         for bam_file_path in self.bam_file_paths:
-            args = ["samtools", "idxstats", bam_file_path]
-            output = subprocess.check_output(args).decode('utf-8')
-            # skip last two lines: the unmapped chromosome line and the empty line
-            reader = csv.reader(output.split('\n')[:-2], delimiter='\t')
             file_name = basename(bam_file_path)
-            file_count = 0
-            
-            chromosome_length_pairs = []
-            for row in reader:
-                chromosome = row[chr_col]
-                if len(chromosome) >= nps.chromosome_name_length:
-                    raise RuntimeError('Chromosome name "%s" exceeds the max supported chromosome name length (%d). '
-                                       'This max chromosome length may be updated in the code if necessary -- please '
-                                       'contact the bamliquidator developers for additional assistance.'
-                                       % (chromosome, nps.chromosome_name_length))
-                                        
-                file_count += int(row[mapped_read_col])
-                chromosome_length_pairs.append((chromosome, int(row[length_col])))
-            
-            files.row["key"] = next_file_key
-            files.row["length"] = file_count
-            files.row.append()
             file_names.append(file_name)
-
-            self.file_to_chromosome_length_pairs[file_name] = chromosome_length_pairs
-            self.file_to_count[file_name] = file_count
             self.file_to_key[file_name] = next_file_key
-
             next_file_key += 1
 
-        files.flush()
         file_names.flush()
-        assert(len(file_names) - 1 == len(files))
         assert(len(file_names) == next_file_key)
 
-    def batch(self, extension, sense):
-        for i, bam_file_path in enumerate(self.bam_file_paths):
-            logging.info("Liquidating %s (file %d of %d)", bam_file_path, i+1, len(self.bam_file_paths))
+    # the total mapped reads of the liquidated bam files, from the files table
+    def mapped_read_count(self):
+        keys = set(self.file_to_key.values())
+        with tables.open_file(self.counts_file_path, "r") as counts_file:
+            return sum(int(row["length"]) for row in counts_file.root.files if row["key"] in keys)
 
-            return_code = self.liquidate(bam_file_path, extension, sense)
+    # extension and sense may each be a single value or a list of values to count with in one pass
+    # (see counting_modes), where a sense of None means the executable's default_sense
+    def batch(self, extension, sense):
+        extensions = as_list(extension)
+        senses = [self.default_sense if s is None else s for s in as_list(sense)]
+
+        modes = counting_modes(senses, extensions)
+        self.extra_counts_table_names = [table_name if i == 0 else mode_counts_table_name(table_name, s, e)
+                                         for table_name in self.level_counts_table_names()
+                                         for i, (s, e) in enumerate(modes)][1:]
+        with tables.open_file(self.counts_file_path, "r+") as counts_file:
+            for table_name in self.extra_counts_table_names:
+                if table_name not in counts_file.root:
+                    self.create_counts_table(counts_file, table_name)
+
+        if len(self.bam_file_paths) > 0:
+            # all files are liquidated by a single process, so that its threads move on to the next
+            # file instead of idling while the last chromosome of a file finishes
+            if self.coverage_index:
+                self.build_coverage_indexes()
+            manifest_file_path = self.write_manifest()
+            logging.info("Liquidating %d bam file(s) listed in %s", len(self.bam_file_paths), manifest_file_path)
+            return_code = self.liquidate(manifest_file_path, ",".join(str(e) for e in extensions), ",".join(senses))
             if return_code != 0:
                 raise Exception("%s failed with exit code %d" % (self.executable_path, return_code))
+            with tables.open_file(self.counts_file_path, "r") as counts_file:
+                assert(len(counts_file.root.file_names) - 1 == len(counts_file.root.files))
 
         start = time()
         self.normalize()
@@ -210,6 +287,25 @@ class BaseLiquidator(ABC):
         logging.info("Post liquidation processing took %f seconds", duration)
         self.log_time('post_liquidation', duration)
 
+    # The bamliquidator executable writes a coverage index next to each bam file, e.g. mm1s.bam.coverage, which
+    # bamliquidator_bins and bamliquidator_regions then count from instead of reading the bam file, as long as the bam
+    # file isn't modified.  Building the index costs about one liquidation, and makes every later liquidation of the
+    # bam file (with any regions, bin size, extension or sense) much faster.
+    def build_coverage_indexes(self):
+        executable_path = os.path.join(dirname(self.executable_path), "bamliquidator")
+        start = time()
+        for bam_file_path in self.bam_file_paths:
+            coverage_index_path = bam_file_path + ".coverage"
+            if (os.path.isfile(coverage_index_path)
+                    and os.path.getmtime(coverage_index_path) >= os.path.getmtime(bam_file_path)):
+                continue
+            logging.info("Building coverage index %s", coverage_index_path)
+            return_code = subprocess.call([executable_path, "--coverage-index", bam_file_path])
+            if return_code != 0:
+                logging.warning("Failed to build coverage index for %s, so it will be liquidated without one",
+                                bam_file_path)
+        self.log_time('coverage_index', time() - start)
+
     def flatten(self):
         logging.info("Flattening HDF5 tables into text files")
         start = time()
@@ -221,19 +317,28 @@ class BaseLiquidator(ABC):
         logging.info("Flattening took %f seconds" % duration)
         self.log_time('flattening', duration)
 
-    def chromosome_args(self, bam_file_name, skip_non_canonical):
-        args = []
-        for chromosome, length in self.file_to_chromosome_length_pairs[bam_file_name]:
-            if skip_non_canonical:
-                if any(pattern in chromosome for pattern in self.chromosome_patterns_to_skip):
-                    continue
-            args.append(chromosome)
-            args.append(str(length))
-        return args
+    # writes the manifest of bam files for the executable's --manifest argument, with one tab separated line
+    # per bam file: bam_file_path bam_file_key cell_type chromosome_patterns_to_skip, where the executable counts
+    # on each chromosome in the bam file header that doesn't contain any of the comma separated patterns
+    def write_manifest(self):
+        patterns_to_skip = ",".join(self.chromosome_patterns_to_skip) if self.skip_non_canonical else ""
+        manifest_file_path = os.path.join(self.output_directory, "manifest.txt")
+        with open(manifest_file_path, "w") as manifest:
+            for bam_file_path in self.bam_file_paths:
+                bam_file_name = basename(bam_file_path)
+                columns = [bam_file_path, str(self.file_to_key[bam_file_name]), cell_type_for_bam_file(bam_file_path),
+                           patterns_to_skip]
+                manifest.write("\t".join(columns) + "\n")
+        return manifest_file_path
         
     def logging_cpp_args(self):
         return [os.path.join(self.output_directory, "log.txt"), "1" if self.include_cpp_warnings_in_stderr else "0"]
 
+    def cache_cpp_args(self):
+        if self.cache_directory is None:
+            return []
+        return [os.path.abspath(self.cache_directory), str(self.cache_size)]
+
     def log_time(self, title, seconds):
         self.timings[title] = seconds
 
@@ -245,33 +350,47 @@ class BaseLiquidator(ABC):
             xml.write('</testsuite>\n')
 
 class BinLiquidator(BaseLiquidator):
+    default_sense = '.'
+    skip_non_canonical = True
+
+    # bin_size may be a list of bin sizes to count in one pass, where each bin size must divide the largest one:
+    # the first bin size is counted into bin_counts (and normalized and plotted), and each other bin size into
+    # the table named by level_counts_table_name
     def __init__(self, bin_size, output_directory, bam_file_path,
                  counts_file_path = None, extension = 0, sense = '.', skip_plot = False,
-                 include_cpp_warnings_in_stderr = True, number_of_threads = 0, blacklist = default_black_list):
-        self.bin_size = bin_size
+                 include_cpp_warnings_in_stderr = True, number_of_threads = 0, blacklist = default_black_list,
+                 compact = False, sparse = False, coverage_index = False, cache_directory = None,
+                 cache_size = default_cache_size):
+        self.bin_sizes = as_list(bin_size)
+        self.bin_size = self.bin_sizes[0]
+        largest_bin_size = max(self.bin_sizes)
+        for size in self.bin_sizes:
+            if size > 0 and largest_bin_size % size != 0:
+                raise Exception("bin size %d does not divide the largest bin size %d" % (size, largest_bin_size))
         self.skip_plot = skip_plot
+        # like compact, sparse only applies to a new counts file, and an existing counts file keeps its own layout
+        self.sparse = sparse
+        if counts_file_path is not None:
+            with tables.open_file(counts_file_path, "r") as counts_file:
+                self.sparse = "bin_counts" in counts_file.root and nps.is_sparse(counts_file.root.bin_counts)
         super(BinLiquidator, self).__init__("bamliquidator_bins", "bin_counts", output_directory, bam_file_path,
-                                            include_cpp_warnings_in_stderr, counts_file_path, number_of_threads)
+                                            include_cpp_warnings_in_stderr, counts_file_path, number_of_threads,
+                                            compact, coverage_index, cache_directory, cache_size)
         self.chromosome_patterns_to_skip = blacklist
         self.batch(extension, sense)
 
-    def liquidate(self, bam_file_path, extension, sense = None):
-        if sense is None: sense = '.'
-
-        cell_type = basename(dirname(bam_file_path))
-        if cell_type == '':
-            cell_type = '-'
-        bam_file_name = basename(bam_file_path)
-        args = [self.executable_path, str(self.number_of_threads), cell_type, str(self.bin_size), str(extension), sense, bam_file_path, 
-                str(self.file_to_key[bam_file_name]), self.counts_file_path]
+    def liquidate(self, manifest_file_path, extensions, senses):
+        args = [self.executable_path, "--manifest", str(self.number_of_threads),
+                ",".join(str(size) for size in self.bin_sizes), extensions, senses,
+                manifest_file_path, self.counts_file_path]
         args.extend(self.logging_cpp_args())
-        args.extend(self.chromosome_args(bam_file_name, skip_non_canonical=True))
+        args.extend(self.cache_cpp_args())
 
         start = time()
         return_code = subprocess.call(args)
         duration = time() - start
 
-        reads = self.file_to_count[bam_file_name]
+        reads = self.mapped_read_count()
         rate = reads / (10**6) / duration
         logging.info("Liquidation completed: %f seconds, %d reads, %f millions of reads per second", duration, reads, rate)
         self.log_time('liquidation', duration)
@@ -282,7 +401,11 @@ class BinLiquidator(BaseLiquidator):
         with tables.open_file(self.counts_file_path, mode = "r+") as counts_file:
             nps.normalize_plot_and_summarize(counts_file, self.output_directory, self.bin_size, self.skip_plot) 
 
-    def create_counts_table(self, h5file):
+    def level_counts_table_names(self):
+        return [self.counts_table_name] + [level_counts_table_name(self.counts_table_name, size)
+                                           for size in self.bin_sizes[1:]]
+
+    def create_counts_table(self, h5file, table_name):
         class BinCount(tables.IsDescription):
             bin_number = tables.UInt32Col(    pos=0)
             cell_type  = tables.StringCol(16, pos=1)
@@ -290,15 +413,36 @@ class BinLiquidator(BaseLiquidator):
             count      = tables.UInt64Col(    pos=3)
             file_key   = tables.UInt32Col(    pos=4)
 
-        table = h5file.create_table("/", "bin_counts", BinCount, "bin counts")
+        # must match exactly the CompactCountH5Record structure in bamliquidator_bins.m.cpp
+        class CompactBinCount(tables.IsDescription):
+            bin_number     = tables.UInt32Col(pos=0)
+            cell_type_key  = tables.UInt16Col(pos=1)
+            chromosome_key = tables.UInt32Col(pos=2)
+            count          = tables.UInt64Col(pos=3)
+            file_key       = tables.UInt32Col(pos=4)
+
+        table = h5file.create_table("/", table_name, CompactBinCount if self.compact else BinCount, "bin counts",
+                                    filters=counts_filters, expectedrows=genome_base_pairs // self.bin_size)
+        if self.sparse:
+            # bamliquidator_bins checks this to only write the bins with nonzero counts (and the last bin of each
+            # chromosome) -- see normalize_plot_and_summarize.py function is_sparse
+            table.attrs.sparse = 1
         table.flush()
         return table
 
 class RegionLiquidator(BaseLiquidator):
+    default_sense = '_' # _ means use strand specified in region file (or . if none specified)
+    skip_non_canonical = False
+
     def __init__(self, regions_file, output_directory, bam_file_path,
                  region_format=None, counts_file_path = None, extension = 0, sense = '.',
-                 include_cpp_warnings_in_stderr = True, number_of_threads = 0):
+                 include_cpp_warnings_in_stderr = True, number_of_threads = 0, compact = False,
+                 coverage_index = False, cache_directory = None, cache_size = default_cache_size,
+                 region_batch_size = 0):
         self.regions_file = regions_file
+        # if region_batch_size > 0, then the regions file is liquidated and written that many lines at a time, so that
+        # memory use is bounded by the batch size instead of growing with the regions file
+        self.region_batch_size = region_batch_size
         self.region_format = region_format
         if self.region_format is None:
             _, self.region_format = os.path.splitext(regions_file)
@@ -309,20 +453,22 @@ class RegionLiquidator(BaseLiquidator):
                                % str(self.region_format))
 
         super(RegionLiquidator, self).__init__("bamliquidator_regions", "region_counts", output_directory, 
-                                               bam_file_path, include_cpp_warnings_in_stderr, counts_file_path, number_of_threads)
+                                               bam_file_path, include_cpp_warnings_in_stderr, counts_file_path, number_of_threads,
+                                               compact, coverage_index, cache_directory, cache_size)
         
         self.batch(extension, sense)
 
-    def liquidate(self, bam_file_path, extension, sense = None):
-        bam_file_name = basename(bam_file_path)
-        args = [self.executable_path, str(self.number_of_threads), self.regions_file, str(self.region_format), str(extension), bam_file_path, 
-                str(self.file_to_key[bam_file_name]), self.counts_file_path]
+    def liquidate(self, manifest_file_path, extensions, senses):
+        args = [self.executable_path, "--manifest", str(self.number_of_threads), self.regions_file, str(self.region_format),
+                extensions, manifest_file_path, self.counts_file_path]
         args.extend(self.logging_cpp_args())
-        if sense is None:
-            args.append('_') # _ means use strand specified in region file (or . if none specified)
+        args.append(senses)
+        if self.region_batch_size > 0:
+            # an empty cache directory disables the cache, which isn't used when streaming anyway
+            args.extend(self.cache_cpp_args() or ["", "0"])
+            args.append(str(self.region_batch_size))
         else:
-            args.append(sense)
-        args.extend(self.chromosome_args(bam_file_name, skip_non_canonical=False))
+            args.extend(self.cache_cpp_args())
 
         start = time()
         return_code = subprocess.call(args)
@@ -335,9 +481,11 @@ class RegionLiquidator(BaseLiquidator):
 
     def normalize(self):
         with tables.open_file(self.counts_file_path, mode = "r+") as counts_file:
-            nps.normalize_regions(counts_file.root.region_counts, counts_file.root.files)
+            nps.normalize_regions(nps.counts_table(counts_file, "region_counts"), counts_file.root.files)
+            for table_name in self.extra_counts_table_names:
+                nps.normalize_regions(nps.counts_table(counts_file, table_name), counts_file.root.files)
 
-    def create_counts_table(self, h5file):
+    def create_counts_table(self, h5file, table_name):
         class Region(tables.IsDescription):
             file_key         = tables.UInt32Col(    pos=0)
             chromosome       = tables.StringCol(nps.chromosome_name_length, pos=1)
@@ -348,7 +496,21 @@ class RegionLiquidator(BaseLiquidator):
             count            = tables.UInt64Col(    pos=6)
             normalized_count = tables.Float64Col(   pos=7)
 
-        table = h5file.create_table("/", "region_counts", Region, "region counts")
+        # must match exactly the CompactRegion structure in bamliquidator_regions.m.cpp
+        class CompactRegion(tables.IsDescription):
+            file_key         = tables.UInt32Col(    pos=0)
+            chromosome_key   = tables.UInt32Col(    pos=1)
+            region_name      = tables.StringCol(64, pos=2)
+            start            = tables.UInt64Col(    pos=3)
+            stop             = tables.UInt64Col(    pos=4)
+            strand           = tables.StringCol(1,  pos=5)
+            count            = tables.UInt64Col(    pos=6)
+            normalized_count = tables.Float64Col(   pos=7)
+
+        if self.compact:
+            table = h5file.create_table("/", table_name, CompactRegion, "region counts", filters=counts_filters)
+        else:
+            table = h5file.create_table("/", table_name, Region, "region counts")
         table.flush()
         return table
 
@@ -364,19 +526,20 @@ def write_bamToGff_matrix(output_file_path, h5_region_counts_file_path):
                 output.write("\tbin_1_%s" % counts_file.root.file_names[file_key].decode('utf-8'))
             output.write("\n")
 
+            region_counts = nps.counts_table(counts_file, "region_counts")
             number_of_files = len(file_keys)
-            number_of_regions = int(counts_file.root.region_counts.nrows / number_of_files)
+            number_of_regions = int(region_counts.nrows / number_of_files)
 
             # first loop through all but the last file index, storing those counts 
             prior_region_counts = numpy.zeros((number_of_regions,  number_of_files - 1))
             for col, file_key in enumerate(file_keys[:-1]):
-                for row, region in enumerate(counts_file.root.region_counts.where("file_key == %d" % file_key)):
+                for row, region in enumerate(region_counts.where("file_key == %d" % file_key)):
                     prior_region_counts[row, col] = region["normalized_count"]
 
             # then loop through the last index,
             # printing the region columns and the counts for the prior files,
             # along with the count for the last index
-            for row, region in enumerate(counts_file.root.region_counts.where("file_key == %d" % file_keys[-1])):
+            for row, region in enumerate(region_counts.where("file_key == %d" % file_keys[-1])):
                 output.write("%s\t%s(%s):%d-%d" % (
                     region["region_name"].decode('utf-8'),
                     region["chromosome"].decode('utf-8'),
@@ -437,9 +600,12 @@ def main():
                                                  'help, please see https://github.com/BradnerLab/pipeline/wiki')
 
     mut_exclusive_group = parser.add_mutually_exclusive_group()
-    mut_exclusive_group.add_argument('-b', '--bin_size', type=int, default=100000,
+    mut_exclusive_group.add_argument('-b', '--bin_size', type=int, nargs='+', default=[100000],
                         help="Number of base pairs in each bin -- the smaller the bin size the longer the runtime and "
-                             "the larger the data files (default is 100000)")
+                             "the larger the data files (default is 100000).  If more than one bin size is given, then "
+                             "every bin size is counted in a single pass, and the counts for each bin size other than the "
+                             "first are stored in a separate table, e.g. bin_counts_10000 (only the first bin size is "
+                             "normalized and plotted).  Each bin size must divide the largest one.")
     mut_exclusive_group.add_argument('-r', '--regions_file',
                         help='a region file in either .gff or .bed format')
 
@@ -455,11 +621,15 @@ def main():
                               'see http://www.pytables.org/ for easy to use Python APIs and '
                               'http://www.hdfgroup.org/products/java/hdf-java-html/hdfview/ for an easy to use GUI for '
                               'browsing HDF5 files)')
-    parser.add_argument('-e', '--extension', type=int, default=0,
-                        help='Extends reads by n bp (default is 0)')
-    parser.add_argument('--sense', default=None, choices=['+', '-', '.'],
+    parser.add_argument('-e', '--extension', type=int, nargs='+', default=[0],
+                        help='Extends reads by n bp (default is 0).  If more than one extension is given, then reads are '
+                             'counted with each extension in a single pass, and the counts for each extension other than '
+                             'the first are stored in a separate table, e.g. bin_counts_both_200 (for bins, only the first '
+                             'extension and sense are normalized and plotted).')
+    parser.add_argument('--sense', default=[None], nargs='+', choices=['+', '-', '.'],
                         help="Map to '+' (forward), '-' (reverse) or '.' (both) strands. For gff regions, default is to use "
-                             "the sense specified by the gff file; otherwise, default maps to both.")
+                             "the sense specified by the gff file; otherwise, default maps to both.  If more than one sense "
+                             "is given, then reads are counted on each in a single pass, like with multiple extensions.")
     parser.add_argument('-m', '--match_bamToGFF', default=False, action='store_true',
                         help="match bamToGFF_turbo.py matrix output format, storing the result as matrix.txt in the output folder")
     parser.add_argument('--region_format', default=None, choices=['gff', 'bed'],
@@ -476,6 +646,48 @@ def main():
     parser.add_argument('-n', '--number_of_threads', type=int, default=0,
                         help='Number of threads to run concurrently during liquidation.  Defaults to the total number of logical '
                              'cpus on the system.')
+    parser.add_argument('--compact', action='store_true',
+                        help='Store the counts tables of a new counts.h5 file in a compact, compressed layout, with small integer '
+                             'chromosome_key and cell_type_key columns in place of the chromosome and cell_type names (which are '
+                             'stored once in the chromosome_names and cell_type_names tables).  This makes counts.h5 several '
+                             'times smaller and faster to query.  Appending to a counts file always keeps its existing layout.')
+    parser.add_argument('--sparse', action='store_true',
+                        help='Only store the bins with nonzero counts in a new counts.h5 file (along with the last bin of each '
+                             'chromosome), so that small bin sizes take space and post processing time in proportion to the '
+                             'signal rather than the genome size.  Missing bins have a count of zero, and are filled in when '
+                             'flattening.  Appending to a counts file always keeps its existing layout.')
+    parser.add_argument('--coverage_index', action='store_true',
+                        help='Build a coverage index next to each bam file that doesn\'t have an up to date one (e.g. '
+                             'mm1s.bam.coverage), and count from the index instead of the bam file.  Building takes about as '
+                             'long as a liquidation, but then every later liquidation of the bam file with any regions, bin '
+                             'size, extension or sense is answered from the index, which is much faster.')
+    parser.add_argument('--cache_directory', default=None,
+                        help='Cache the counts of each liquidated bam file in this directory, which may be shared by any '
+                             'number of concurrent runs, and read the counts of a bam file from the cache instead of '
+                             'liquidating it if it was already liquidated with the same regions file (or bin sizes), '
+                             'extensions, senses and chromosomes.  A bam file that changes is liquidated again.')
+    parser.add_argument('--cache_size', type=int, default=default_cache_size,
+                        help='Once the cache directory holds more than this many megabytes, the least recently used '
+                             'counts are evicted.')
+    parser.add_argument('--region_batch_size', type=int, default=0,
+                        help='Liquidate the regions file this many lines at a time, appending the counts of each batch to '
+                             'counts.h5 before reading the next, so that memory use is bounded by the batch size instead of '
+                             'growing with the regions file (e.g. 1000000 for genome wide region sets with tens of millions '
+                             'of lines).  The bam files are then liquidated one after another, and --cache_directory is '
+                             'ignored.  Defaults to 0, which liquidates all the regions at once.')
+    parser.add_argument('--read_ahead', type=int, default=None,
+                        help='How many megabytes past its current read each large fetch asks the kernel to read the '
+                             'bam file in the background, e.g. more for bam files on slow network storage, or 0 to leave '
+                             'read ahead to the kernel.  Defaults to 32.')
+    parser.add_argument('--read_size', type=int, default=None,
+                        help='The size in kilobytes of each read of a bam file by a large fetch.  Defaults to 1024.')
+    parser.add_argument('--read_ahead_blocks', type=int, default=None,
+                        help='How many compressed blocks each large fetch reads and decompresses ahead of the reads it '
+                             'is counting.  Defaults to 64.')
+    parser.add_argument('--mmap', action='store_true',
+                        help='Map each bam file into memory once, shared by every liquidation thread, and decompress its '
+                             'blocks straight from the mapping.  This is usually faster for bam files on local disks or '
+                             'already in the page cache, and slower for bam files on network storage.')
     parser.add_argument('--xml_timings', action='store_true',
                         help='Write performance timings to junit style timings.xml in output folder, which is useful for '
                              'tracking performance over time with automatically generated Jenkins graphs')
@@ -501,10 +713,20 @@ def main():
 
     configure_logging(args)
 
+    # the liquidation executables read these from the environment -- see ReadAhead in bamliquidator.cpp
+    for name, value in (("BAMLIQUIDATOR_READ_AHEAD", args.read_ahead),
+                        ("BAMLIQUIDATOR_READ_SIZE", args.read_size),
+                        ("BAMLIQUIDATOR_READ_AHEAD_BLOCKS", args.read_ahead_blocks)):
+        if value is not None:
+            os.environ[name] = str(value)
+    if args.mmap:
+        os.environ["BAMLIQUIDATOR_MMAP"] = "1"
+
     if args.regions_file is None:
         liquidator = BinLiquidator(args.bin_size, args.output_directory, args.bam_file_path,
                                    args.counts_file, args.extension, args.sense, args.skip_plot,
-                                   not args.quiet, args.number_of_threads, args.black_list)
+                                   not args.quiet, args.number_of_threads, args.black_list, args.compact, args.sparse,
+                                   args.coverage_index, args.cache_directory, args.cache_size)
     else:
         if args.counts_file:
             raise Exception("Appending to a prior regions counts.h5 file is not supported at this time -- "
@@ -513,7 +735,8 @@ def main():
         ## review matrix output, specifically the assumption that each file has the exact same regions in the same order
         liquidator = RegionLiquidator(args.regions_file, args.output_directory, args.bam_file_path, 
                                       args.region_format, args.counts_file, args.extension, args.sense,
-                                      not args.quiet, args.number_of_threads)
+                                      not args.quiet, args.number_of_threads, args.compact, args.coverage_index,
+                                      args.cache_directory, args.cache_size, args.region_batch_size)
 
     if args.flatten:
         liquidator.flatten()
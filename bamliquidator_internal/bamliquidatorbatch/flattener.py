@@ -1,17 +1,36 @@
 #!/usr/bin/env python
 
+import normalize_plot_and_summarize as nps
+
 import argparse
 import csv
 import os
 import tables
 
+# The rows of a sparse table (see normalize_plot_and_summarize.py function is_sparse), with the missing bins filled
+# in as rows with a count of zero (and for normalized_counts, the percentile of the missing bins).
+def dense_rows(table):
+    zero_percentiles = getattr(table.attrs, "zero_percentiles", {})
+    previous = None
+    for stored_row in table:
+        row = dict((col, stored_row[col]) for col in table.colnames)
+        group = (row["file_key"], row["cell_type"], row["chromosome"])
+        first_missing_bin = previous[1] + 1 if previous is not None and previous[0] == group else 0
+        for bin_number in range(first_missing_bin, row["bin_number"]):
+            missing_row = dict(row, bin_number=bin_number, count=0)
+            if "percentile" in missing_row:
+                missing_row["percentile"] = zero_percentiles[(row["cell_type"].decode(), row["file_key"])]
+            yield missing_row
+        yield row
+        previous = (group, row["bin_number"])
+
 def write_tab(table, file_names, output_directory, log=False):
     chromosome_to_file_writer_pair = {}
 
     columns = [col for col in table.colnames if col != "chromosome"]
     columns = [col if col != "file_key" else "file_name" for col in columns]
 
-    for row in table:
+    for row in (dense_rows(table) if nps.is_sparse(table) else table):
         chromosome = row["chromosome"].decode()
         if chromosome not in chromosome_to_file_writer_pair:
             tab_file_path = os.path.join(output_directory, table.name + "_" + chromosome + ".tab")
@@ -38,10 +57,11 @@ def write_tab(table, file_names, output_directory, log=False):
     for tab_file, _ in list(chromosome_to_file_writer_pair.values()):
         tab_file.close()
 
+# the chromosome and cell_type names of compact counts tables are written instead of their keys
 def write_tab_for_all(h5_file, output_directory, log=False):
     for table in h5_file.root:
-        if table.name not in ("files", "file_names"):
-            write_tab(table, h5_file.root.file_names, output_directory, log)
+        if table.name not in ("files", "file_names") and table.name not in nps.names_tables.values():
+            write_tab(nps.counts_table(h5_file, table.name), h5_file.root.file_names, output_directory, log)
 
 def main():
     parser = argparse.ArgumentParser(description='Writes bamliquidator_batch.py hdf5 tables into tab delimited '
@@ -63,7 +83,7 @@ def main():
     log = True
 
     if args.table:
-        table = h5_file.get_node("/" + args.table)
+        table = nps.counts_table(h5_file, args.table)
         write_tab(table, h5_file.root.file_names, args.output_directory, log)
     else:
         write_tab_for_all(h5_file, args.output_directory, log)
@@ -28,8 +28,10 @@ from __future__ import division
 
 import sys
 import os
+import re
 import argparse
 import tables
+import numpy
 import scipy.stats as stats
 import collections
 import logging
@@ -66,9 +68,93 @@ except:
 chromosome_name_length = 64 # Includes 1 for null terminator, so really max of 63 characters.
                             # Note that changing this value requires updating C++ code as well.
 
+# the tables of names for the small integer keys in compact counts tables, by the column they replace
+# -- see bamliquidator_batch.py function create_names_table
+names_tables = collections.OrderedDict([("chromosome", "chromosome_names"), ("cell_type", "cell_type_names")])
+
+# A row of a KeyedTable, which looks up the names for its chromosome_key and cell_type_key columns so that it
+# can be used like a row with chromosome and cell_type columns.
+class KeyedRow(object):
+    def __init__(self, row, names):
+        self.row = row
+        self.names = names
+
+    def __getitem__(self, column):
+        if column in self.names:
+            return self.names[column][self.row[column + "_key"]]
+        return self.row[column]
+
+    def __setitem__(self, column, value):
+        self.row[column] = value
+
+    def update(self):
+        self.row.update()
+
+# A compact counts table, which stores small integer chromosome_key and/or cell_type_key columns instead of
+# the chromosome and cell_type strings, wrapped so that it reads just like the usual counts table: rows and
+# where conditions use chromosome and cell_type names, e.g. where("chromosome == 'chr1'").
+class KeyedTable(object):
+    def __init__(self, table, names):
+        self.table = table
+        self.names = names
+        self.keys = dict((column, dict((name, key) for key, name in names[column].items())) for column in names)
+        self.name = table.name
+        self.colnames = [col[:-len("_key")] if col[:-len("_key")] in names else col for col in table.colnames]
+
+    @property
+    def nrows(self):
+        return self.table.nrows
+
+    def __iter__(self):
+        for row in self.table:
+            yield KeyedRow(row, self.names)
+
+    def where(self, condition):
+        for row in self.table.where(self.keyed_condition(condition)):
+            yield KeyedRow(row, self.names)
+
+    def keyed_condition(self, condition):
+        def replace(match):
+            column, name = match.group(1), match.group(2)
+            return "(%s_key == %d)" % (column, self.keys[column].get(name.encode(), -1))
+        return re.sub(r"\b(%s) == '([^']*)'" % "|".join(self.names), replace, condition)
+
+    # the distinct values of the chromosome or cell_type column, in the order they first appear
+    def distinct(self, column):
+        keys = self.table.col(column + "_key")
+        _, first = numpy.unique(keys, return_index=True)
+        return [self.names[column][keys[i]] for i in sorted(first)]
+
+    @property
+    def attrs(self):
+        return self.table.attrs
+
+    def flush(self):
+        self.table.flush()
+
+# Returns the counts table with the given name, e.g. "bin_counts" or "region_counts_both_200", which is wrapped
+# in a KeyedTable if the counts file has the compact layout.
+def counts_table(h5file, table_name):
+    table = h5file.get_node("/", table_name)
+    names = {}
+    for column, names_table in names_tables.items():
+        if column + "_key" in table.colnames:
+            names[column] = dict((row["key"], row["name"]) for row in h5file.get_node("/", names_table))
+    return KeyedTable(table, names) if names else table
+
+# True if the bin counts table was created with bamliquidator_batch.py --sparse (or is the normalized_counts
+# table of such a table), in which case it only has the rows for the bins with nonzero counts, along with the
+# last bin of each chromosome so that the number of bins is known, and every missing bin has a count of zero.
+def is_sparse(table):
+    return getattr(table.attrs, "sparse", 0) == 1
+
+# keeps the bin_counts table along with any bin counts tables for additional senses/extensions, e.g.
+# bin_counts_forward_200 (see bamliquidator_batch.py function mode_counts_table_name), and the names
+# tables of a compact counts file
 def delete_all_but_bin_counts_and_files_table(h5file):
     for table in h5file.root:
-        if table.name != "bin_counts" and table.name != "files" and table.name != "file_names":
+        if (not table.name.startswith("bin_counts") and table.name not in ("files", "file_names")
+                and table.name not in names_tables.values()):
             for index in list(table.colindexes.values()):
                 index.column.remove_index()
             table.remove()
@@ -89,6 +175,9 @@ def create_normalized_counts_table(h5file):
     return table
 
 def all_cell_types(counts):
+    if isinstance(counts, KeyedTable):
+        return set(name.decode() for name in counts.distinct("cell_type"))
+
     types = set()
 
     for row in counts:
@@ -97,6 +186,9 @@ def all_cell_types(counts):
     return types 
 
 def all_chromosomes(counts):
+    if isinstance(counts, KeyedTable):
+        return [name.decode() for name in counts.distinct("chromosome")]
+
     # use an ordered dict to preserve the chromosome order in the returned list
     chromosomes = collections.OrderedDict() 
 
@@ -232,18 +324,42 @@ def normalize_regions(region_counts, files):
 
     region_counts.flush()
 
-# leave off file_key argument to calculate percentiles for the cell_type averaged normalized counts
-def populate_percentiles(normalized_counts, cell_type, file_key = 0):
+# Returns the percentiles of the counts of a sparse table with the given total number of bins, along with the
+# percentile of the missing bins, which have a count of zero.  The percentiles are the same as ranking every
+# bin, including the missing ones, but only take time in proportion to the number of rows.
+def sparse_percentiles(counts, bins):
+    counts = numpy.asarray(counts, dtype=float)
+    nonzero = counts > 0
+    zeros = bins - numpy.count_nonzero(nonzero)
+
+    # like stats.rankdata, the tied zeros share their average rank
+    zero_rank = (zeros + 1) / 2
+    ranks = numpy.full(len(counts), zero_rank)
+    ranks[nonzero] = zeros + stats.rankdata(counts[nonzero])
+
+    scale = 100 / max(bins - 1, 1)
+    return (ranks - 1) * scale, (zero_rank - 1) * scale
+
+# leave off file_key argument to calculate percentiles for the cell_type averaged normalized counts.
+# zero_percentiles is only given for a sparse normalized_counts table, and the percentile of the missing bins is
+# stored in it with the key (cell_type, file_key).
+def populate_percentiles(normalized_counts, cell_type, file_key = 0, zero_percentiles = None):
     bin_numbers = []
     normalized_count_list = []
+    chromosome_bins = collections.defaultdict(int)
 
     condition = "(cell_type == '%s') & (file_key == %d)" % (cell_type, file_key)
 
     for row in normalized_counts.where(condition):
         bin_numbers.append(row["bin_number"])
         normalized_count_list.append(row["count"])
+        chromosome_bins[row["chromosome"]] = max(chromosome_bins[row["chromosome"]], row["bin_number"] + 1)
 
-    percentiles = (stats.rankdata(normalized_count_list) - 1) / (len(normalized_count_list)-1) * 100
+    if zero_percentiles is None:
+        percentiles = (stats.rankdata(normalized_count_list) - 1) / (len(normalized_count_list)-1) * 100
+    else:
+        percentiles, zero_percentiles[(cell_type, file_key)] = sparse_percentiles(normalized_count_list,
+                                                                                  sum(chromosome_bins.values()))
     # percentiles calculated in bulk as suggested at 
     # http://grokbase.com/t/python/python-list/092235vj27/faster-scipy-percentileofscore
 
@@ -285,6 +401,34 @@ def populate_normalized_counts_for_cell_type(normalized_counts, cell_type, file_
 
     normalized_counts.flush()
 
+# like populate_normalized_counts_for_cell_type, except for a sparse normalized_counts table
+def populate_sparse_normalized_counts_for_cell_type(normalized_counts, cell_type, file_keys):
+    chromosome_to_summed_counts = collections.OrderedDict()
+
+    for file_key in file_keys:
+        condition = "(file_key == %d) & (cell_type == '%s')" % (file_key, cell_type)
+        for row in normalized_counts.where(condition):
+            if row["chromosome"] not in chromosome_to_summed_counts:
+                chromosome_to_summed_counts[row["chromosome"]] = collections.defaultdict(float)
+            chromosome_to_summed_counts[row["chromosome"]][row["bin_number"]] += row["count"]
+
+    len_file_keys = len(file_keys)
+
+    for chromosome, summed_counts in chromosome_to_summed_counts.items():
+        last_bin = max(summed_counts.keys())
+        for bin_number in sorted(summed_counts.keys()):
+            if summed_counts[bin_number] == 0 and bin_number != last_bin:
+                continue
+            normalized_counts.row["bin_number"] = bin_number
+            normalized_counts.row["cell_type"] = cell_type
+            normalized_counts.row["chromosome"] = chromosome
+            normalized_counts.row["file_key"] = 0
+            normalized_counts.row["count"] = summed_counts[bin_number] / len_file_keys
+            normalized_counts.row["percentile"] = -1
+            normalized_counts.row.append()
+
+    normalized_counts.flush()
+
 def create_summary_table(h5file):
     class Summary(tables.IsDescription):
         bin_number = tables.UInt32Col(                    pos=0)
@@ -371,12 +515,67 @@ def populate_summary(summary, normalized_counts, chromosome_str):
         summary.row.append()
     summary.flush()
 
+# Like populate_summary, except for a sparse normalized_counts table, where zero_percentiles has the percentile of
+# the missing bins for each (cell_type, file_key).  Every cell type and line starts out counted at the percentile
+# of its missing bins, and each stored row then replaces that with its own percentile.  The bins without any stored
+# rows are summarized from the missing bins' percentiles alone, so that the summary has a row for every bin, the
+# same as populate_summary.
+def populate_sparse_summary(summary, normalized_counts, chromosome_str, zero_percentiles):
+    high = 95 # 95th percentile
+    low  = 5  # 5th percentile
+
+    # the summary columns from avg_cell_type_percentile (summed rather than averaged) through
+    # lines_lt_5th_percentile that a row with the given file_key and percentile adds to
+    def summed_columns(file_key, percentile):
+        is_cell_type = file_key == 0
+        return numpy.array([percentile if is_cell_type else 0,
+                            is_cell_type and percentile >= high,
+                            is_cell_type and percentile < high,
+                            not is_cell_type and percentile >= high,
+                            not is_cell_type and percentile < high,
+                            is_cell_type and percentile >= low,
+                            is_cell_type and percentile < low,
+                            not is_cell_type and percentile >= low,
+                            not is_cell_type and percentile < low], dtype=float)
+
+    baseline = sum(summed_columns(file_key, percentile) for (_, file_key), percentile in zero_percentiles.items())
+    num_cell_types = sum(1 for _, file_key in zero_percentiles if file_key == 0)
+
+    summed_by_bin = {}
+    for row in normalized_counts.where("chromosome == chromosome_str"):
+        bin_number = row["bin_number"]
+        if bin_number not in summed_by_bin:
+            summed_by_bin[bin_number] = baseline.copy()
+        file_key = row["file_key"]
+        zero_percentile = zero_percentiles[(row["cell_type"].decode(), file_key)]
+        summed_by_bin[bin_number] += summed_columns(file_key, row["percentile"]) - summed_columns(file_key, zero_percentile)
+
+    logging.debug(" - populating summary table with calculated summaries")
+
+    # the last bin of each chromosome is always stored (see is_sparse)
+    max_bin = max(summed_by_bin.keys()) if summed_by_bin else -1
+    for bin_number in range(max_bin + 1):
+        summed = summed_by_bin.get(bin_number, baseline)
+        summary.row["bin_number"] = bin_number
+        summary.row["chromosome"] = chromosome_str
+        summary.row["avg_cell_type_percentile"] = summed[0] / num_cell_types
+        summary.row["cell_types_gte_95th_percentile"] = round(summed[1])
+        summary.row["cell_types_lt_95th_percentile"] = round(summed[2])
+        summary.row["lines_gte_95th_percentile"] = round(summed[3])
+        summary.row["lines_lt_95th_percentile"] = round(summed[4])
+        summary.row["cell_types_gte_5th_percentile"] = round(summed[5])
+        summary.row["cell_types_lt_5th_percentile"] = round(summed[6])
+        summary.row["lines_gte_5th_percentile"] = round(summed[7])
+        summary.row["lines_lt_5th_percentile"] = round(summed[8])
+        summary.row.append()
+    summary.flush()
+
 def normalize_plot_and_summarize(counts_file, output_directory, bin_size, skip_plot):
     delete_all_but_bin_counts_and_files_table(counts_file)
 
     # recreating the entirity of the remaining tables is quick and easier than updating prior records correctly
 
-    counts = counts_file.root.bin_counts
+    counts = counts_table(counts_file, "bin_counts")
     files = counts_file.root.files
     normalized_counts = create_normalized_counts_table(counts_file)
     summary = create_summary_table(counts_file)
@@ -384,6 +583,10 @@ def normalize_plot_and_summarize(counts_file, output_directory, bin_size, skip_p
     cell_types = all_cell_types(counts)
     chromosomes = all_chromosomes(counts)
 
+    # the normalized counts of a sparse counts table are sparse as well
+    sparse = is_sparse(counts)
+    zero_percentiles = {} if sparse else None
+
     logging.info("Cell Types: %s", ", ".join(cell_types))
 
     for cell_type in cell_types:
@@ -391,9 +594,16 @@ def normalize_plot_and_summarize(counts_file, output_directory, bin_size, skip_p
         current_file_keys = file_keys(counts, cell_type)
         for file_key in current_file_keys:
            populate_normalized_counts(normalized_counts, counts, file_key, bin_size, files)
-           populate_percentiles(normalized_counts, cell_type, file_key)
-        populate_normalized_counts_for_cell_type(normalized_counts, cell_type, current_file_keys) 
-        populate_percentiles(normalized_counts, cell_type)
+           populate_percentiles(normalized_counts, cell_type, file_key, zero_percentiles)
+        if sparse:
+            populate_sparse_normalized_counts_for_cell_type(normalized_counts, cell_type, current_file_keys)
+        else:
+            populate_normalized_counts_for_cell_type(normalized_counts, cell_type, current_file_keys) 
+        populate_percentiles(normalized_counts, cell_type, zero_percentiles=zero_percentiles)
+
+    if sparse:
+        normalized_counts.attrs.sparse = 1
+        normalized_counts.attrs.zero_percentiles = zero_percentiles
 
     logging.info("Indexing normalized counts")
     normalized_counts.cols.bin_number.create_csindex()
@@ -414,7 +624,10 @@ def normalize_plot_and_summarize(counts_file, output_directory, bin_size, skip_p
 
     logging.info("Summarizing")
     for chromosome in chromosomes:
-        populate_summary(summary, normalized_counts, chromosome)
+        if sparse:
+            populate_sparse_summary(summary, normalized_counts, chromosome, zero_percentiles)
+        else:
+            populate_summary(summary, normalized_counts, chromosome)
     summary.cols.avg_cell_type_percentile.create_csindex()
 
     # Iterating over this index in reverse order is hundreds of times slower than iterating
@@ -472,7 +685,7 @@ def validate(counts_file_path):
 
     error_count = 0
 
-    counts = counts_file.root.bin_counts
+    counts = counts_table(counts_file, "bin_counts")
     cell_types = all_cell_types(counts)
     num_cell_types = len(cell_types)
     num_files = 0
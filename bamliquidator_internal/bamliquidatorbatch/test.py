@@ -4,15 +4,35 @@ from __future__ import division
 
 import bamliquidator_batch as blb
 
+import ctypes
 import os
+import numpy
+import random
 import shutil
 import subprocess
+import sys
 import tables
 import tempfile
+import threading
 import unittest
 
-# one full read for each chromosome
-def create_bam(dir_path, chromosomes, sequence, file_name='single.bam'):
+# the in-process module is only built by "make bamliquidator_native", so its tests are skipped without it
+sys.path.append(os.path.dirname(os.path.dirname(os.path.realpath(__file__))))
+try:
+    import bamliquidator_native
+except ImportError:
+    bamliquidator_native = None
+
+# utils.py, which has the LiquidatorServer client, is Python 2 only, so its tests are skipped on Python 3
+sys.path.append(os.path.dirname(os.path.dirname(os.path.dirname(os.path.realpath(__file__)))))
+try:
+    import utils
+except (ImportError, SyntaxError):
+    utils = None
+
+# one full read for each chromosome, followed by extra_reads, a list of (chromosome, flag, 1 based position, CIGAR,
+# sequence) sorted by position
+def create_bam(dir_path, chromosomes, sequence, file_name='single.bam', extra_reads=()):
     # create a sam file, based on instructions at http://genome.ucsc.edu/goldenPath/help/bam.html
     # and http://samtools.github.io/hts-specs/SAMv1.pdf
     sam_file_path = os.path.join(dir_path, 'single.sam') 
@@ -34,6 +54,11 @@ def create_bam(dir_path, chromosomes, sequence, file_name='single.bam'):
             #               |      |   |   |  |    |    |  |  |  |   QUAL           
             #               |      |   |   |  |    |    |  |  |  |   |   distance to ref
             sam_file.write('read1\t16\t%s\t1\t255\t50M\t*\t0\t0\t%s\t%s\tNM:i:0\n' % (chromosome, sequence, qual))
+            for i, (read_chromosome, flag, pos, cigar, read_sequence) in enumerate(extra_reads):
+                if read_chromosome == chromosome:
+                    read_qual = '*' if read_sequence == '*' else qual[:len(read_sequence)]
+                    sam_file.write('extra%d\t%d\t%s\t%d\t255\t%s\t*\t0\t0\t%s\t%s\n'
+                                   % (i, flag, chromosome, pos, cigar, read_sequence, read_qual))
    
     # create bam file
     bam_file_path = os.path.join(dir_path, file_name)
@@ -45,6 +70,52 @@ def create_bam(dir_path, chromosomes, sequence, file_name='single.bam'):
 
     return bam_file_path
 
+# Reads at random positions, a few of them spliced over tens of kilobases, so that the bam file has many BGZF blocks
+# (with records that continue from one block into the next) and fetches have several .bai chunks.
+def create_large_bam(dir_path, chromosome_lengths, reads_per_chromosome, file_name='large.bam', seed=7):
+    rng = random.Random(seed)
+    sam_file_path = os.path.join(dir_path, 'large.sam')
+    with open(sam_file_path, 'w') as sam_file:
+        for chromosome, length in chromosome_lengths:
+            sam_file.write('@SQ\tSN:%s\tLN:%d\n' % (chromosome, length))
+        for chromosome, length in chromosome_lengths:
+            for i, pos in enumerate(sorted(rng.randint(1, length - 50000) for _ in range(reads_per_chromosome))):
+                cigar = '25M40000N25M' if i % 40 == 0 else '50M'
+                sequence = ''.join(rng.choice('ACGT') for _ in range(50))
+                sam_file.write('%s_%d\t%d\t%s\t%d\t255\t%s\t*\t0\t0\t%s\t%s\n'
+                               % (chromosome, i, rng.choice((0, 16)), chromosome, pos, cigar, sequence, 'I' * 50))
+
+    bam_file_path = os.path.join(dir_path, file_name)
+    subprocess.check_call(['samtools', 'view', '-S', '-b', '-o', bam_file_path, sam_file_path])
+    subprocess.check_call(['samtools', 'index', bam_file_path])
+    return bam_file_path
+
+# Sets the variables in the environment while in the with block, e.g. the BAMLIQUIDATOR_ tunables that the
+# liquidation executables read (see ReadAhead in bamliquidator.cpp).
+class Environment(object):
+    def __init__(self, **variables):
+        self.variables = variables
+
+    def __enter__(self):
+        self.saved = dict((name, os.environ.get(name)) for name in self.variables)
+        os.environ.update(self.variables)
+        return self
+
+    def __exit__(self, *exc_info):
+        for name, value in self.saved.items():
+            if value is None:
+                os.environ.pop(name, None)
+            else:
+                os.environ[name] = value
+
+# every fetch with bam_fetch, every fetch with the BlockReader (with a deep and a shallow read ahead queue), and every
+# fetch from a memory mapped bam file
+fetch_environments = [{'BAMLIQUIDATOR_PARALLEL_FETCH': '1000000000'},
+                      {'BAMLIQUIDATOR_PARALLEL_FETCH': '0'},
+                      {'BAMLIQUIDATOR_PARALLEL_FETCH': '0', 'BAMLIQUIDATOR_READ_AHEAD_BLOCKS': '2',
+                       'BAMLIQUIDATOR_READ_SIZE': '64'},
+                      {'BAMLIQUIDATOR_MMAP': '1'}]
+
 def create_single_region_gff_file(dir_path, chromosome, start, stop, strand='.', file_name = 'single.gff', region_name='region1'):
     region_file_path = os.path.join(dir_path, file_name) 
     with open(region_file_path, 'w') as region_file:
@@ -95,6 +166,189 @@ class SingleFullReadBamTest(TempDirTest):
                                            bam_file_path = self.bam_file_path)
             liquidator.batch(extension = 0, sense = '.')
 
+    def test_bin_liquidation_multiple_senses(self):
+        liquidator = blb.BinLiquidator(bin_size = len(self.sequence),
+                                       output_directory = os.path.join(self.dir_path, 'output'),
+                                       bam_file_path = self.bam_file_path,
+                                       extension = [0, 10],
+                                       sense = ['.', '+', '-'])
+
+        with tables.open_file(liquidator.counts_file_path) as counts:
+            # the single read is on the reverse strand (flag 16) at the start of the chromosome,
+            # so extending it doesn't change the count
+            expected_counts = {'bin_counts'             : len(self.sequence),
+                               'bin_counts_both_10'     : len(self.sequence),
+                               'bin_counts_forward_0'   : 0,
+                               'bin_counts_forward_10'  : 0,
+                               'bin_counts_reverse_0'   : len(self.sequence),
+                               'bin_counts_reverse_10'  : len(self.sequence)}
+            for table_name, expected_count in expected_counts.items():
+                table = counts.get_node("/", table_name)
+                self.assertEqual(1, len(table))
+                self.assertEqual(expected_count, table[0]['count'])
+
+    def test_bin_liquidation_multiple_bin_sizes(self):
+        liquidator = blb.BinLiquidator(bin_size = [10, 50, 25],
+                                       output_directory = os.path.join(self.dir_path, 'output'),
+                                       bam_file_path = self.bam_file_path,
+                                       extension = [0, 10])
+
+        with tables.open_file(liquidator.counts_file_path) as counts:
+            # the single read covers the whole 50 base pair chromosome
+            expected_counts = {'bin_counts'            : [10] * 5,
+                               'bin_counts_both_10'    : [10] * 5,
+                               'bin_counts_50'         : [50],
+                               'bin_counts_50_both_10' : [50],
+                               'bin_counts_25'         : [25, 25],
+                               'bin_counts_25_both_10' : [25, 25]}
+            for table_name, expected in expected_counts.items():
+                table = counts.get_node("/", table_name)
+                self.assertEqual(list(range(len(expected))), [row['bin_number'] for row in table])
+                self.assertEqual(expected, [row['count'] for row in table])
+
+        with self.assertRaises(Exception):
+            blb.BinLiquidator(bin_size = [10, 25],
+                              output_directory = os.path.join(self.dir_path, 'output2'),
+                              bam_file_path = self.bam_file_path)
+
+    def test_compact_bin_liquidation(self):
+        liquidator = blb.BinLiquidator(bin_size = len(self.sequence),
+                                       output_directory = os.path.join(self.dir_path, 'output'),
+                                       bam_file_path = self.bam_file_path,
+                                       compact = True)
+        liquidator.flatten()
+
+        with tables.open_file(liquidator.counts_file_path) as counts:
+            self.assertTrue('chromosome_key' in counts.root.bin_counts.colnames)
+
+            bin_counts = blb.nps.counts_table(counts, 'bin_counts')
+            self.assertEqual(1, bin_counts.nrows)
+            records = list(bin_counts.where("chromosome == '%s'" % self.chromosome))
+            self.assertEqual(1, len(records))
+            self.assertEqual(self.chromosome, records[0]['chromosome'].decode())
+            self.assertEqual(len(self.sequence), records[0]['count'])
+
+            self.assertEqual(1, len(counts.root.normalized_counts.read_where("file_key == 1")))
+
+    def test_sparse_bin_liquidation(self):
+        output_directory = os.path.join(self.dir_path, 'output')
+        # the single read is on the reverse strand, so every forward bin is zero
+        liquidator = blb.BinLiquidator(bin_size = 10,
+                                       output_directory = output_directory,
+                                       bam_file_path = self.bam_file_path,
+                                       sense = '+',
+                                       sparse = True)
+        liquidator.flatten()
+
+        with tables.open_file(liquidator.counts_file_path) as counts:
+            # only the last bin of the chromosome is stored
+            self.assertEqual(1, len(counts.root.bin_counts))
+            self.assertEqual(4, counts.root.bin_counts[0]['bin_number'])
+            self.assertEqual(0, counts.root.bin_counts[0]['count'])
+
+        with open(os.path.join(output_directory, 'bin_counts_chr1.tab')) as tab_file:
+            lines = tab_file.readlines()
+            self.assertEqual(6, len(lines)) # the header and all 5 bins
+            self.assertEqual(['0', '1', '2', '3', '4'], [line.split('\t')[0] for line in lines[1:]])
+            self.assertEqual(['0'] * 5, [line.split('\t')[2] for line in lines[1:]])
+
+    def test_compact_region_liquidation(self):
+        regions_file_path = create_single_region_gff_file(self.dir_path, self.chromosome, 1, 8)
+        liquidator = blb.RegionLiquidator(regions_file = regions_file_path,
+                                          output_directory = os.path.join(self.dir_path, 'output'),
+                                          bam_file_path = self.bam_file_path,
+                                          compact = True)
+
+        matrix_path = os.path.join(self.dir_path, 'matrix.gff')
+        blb.write_bamToGff_matrix(matrix_path, liquidator.counts_file_path)
+
+        with tables.open_file(liquidator.counts_file_path) as counts:
+            record = list(blb.nps.counts_table(counts, 'region_counts'))[0]
+            self.assertEqual(self.chromosome, record['chromosome'].decode())
+            self.assertEqual(7, record['count'])
+            self.assertEqual(1000000.0, record['normalized_count'])
+
+        with open(matrix_path, 'r') as matrix_file:
+            self.assertEqual('chr1(.):1-8', matrix_file.readlines()[1].split('\t')[1])
+
+    def test_coverage_index(self):
+        regions_file_path = create_single_region_gff_file(self.dir_path, self.chromosome, 1, 8)
+        liquidator = blb.RegionLiquidator(regions_file = regions_file_path,
+                                          output_directory = os.path.join(self.dir_path, 'output'),
+                                          bam_file_path = self.bam_file_path,
+                                          extension = [0, 20],
+                                          coverage_index = True)
+        self.assertTrue(os.path.isfile(self.bam_file_path + '.coverage'))
+
+        with tables.open_file(liquidator.counts_file_path) as counts:
+            self.assertEqual(7, counts.root.region_counts[0]['count'])
+            # the read is on the reverse strand at the start of the chromosome, so extending it changes nothing
+            self.assertEqual(7, counts.root.region_counts_default_20[0]['count'])
+
+        bin_liquidator = blb.BinLiquidator(bin_size = 10,
+                                           output_directory = os.path.join(self.dir_path, 'bin_output'),
+                                           bam_file_path = self.bam_file_path,
+                                           coverage_index = True)
+        with tables.open_file(bin_liquidator.counts_file_path) as counts:
+            self.assertEqual([10] * 5, [row['count'] for row in counts.root.bin_counts])
+
+    def test_cache(self):
+        regions_file_path = create_single_region_gff_file(self.dir_path, self.chromosome, 1, 8)
+        cache_directory = os.path.join(self.dir_path, 'cache')
+
+        def cache_entries():
+            return [name for name in os.listdir(cache_directory) if name.endswith('.counts')]
+
+        for run in range(2):
+            liquidator = blb.RegionLiquidator(regions_file = regions_file_path,
+                                              output_directory = os.path.join(self.dir_path, 'output_%d' % run),
+                                              bam_file_path = self.bam_file_path,
+                                              extension = [0, 20],
+                                              cache_directory = cache_directory)
+            with tables.open_file(liquidator.counts_file_path) as counts:
+                self.assertEqual(7, counts.root.region_counts[0]['count'])
+                self.assertEqual(7, counts.root.region_counts_default_20[0]['count'])
+            # the second run reads the first run's entry instead of adding another
+            self.assertEqual(1, len(cache_entries()))
+
+        for run in range(2):
+            bin_liquidator = blb.BinLiquidator(bin_size = 10,
+                                               output_directory = os.path.join(self.dir_path, 'bin_output_%d' % run),
+                                               bam_file_path = self.bam_file_path,
+                                               cache_directory = cache_directory)
+            with tables.open_file(bin_liquidator.counts_file_path) as counts:
+                self.assertEqual([10] * 5, [row['count'] for row in counts.root.bin_counts])
+            self.assertEqual(2, len(cache_entries()))
+
+        # a cache size of 0 evicts every entry, including the new one
+        blb.BinLiquidator(bin_size = 20,
+                          output_directory = os.path.join(self.dir_path, 'evicting_output'),
+                          bam_file_path = self.bam_file_path,
+                          cache_directory = cache_directory,
+                          cache_size = 0)
+        self.assertEqual(0, len(cache_entries()))
+
+    def test_region_liquidation_in_batches(self):
+        regions = [(1, 8), (10, 30), (2, 4), (5, 60), (20, 50)]
+        regions_file_path = os.path.join(self.dir_path, 'regions.gff')
+        with open(regions_file_path, 'w') as region_file:
+            for i, (start, stop) in enumerate(regions):
+                region_file.write('%s\tregion%d\t\t%d\t%d\t\t.\t\t\n' % (self.chromosome, i, start, stop))
+
+        liquidator = blb.RegionLiquidator(regions_file = regions_file_path,
+                                          output_directory = os.path.join(self.dir_path, 'output'),
+                                          bam_file_path = self.bam_file_path,
+                                          extension = [0, 20],
+                                          region_batch_size = 2)
+
+        with tables.open_file(liquidator.counts_file_path) as counts:
+            # region3 extends past the end of the chromosome, so it is excluded, and the rest keep their file order
+            # across batches
+            for table in (counts.root.region_counts, counts.root.region_counts_default_20):
+                self.assertEqual(['region0', 'region1', 'region2', 'region4'],
+                                 [row['region_name'].decode() for row in table])
+                self.assertEqual([7, 20, 2, 30], [row['count'] for row in table])
+
     def test_region_liquidation(self):
         start = 1
         stop  = 8
@@ -374,6 +628,311 @@ class SingleFullReadBamTest(TempDirTest):
                                                  output_directory = os.path.join(self.dir_path, 'region_output'),
                                                  bam_file_path = self.bam_file_path)
     
+# the same tests, with every fetch read from a memory mapped bam file instead of with bam_fetch
+class MemoryMappedSingleFullReadBamTest(SingleFullReadBamTest):
+    def setUp(self):
+        super(MemoryMappedSingleFullReadBamTest, self).setUp()
+        self.environment = Environment(BAMLIQUIDATOR_MMAP='1').__enter__()
+
+    def tearDown(self):
+        self.environment.__exit__()
+        super(MemoryMappedSingleFullReadBamTest, self).tearDown()
+
+class CigarOperationsTest(TempDirTest):
+    def setUp(self):
+        super(CigarOperationsTest, self).setUp()
+        self.chromosome = 'chr1'
+        self.sequence = 'ATTTAAAAATTAATTTAATGCTTGGCTAAATCTTAATTACATATATAATT'
+        # only M, D and N operations count towards a read's length, so the = read and the read without a cigar
+        # count 0 in every bin, and the read with an X counts [10, 30)
+        extra_reads = [(self.chromosome, 0, 5, '*', '*'),
+                       (self.chromosome, 0, 11, '10M5X10M', self.sequence[10:35]),
+                       (self.chromosome, 16, 21, '20=', self.sequence[20:40])]
+        self.bam_file_path = create_bam(self.dir_path, [self.chromosome], self.sequence, extra_reads=extra_reads)
+
+    def test_bin_liquidation(self):
+        for i, environment in enumerate(fetch_environments):
+            with Environment(**environment):
+                liquidator = blb.BinLiquidator(bin_size = 10,
+                                               output_directory = os.path.join(self.dir_path, 'output%d' % i),
+                                               bam_file_path = self.bam_file_path,
+                                               skip_plot = True)
+            with tables.open_file(liquidator.counts_file_path) as counts:
+                self.assertEqual([10, 20, 20, 10, 10], [row['count'] for row in counts.root.bin_counts])
+
+    def test_region_liquidation(self):
+        regions_file_path = os.path.join(self.dir_path, 'regions.gff')
+        with open(regions_file_path, 'w') as region_file:
+            for i, (start, stop) in enumerate([(1, 8), (10, 30), (25, 45)]):
+                region_file.write('%s\tregion%d\t\t%d\t%d\t\t.\t\t\n' % (self.chromosome, i, start, stop))
+
+        for i, environment in enumerate(fetch_environments):
+            with Environment(**environment):
+                liquidator = blb.RegionLiquidator(regions_file = regions_file_path,
+                                                  output_directory = os.path.join(self.dir_path, 'output%d' % i),
+                                                  bam_file_path = self.bam_file_path)
+            with tables.open_file(liquidator.counts_file_path) as counts:
+                self.assertEqual([7, 40, 25], [row['count'] for row in counts.root.region_counts])
+
+class LargeBamTest(TempDirTest):
+    def setUp(self):
+        super(LargeBamTest, self).setUp()
+        self.chromosome_lengths = [('chr1', 3000000), ('chr2', 1000000)]
+        self.bam_file_path = create_large_bam(self.dir_path, self.chromosome_lengths, 30000)
+
+    # each fetch environment gives the same counts as bam_fetch
+    def test_bin_liquidation(self):
+        results = []
+        for i, environment in enumerate(fetch_environments):
+            with Environment(**environment):
+                liquidator = blb.BinLiquidator(bin_size = [1000, 100000],
+                                               output_directory = os.path.join(self.dir_path, 'output%d' % i),
+                                               bam_file_path = self.bam_file_path,
+                                               extension = [0, 200],
+                                               sense = ['.', '+'],
+                                               skip_plot = True)
+            with tables.open_file(liquidator.counts_file_path) as counts:
+                results.append(dict((table.name, [(row['chromosome'], row['bin_number'], row['count'])
+                                                  for row in table])
+                                    for table in counts.list_nodes('/', classname='Table')
+                                    if table.name.startswith('bin_counts')))
+
+        self.assertEqual(4 * 2, len(results[0]))
+        self.assertTrue(sum(count for _, _, count in results[0]['bin_counts']) > 0)
+        for result in results[1:]:
+            self.assertEqual(results[0], result)
+
+    # Regions in the middle of the chromosomes, which end fetches before the end of their chunks, and skip between
+    # the chunks of the spliced reads' bins and the rest.
+    def create_regions_file(self, strands='.'):
+        rng = random.Random(11)
+        regions_file_path = os.path.join(self.dir_path, 'regions.gff')
+        with open(regions_file_path, 'w') as region_file:
+            for i in range(300):
+                chromosome, length = rng.choice(self.chromosome_lengths)
+                start = rng.randint(1, length - 60000)
+                region_file.write('%s\tregion%d\t\t%d\t%d\t\t%s\t\t\n'
+                                  % (chromosome, i, start, start + rng.choice((100, 5000, 20000, 60000)),
+                                     rng.choice(strands)))
+        return regions_file_path
+
+    def test_region_liquidation(self):
+        regions_file_path = self.create_regions_file()
+
+        results = []
+        for i, environment in enumerate(fetch_environments):
+            with Environment(**environment):
+                liquidator = blb.RegionLiquidator(regions_file = regions_file_path,
+                                                  output_directory = os.path.join(self.dir_path, 'output%d' % i),
+                                                  bam_file_path = self.bam_file_path,
+                                                  extension = [0, 200])
+            with tables.open_file(liquidator.counts_file_path) as counts:
+                results.append([[(row['region_name'], row['count']) for row in table]
+                                for table in (counts.root.region_counts, counts.root.region_counts_default_200)])
+
+        self.assertEqual(300, len(results[0][0]))
+        self.assertTrue(sum(count for _, count in results[0][0]) > 0)
+        for result in results[1:]:
+            self.assertEqual(results[0], result)
+
+    # The counts with a coverage index are the same as without one, for every strand, extension and number of
+    # summary points, and the index is only used while it is up to date with the bam file.
+    def test_coverage_index(self):
+        regions_file_path = self.create_regions_file('+-.')
+        executable = os.path.join(os.path.dirname(os.path.dirname(os.path.realpath(__file__))), 'bamliquidator')
+        queries = [('chr1', 0, 3000000, '.', 7, 0),
+                   ('chr1', 1000, 250000, '+', 5, 200),
+                   ('chr2', 12345, 950000, '-', 3, 50)]
+
+        # the bin and region counts tables, whether bamliquidator_bins and bamliquidator_regions logged that they
+        # counted from the coverage index, and the summary points of each query
+        def liquidate(name, coverage_index):
+            bin_liquidator = blb.BinLiquidator(bin_size = [1000, 100000],
+                                               output_directory = os.path.join(self.dir_path, name, 'bins'),
+                                               bam_file_path = self.bam_file_path,
+                                               extension = [0, 200],
+                                               sense = ['.', '+', '-'],
+                                               skip_plot = True,
+                                               coverage_index = coverage_index)
+            region_liquidator = blb.RegionLiquidator(regions_file = regions_file_path,
+                                                     output_directory = os.path.join(self.dir_path, name, 'regions'),
+                                                     bam_file_path = self.bam_file_path,
+                                                     extension = [0, 200],
+                                                     sense = ['_', '.', '+', '-'],
+                                                     coverage_index = coverage_index)
+            counts = {}
+            used = []
+            for liquidator in (bin_liquidator, region_liquidator):
+                with tables.open_file(liquidator.counts_file_path) as counts_file:
+                    for table in counts_file.list_nodes('/', classname='Table'):
+                        if table.name.startswith('bin_counts'):
+                            counts[table.name] = [(row['chromosome'], row['bin_number'], row['count']) for row in table]
+                        elif table.name.startswith('region_counts'):
+                            counts[table.name] = [(row['region_name'], row['count']) for row in table]
+                with open(os.path.join(liquidator.output_directory, 'log.txt')) as log_file:
+                    used.append(any('from its coverage index' in line for line in log_file))
+            points = [subprocess.check_output([executable, self.bam_file_path] + [str(arg) for arg in query])
+                      for query in queries]
+            return counts, used, points
+
+        without_index = liquidate('without_index', False)
+        self.assertFalse(os.path.isfile(self.bam_file_path + '.coverage'))
+        self.assertEqual(6 * 2 + 4 * 2, len(without_index[0]))
+        self.assertEqual([False, False], without_index[1])
+        self.assertEqual([7, 5, 3], [len(points.split()) for points in without_index[2]])
+
+        self.assertEqual((without_index[0], [True, True], without_index[2]), liquidate('with_index', True))
+
+        # once the bam file is modified, the index is out of date, so the bam file is read instead
+        bam_stat = os.stat(self.bam_file_path)
+        os.utime(self.bam_file_path, (bam_stat.st_atime, bam_stat.st_mtime + 100))
+        self.assertEqual((without_index[0], [False, False], without_index[2]), liquidate('modified', False))
+
+        # and a liquidation with coverage_index rebuilds it
+        self.assertEqual((without_index[0], [True, True], without_index[2]), liquidate('rebuilt', True))
+
+# the previous line by line parser of the region file (getline and boost::split), and the chunked parser with its
+# usual 4 MiB chunks, with a chunk per line, and with chunks of a few lines
+region_parser_environments = [{'BAMLIQUIDATOR_REGION_LINE_PARSER': '1'},
+                              {},
+                              {'BAMLIQUIDATOR_REGION_CHUNK_BYTES': '0'},
+                              {'BAMLIQUIDATOR_REGION_CHUNK_BYTES': '100'}]
+
+class RegionParserTest(TempDirTest):
+    def setUp(self):
+        super(RegionParserTest, self).setUp()
+        self.chromosome_lengths = dict([('chr1', 300000), ('chr2', 100000)])
+        self.bam_file_path = create_large_bam(self.dir_path, sorted(self.chromosome_lengths.items()), 2000)
+        self.runs = 0
+
+    # Liquidates the region lines with each parser, and checks that every parser gives the same region counts and
+    # logs the same warnings and errors.  Returns the region counts (or None if liquidation failed) and the logged
+    # warnings and errors without their timestamps.
+    def liquidate(self, lines, region_format='gff', **kwargs):
+        regions_file_path = os.path.join(self.dir_path, 'regions.' + region_format)
+        with open(regions_file_path, 'wb') as region_file:
+            region_file.write(''.join(lines).encode())
+
+        results = []
+        for environment in region_parser_environments:
+            self.runs += 1
+            output_directory = os.path.join(self.dir_path, 'output%d' % self.runs)
+            region_counts = None
+            with Environment(**environment):
+                try:
+                    liquidator = blb.RegionLiquidator(regions_file = regions_file_path,
+                                                      output_directory = output_directory,
+                                                      bam_file_path = self.bam_file_path,
+                                                      include_cpp_warnings_in_stderr = False,
+                                                      **kwargs)
+                    with tables.open_file(liquidator.counts_file_path) as counts:
+                        region_counts = [(row['chromosome'].decode(), row['region_name'].decode(), row['start'],
+                                          row['stop'], row['strand'].decode(), row['count'])
+                                         for row in counts.root.region_counts]
+                except Exception:
+                    pass
+            # read as bytes, since a logged column may hold the carriage return of a CRLF line
+            with open(os.path.join(output_directory, 'log.txt'), 'rb') as log_file:
+                logged = [line.split(' ', 2)[2] for line in log_file.read().decode().split('\n')
+                          if ' WARNING\t' in line or ' ERROR\t' in line]
+            results.append((region_counts, logged))
+
+        for result in results[1:]:
+            self.assertEqual(results[0], result)
+        return results[0]
+
+    # A region file of many chunks, with invalid and missing chromosomes, regions past the end of the chromosome,
+    # over-long names, signed and swapped positions, missing optional columns and CRLF lines.
+    def test_multi_chunk_file(self):
+        rng = random.Random(5)
+        lines = []
+        expected_regions = []
+        expected_warnings = []
+        for line_number in range(1, 2001):
+            chromosome = rng.choice(['chr1', 'chr2', 'chr1', 'chr2', 'chr3', ''])
+            name = 'region%d' % line_number + 'x' * rng.choice([0, 0, 0, 56, 57, 100])
+            start, stop = sorted((rng.randint(0, 320000), rng.randint(0, 320000)))
+            start_column = rng.choice(['%d', '+%d', '%d']) % start
+            columns = [chromosome, name, '', start_column, str(stop), '', rng.choice('+-.'), '', '']
+            if rng.random() < 0.5:
+                columns[3], columns[4] = columns[4], columns[3]
+            columns = columns[:rng.choice([7, 8, 9])]
+            lines.append('\t'.join(columns) + ('\r\n' if len(columns) > 7 and rng.random() < 0.2 else '\n'))
+
+            truncated = name[:63]
+            if len(name) >= 64:
+                expected_warnings.append("WARNING\tTruncated region on line %d from '%s' to '%s'"
+                                         % (line_number, name, truncated))
+            if stop <= self.chromosome_lengths.get(chromosome, -1):
+                expected_regions.append((chromosome, truncated, start, stop, '.'))
+            else:
+                expected_warnings.append("WARNING\tExcluding invalid region on line %d: bam file key 1 %s %s %d -> %d . 0"
+                                         % (line_number, chromosome, truncated, start, stop))
+
+        region_counts, logged = self.liquidate(lines)
+        self.assertEqual(expected_regions, [region[:5] for region in region_counts])
+        self.assertEqual(expected_warnings, logged)
+        self.assertTrue(sum(region[5] for region in region_counts) > 0)
+
+        # streaming the region file a batch at a time gives the same counts and warnings
+        self.assertEqual((region_counts, logged), self.liquidate(lines, region_batch_size = 300))
+
+        # the same regions in a bed file, with the carriage return of the CRLF lines in an unparsed column
+        bed_lines = ['%s\t%d\t%d\tregion%d\t0\t+\t%d\t%d%s'
+                     % (region[0], region[2], region[3], i, region[2], region[3], '\r\n' if i % 7 else '\n')
+                     for i, region in enumerate(region_counts)]
+        bed_counts, logged = self.liquidate(bed_lines, 'bed')
+        self.assertEqual([], logged)
+        self.assertEqual([region[2:4] + region[5:] for region in region_counts],
+                         [region[2:4] + region[5:] for region in bed_counts])
+
+    # An error on a line in a later chunk stops liquidation, logging the warnings of the lines before it, and the
+    # error with the line number of the bad line.
+    def test_errors(self):
+        lines = ['chr1\tregion%d\t\t%d\t%d\t\t.\n' % (i, 100 * i, 100 * i + 50) for i in range(1, 501)]
+        lines[99] = 'chr9' + lines[99][4:]
+        excluded = 'WARNING\tExcluding invalid region on line 100: bam file key 1 chr9 region100 10000 -> 10050 . 0'
+        bad_number = 'bad lexical cast: source type value could not be interpreted as target'
+        not_enough_columns = "Not enough columns parsing line 451 'chr1\tregion\t\t1\t2\t' of %s"
+        for bad_line, error in [('chr1\tregion\t\t1\t2\t\n', not_enough_columns),
+                                ('\n', "Not enough columns parsing line 451 '' of %s"),
+                                ('chr1\tregion\t\t1\t2\t\t++\n', "error parsing strand: '++' on line 451"),
+                                ('chr1\tregion\t\t1\t2\t\t\n', "error parsing strand: '' on line 451"),
+                                # the carriage return of a CRLF line is part of its last column
+                                ('chr1\tregion\t\t1\t2\t\t+\r\n', "error parsing strand: '+\r' on line 451"),
+                                ('chr1\tregion\t\t12x\t20\t\t+\n', bad_number),
+                                ('chr1\tregion\t\t 12\t20\t\t+\n', bad_number),
+                                ('chr1\tregion\t\t\t20\t\t+\n', bad_number),
+                                ('chr1\tregion\t\t+\t20\t\t+\n', bad_number),
+                                ('chr1\tregion\t\t-\t20\t\t+\n', bad_number),
+                                ('chr1\tregion\t\t+-12\t20\t\t+\n', bad_number),
+                                ('chr1\tregion\t\t18446744073709551616\t20\t\t+\n', bad_number),
+                                ('chr1\tregion\t\t99999999999999999999\t20\t\t+\n', bad_number)]:
+            region_counts, logged = self.liquidate(lines[:450] + [bad_line] + lines[450:])
+            self.assertEqual(None, region_counts)
+            self.assertEqual([excluded, 'ERROR\tUnhandled exception: ' + (error % os.path.join(self.dir_path, 'regions.gff')
+                                                                          if '%s' in error else error)], logged)
+
+        # a CRLF bed line with only the required columns has a carriage return in its stop column
+        _, logged = self.liquidate(['chr1\t1\t2\r\n'], 'bed')
+        self.assertEqual(['ERROR\tUnhandled exception: ' + bad_number], logged)
+
+    # positions are parsed like boost::lexical_cast<uint64_t>, where a + is ignored and a - wraps around
+    def test_signed_and_large_numbers(self):
+        lines = ['chr1\tplus\t\t+10\t+20\t\t.\n',
+                 'chr1\tminus_zero\t\t-0\t20\t\t.\n',
+                 'chr1\tminus\t\t-10\t20\t\t.\n',
+                 'chr1\tmax\t\t10\t18446744073709551615\t\t.\n',
+                 'chr1\tleading_zeros\t\t0010\t00020\t\t.\n']
+        region_counts, logged = self.liquidate(lines)
+        self.assertEqual([('chr1', 'plus', 10, 20), ('chr1', 'minus_zero', 0, 20), ('chr1', 'leading_zeros', 10, 20)],
+                         [region[:4] for region in region_counts])
+        self.assertEqual(['WARNING\tExcluding invalid region on line 3: bam file key 1 chr1 minus 20 -> %d . 0'
+                          % (2**64 - 10),
+                          'WARNING\tExcluding invalid region on line 4: bam file key 1 chr1 max 10 -> %d . 0'
+                          % (2**64 - 1)],
+                         logged)
+
 class MultipleChromosomeTest(TempDirTest):
     def testBinLiquidation(self):
         chromosomes = ['chr1', 'chr2']
@@ -452,6 +1011,16 @@ class MultipleChromosomeTest(TempDirTest):
                 self.assertEqual(chromosome, record['chromosome'].decode())
                 self.assertEqual(len(sequence), record['count']) # count represents how many base pair reads 
 
+# the same tests, with every fetch read from a memory mapped bam file instead of with bam_fetch
+class MemoryMappedMultipleChromosomeTest(MultipleChromosomeTest):
+    def setUp(self):
+        super(MemoryMappedMultipleChromosomeTest, self).setUp()
+        self.environment = Environment(BAMLIQUIDATOR_MMAP='1').__enter__()
+
+    def tearDown(self):
+        self.environment.__exit__()
+        super(MemoryMappedMultipleChromosomeTest, self).tearDown()
+
 class AppendingTest(TempDirTest):
     def setUp(self):
         super(AppendingTest, self).setUp()
@@ -488,6 +1057,59 @@ class AppendingTest(TempDirTest):
                 self.assertEqual(str(together_h5.root.summary[:]), str(appending_h5.root.summary[:]))
                 self.assertEqual(str(together_h5.root.sorted_summary[:]), str(appending_h5.root.sorted_summary[:]))
 
+# Two lines of one cell type and a line of another, with so few reads that most of the 1 kbp bins are empty, and
+# so are missing from the sparse tables.
+class SparseSummaryTest(TempDirTest):
+    def setUp(self):
+        super(SparseSummaryTest, self).setUp()
+        chromosome_lengths = [('chr1', 300000), ('chr2', 100000)]
+        self.cell_type_dir_paths = []
+        for cell_type, seeds in (('cell_type_a', (1, 2)), ('cell_type_b', (3,))):
+            cell_type_dir_path = os.path.join(self.dir_path, cell_type)
+            os.mkdir(cell_type_dir_path)
+            for seed in seeds:
+                create_large_bam(cell_type_dir_path, chromosome_lengths, 40, 'line%d.bam' % seed, seed)
+            self.cell_type_dir_paths.append(cell_type_dir_path)
+
+    # the flattened summary rows of each chromosome, with the cell types appended one run at a time
+    def flattened_summary(self, sparse):
+        output_directory = os.path.join(self.dir_path, 'sparse' if sparse else 'dense')
+        counts_file_path = None
+        for cell_type_dir_path in self.cell_type_dir_paths:
+            liquidator = blb.BinLiquidator(bin_size = 1000,
+                                           output_directory = output_directory,
+                                           bam_file_path = cell_type_dir_path,
+                                           counts_file_path = counts_file_path,
+                                           skip_plot = True,
+                                           sparse = sparse)
+            counts_file_path = liquidator.counts_file_path
+        liquidator.flatten()
+
+        summary = {}
+        for chromosome in ('chr1', 'chr2'):
+            with open(os.path.join(output_directory, 'summary_%s.tab' % chromosome)) as tab_file:
+                summary[chromosome] = [line.rstrip('\r\n').split('\t') for line in tab_file]
+        return summary
+
+    def test_dense_and_sparse_summaries_match(self):
+        dense = self.flattened_summary(sparse = False)
+        sparse = self.flattened_summary(sparse = True)
+
+        with tables.open_file(os.path.join(self.dir_path, 'sparse', 'counts.h5')) as counts:
+            # most bins of the two cell types and three lines really are missing from the sparse counts
+            self.assertTrue(len(counts.root.normalized_counts) < (2 + 3) * (300 + 100) / 2)
+
+        for chromosome, bins in (('chr1', 300), ('chr2', 100)):
+            header = dense[chromosome][0]
+            self.assertEqual(header, sparse[chromosome][0])
+            self.assertEqual(1 + bins, len(dense[chromosome]))
+            self.assertEqual(len(dense[chromosome]), len(sparse[chromosome]))
+            average_column = header.index('avg_cell_type_percentile')
+            for dense_row, sparse_row in zip(dense[chromosome][1:], sparse[chromosome][1:]):
+                self.assertAlmostEqual(float(dense_row[average_column]), float(sparse_row[average_column]))
+                del dense_row[average_column], sparse_row[average_column]
+                self.assertEqual(dense_row, sparse_row)
+
 class LiquidateBamInDifferentDirectories(unittest.TestCase):
     def setUp(self):
         self.dir_before = os.getcwd()
@@ -549,6 +1171,152 @@ class LiquidateBamInDifferentDirectories(unittest.TestCase):
             self.assertEqual(len(self.sequence), record['count']) # count represents how many base pair reads 
                                                                   # intersected the bin
 
+@unittest.skipIf(bamliquidator_native is None, 'bamliquidator_native is not built')
+class NativeLiquidatorTest(TempDirTest):
+    def setUp(self):
+        super(NativeLiquidatorTest, self).setUp()
+        self.chromosome = 'chr1'
+        self.sequence = 'ATTTAAAAATTAATTTAATGCTTGGCTAAATCTTAATTACATATATAATT'
+        self.liquidator = bamliquidator_native.BamLiquidator(create_bam(self.dir_path, [self.chromosome], self.sequence))
+
+    def test_liquidate(self):
+        counts = self.liquidator.liquidate(self.chromosome, numpy.array([0, 10, 45]), numpy.array([50, 20, 100]))
+        self.assertEqual(numpy.uint64, counts.dtype)
+        self.assertEqual([[50], [10], [5]], counts.tolist())
+
+    def test_strand_and_summary_points(self):
+        self.assertEqual([[0, 0]], self.liquidator.liquidate(self.chromosome, [0], [50], '+', 2).tolist())
+        self.assertEqual([[25, 25]], self.liquidator.liquidate(self.chromosome, [0], [50], '-', 2).tolist())
+
+    # ctypes arrays export '<' formats, whose letters have standard sizes (e.g. '<l' is 4 bytes, although some
+    # Python versions also report an 8 byte c_long as '<l'), so the size of each integer has to come from itemsize
+    def test_buffer_formats(self):
+        for integer_type in (ctypes.c_int8, ctypes.c_uint16, ctypes.c_int32, ctypes.c_long, ctypes.c_int64,
+                             ctypes.c_uint64):
+            starts = memoryview((integer_type * 3)(0, 10, 45))
+            stops = memoryview((integer_type * 3)(50, 20, 100))
+            self.assertEqual('<', starts.format[0])
+            self.assertEqual([[50], [10], [5]], self.liquidator.liquidate(self.chromosome, starts, stops).tolist())
+
+        floats = memoryview((ctypes.c_double * 1)(0))
+        self.assertRaises(TypeError, self.liquidator.liquidate, self.chromosome, floats, [50])
+
+    def test_out(self):
+        out = numpy.zeros((2, 1), dtype=numpy.uint64)
+        self.assertTrue(out is self.liquidator.liquidate(self.chromosome, [0, 40], [10, 60], out=out))
+        self.assertEqual([[10], [10]], out.tolist())
+
+    def test_invalid(self):
+        self.assertRaises(RuntimeError, self.liquidator.liquidate, 'chr2', [0], [50])
+        self.assertRaises(ValueError, self.liquidator.liquidate, self.chromosome, [50], [50])
+        self.assertRaises(ValueError, self.liquidator.liquidate, self.chromosome, [0, 1], [50])
+        for strand in ('x', '', 'forward', '+-'):
+            self.assertRaises(ValueError, self.liquidator.liquidate, self.chromosome, [0], [50], strand)
+        self.assertRaises(IOError, bamliquidator_native.BamLiquidator, os.path.join(self.dir_path, 'missing.bam'))
+
+# A stand in for "bamliquidator --server threads max_open_files", which holds threads queries at a time and then
+# answers them in reverse order, after a response to an id that was never sent.  Each count is the query's length
+# divided by its number of summary points, bam file missing.bam is an ERROR, and bam file exit.bam exits.
+fake_liquidator_server = '''import sys
+batch = int(sys.argv[2])
+queries = []
+for line in iter(sys.stdin.readline, ''):
+    fields = line.rstrip('\\n').split('\\t')
+    if fields[1] == 'exit.bam':
+        sys.exit(1)
+    queries.append(fields)
+    if len(queries) == batch:
+        sys.stdout.write('0\\t1\\n')
+        for query_id, bam_file, chromosome, start, stop, strand, spnum, extension in reversed(queries):
+            if bam_file == 'missing.bam':
+                sys.stdout.write('%s\\tERROR\\tfailed to open %s\\n' % (query_id, bam_file))
+            else:
+                count = (int(stop) - int(start)) // int(spnum)
+                sys.stdout.write('\\t'.join([query_id] + [str(count)] * int(spnum)) + '\\n')
+        sys.stdout.flush()
+        queries = []
+'''
+
+@unittest.skipIf(utils is None, 'utils.py requires Python 2')
+class LiquidatorServerClientTest(TempDirTest):
+    def setUp(self):
+        super(LiquidatorServerClientTest, self).setUp()
+        self.executable = os.path.join(self.dir_path, 'fake_bamliquidator')
+        with open(self.executable, 'w') as executable:
+            executable.write('#!%s\n%s' % (sys.executable, fake_liquidator_server))
+        os.chmod(self.executable, 0o755)
+
+    # liquidates each query on its own thread, returning the counts or exception of each
+    def liquidate_concurrently(self, server, queries):
+        results = [None] * len(queries)
+        def liquidate(i):
+            try:
+                results[i] = server.liquidate(*queries[i])
+            except Exception as e:
+                results[i] = e
+        threads = [threading.Thread(target=liquidate, args=(i,)) for i in range(len(queries))]
+        for thread in threads:
+            thread.start()
+        for thread in threads:
+            # the server only answers once every query is sent, so a client that waits for each response
+            # before sending the next query never finishes
+            thread.join(30)
+            self.assertFalse(thread.is_alive())
+        return results
+
+    def test_out_of_order_responses(self):
+        server = utils.LiquidatorServer(threads=3, executable=self.executable)
+        try:
+            results = self.liquidate_concurrently(server, [('a.bam', 'chr1', 0, 100, '.', 1, 0),
+                                                           ('a.bam', 'chr1', 0, 60, '.', 2, 0),
+                                                           ('missing.bam', 'chr1', 0, 10, '.', 1, 0)])
+            self.assertEqual([100], results[0])
+            self.assertEqual([30, 30], results[1])
+            self.assertTrue(isinstance(results[2], RuntimeError))
+            self.assertTrue('failed to open missing.bam' in str(results[2]))
+
+            # a single query at a time is answered right away
+            server_one = utils.LiquidatorServer(threads=1, executable=self.executable)
+            self.assertEqual([5, 5], server_one.liquidate('a.bam', 'chr1', 10, 20, '+', 2, 200))
+            self.assertRaises(RuntimeError, server_one.liquidate, 'missing.bam', 'chr1', 10, 20)
+            self.assertEqual([7], server_one.liquidate('a.bam', 'chr1', 1, 8))
+            server_one.close()
+        finally:
+            server.close()
+
+    def test_server_exit(self):
+        server = utils.LiquidatorServer(threads=2, executable=self.executable)
+        results = self.liquidate_concurrently(server, [('a.bam', 'chr1', 0, 100, '.', 1, 0),
+                                                       ('exit.bam', 'chr1', 0, 100, '.', 1, 0)])
+        for result in results:
+            self.assertTrue(isinstance(result, RuntimeError))
+            self.assertTrue('exited unexpectedly' in str(result))
+        self.assertRaises(RuntimeError, server.liquidate, 'a.bam', 'chr1', 0, 100)
+        server.close()
+
+    def test_bamliquidator_server(self):
+        executable = os.path.join(os.path.dirname(os.path.dirname(os.path.realpath(__file__))), 'bamliquidator')
+        if not os.path.isfile(executable):
+            self.skipTest('bamliquidator is not built')
+
+        chromosome = 'chr1'
+        bam_file_path = create_bam(self.dir_path, [chromosome], 'ATTTAAAAATTAATTTAATGCTTGGCTAAATCTTAATTACATATATAATT')
+        server = utils.LiquidatorServer(threads=4, executable=executable)
+        try:
+            queries = [(bam_file_path, chromosome, start, stop, '.', 1, 0)
+                       for start, stop in [(0, 50), (10, 20), (45, 100)]] * 10
+            queries.append((bam_file_path, 'chr2', 0, 50, '.', 1, 0))
+            queries.append((os.path.join(self.dir_path, 'missing.bam'), chromosome, 0, 50, '.', 1, 0))
+            results = self.liquidate_concurrently(server, queries)
+            self.assertEqual([[50], [10], [5]] * 10, results[:-2])
+            for result in results[-2:]:
+                self.assertTrue(isinstance(result, RuntimeError))
+            # the single read is on the reverse strand
+            self.assertEqual([0, 0], server.liquidate(bam_file_path, chromosome, 0, 50, '+', 2, 0))
+            self.assertEqual([25, 25], server.liquidate(bam_file_path, chromosome, 0, 50, '-', 2, 0))
+        finally:
+            server.close()
+
 if __name__ == '__main__':
     unittest.main()
 
@@ -57,6 +57,7 @@ from string import join, maketrans
 
 import subprocess
 import datetime
+import threading
 
 from collections import defaultdict
 
@@ -99,6 +100,7 @@ from collections import defaultdict
 
 #6. Bam class
 #class Bam(bamFile) <- a class for handling and manipulating bam objects.  requires samtools
+#class LiquidatorServer() <- a long running bamliquidator process that keeps bam files open between counts
 
 #7. Misc. functions
 #def uniquify(seq, idfun=None):  <- makes a list unique
@@ -1081,6 +1083,79 @@ def convertBitwiseFlag(flag):
     else:
         return "+";
 
+class _ServerQuery:
+    '''a query sent to a LiquidatorServer, answered once its response is read'''
+    def __init__(self):
+        self.answered = threading.Event()
+        self.response = None
+
+class LiquidatorServer:
+    '''A long running "bamliquidator --server" process, which keeps recently used bam files and
+    their indexes open so that counting many loci doesn't pay for reopening the bam each time.
+    Safe to share between threads: each query is sent with its own id, and a reader thread hands
+    each response to the query with that id, so the server answers queries from several threads
+    in parallel and in any order.'''
+    def __init__(self,threads = 1,maxOpenFiles = 64,executable = 'bamliquidator'):
+        self._process = subprocess.Popen([executable,'--server',str(threads),str(maxOpenFiles)],
+                                         stdin = subprocess.PIPE,stdout = subprocess.PIPE)
+        self._lock = threading.Lock()
+        self._nextId = 0
+        self._pending = {}
+        self._error = None
+        self._reader = threading.Thread(target = self._readResponses)
+        self._reader.daemon = True
+        self._reader.start()
+
+    def liquidate(self,bamFile,chrom,start,stop,strand = '.',spnum = 1,extension = 200):
+        '''returns the list of spnum counts, see bamliquidator for the meaning of each argument'''
+        query = _ServerQuery()
+        with self._lock:
+            if self._error is not None:
+                raise RuntimeError(self._error)
+            self._nextId += 1
+            queryId = str(self._nextId)
+            self._pending[queryId] = query
+            try:
+                self._process.stdin.write('\t'.join([queryId,bamFile,chrom,str(start),str(stop),strand,str(spnum),str(extension)]) + '\n')
+                self._process.stdin.flush()
+            except:
+                del self._pending[queryId]
+                raise
+        try:
+            # waiting in short steps lets Python 2 deliver a KeyboardInterrupt
+            while not query.answered.wait(1):
+                pass
+        finally:
+            with self._lock:
+                self._pending.pop(queryId,None)
+        if query.response is None:
+            raise RuntimeError(self._error)
+        if query.response[:1] == ['ERROR']:
+            raise RuntimeError('bamliquidator server error: ' + '\t'.join(query.response[1:]))
+        return [int(count) for count in query.response]
+
+    def _readResponses(self):
+        for line in iter(self._process.stdout.readline,''):
+            fields = line.rstrip('\n').split('\t')
+            # a response to a query that is no longer waiting (e.g. interrupted by a
+            # KeyboardInterrupt) is dropped instead of being taken for a later query's
+            with self._lock:
+                query = self._pending.pop(fields[0],None)
+            if query is not None:
+                query.response = fields[1:]
+                query.answered.set()
+        with self._lock:
+            self._error = 'bamliquidator server exited unexpectedly'
+            unanswered = list(self._pending.values())
+            self._pending = {}
+        for query in unanswered:
+            query.answered.set()
+
+    def close(self):
+        self._process.stdin.close()
+        self._process.wait()
+        self._reader.join()
+
 class Bam:
     '''A class for a sorted and indexed bam file that allows easy analysis of reads'''
     def __init__(self,bamFile):
@@ -1229,7 +1304,11 @@ class Bam:
 
         return len(reads)
 
-    def liquidateLocus(self,locus,sense='.'):
+    def liquidateLocus(self,locus,sense='.',server=None):
+
+           if server is not None:
+               counts = server.liquidate(self._bam,locus.chr(),locus.start(),locus.end(),sense,1,200)
+               return ''.join('%d\n' % count for count in counts)
 
            bamliquidatorCmd = 'bamliquidator %s %s %s %s %s 1 200' % (self._bam, locus.chr(),
                                                                      str(locus.start()), str(locus.end()),